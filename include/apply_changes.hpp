@@ -0,0 +1,9 @@
+#pragma once
+
+/**
+ * Entry point for "osmium-filter apply-changes": Update a filtered
+ * extract with OSM change files, running the filter only on the changed
+ * objects. Called with the command line arguments after "apply-changes".
+ */
+int apply_changes(int argc, char* argv[]);
+
@@ -0,0 +1,429 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#include <osmium/osm/entity_bits.hpp>
+#include <osmium/osm/item_type.hpp>
+
+#include "object_filter.hpp"
+#include "tag_stats.hpp"
+
+/**
+ * Estimates how likely expressions are to be true and how expensive they
+ * are to evaluate, based on TagStats of the input. This is used by
+ * ExprNode::optimize() to order the children of "and" and "or"
+ * expressions and to decide how ID lists are searched.
+ *
+ * Different expressions are assumed to be independent of each other.
+ * Costs are in rough units of one integer comparison, they only have to
+ * be good enough to compare alternatives.
+ */
+class CostModel {
+
+public:
+
+    struct estimate {
+        // Probability that the expression is true for an object of
+        // each type (by nwr index).
+        std::array<double, 3> probability{{0.5, 0.5, 0.5}};
+
+        // Cost of evaluating the expression for an object of each type.
+        std::array<double, 3> cost{{1.0, 1.0, 1.0}};
+    };
+
+private:
+
+    static constexpr const double string_compare_cost = 2.0;
+    static constexpr const double regex_cost = 25.0;
+    static constexpr const double set_lookup_cost = 8.0;
+    static constexpr const double box_cost = 4.0;
+    static constexpr const double polygon_cost = 50.0;
+
+    const TagStats& m_stats;
+
+    // Share of the objects the filter is evaluated on by type.
+    std::array<double, 3> m_weights{{0.0, 0.0, 0.0}};
+    double m_objects = 0.0;
+
+    std::array<double, 3> m_average_tags{{0.0, 0.0, 0.0}};
+    std::array<double, 3> m_average_length{{0.0, 0.0, 0.0}};
+
+    static osmium::item_type type(std::size_t t) noexcept {
+        return osmium::nwr_index_to_item_type(static_cast<unsigned int>(t));
+    }
+
+    static double average(const TagStats::histogram_type& histogram) noexcept {
+        double sum = 0.0;
+        double total = 0.0;
+        for (std::size_t n = 1; n < TagStats::num_buckets; ++n) {
+            const double first = double(std::uint64_t(1) << (n - 1));
+            sum += double(histogram[n]) * (first + (first - 1.0) / 2.0); // middle of bucket
+            total += double(histogram[n]);
+        }
+        return total + double(histogram[0]) > 0.0 ? sum / (total + double(histogram[0])) : 0.0;
+    }
+
+    static bool compare(integer_op_type op, std::int64_t lhs, std::int64_t rhs) noexcept {
+        switch (op) {
+            case integer_op_type::equal:
+                return lhs == rhs;
+            case integer_op_type::not_equal:
+                return lhs != rhs;
+            case integer_op_type::less_than:
+                return lhs < rhs;
+            case integer_op_type::less_or_equal:
+                return lhs <= rhs;
+            case integer_op_type::greater_than:
+                return lhs > rhs;
+            case integer_op_type::greater_or_equal:
+                return lhs >= rhs;
+        }
+        return false;
+    }
+
+    // Share of objects in the histogram for which "value OP rhs" is true.
+    static double histogram_share(const TagStats::histogram_type& histogram, integer_op_type op, std::int64_t rhs) noexcept {
+        const double below = TagStats::fraction_below(histogram, rhs);
+        const double below_or_equal = TagStats::fraction_below(histogram, rhs + 1);
+        switch (op) {
+            case integer_op_type::equal:
+                return below_or_equal - below;
+            case integer_op_type::not_equal:
+                return 1.0 - (below_or_equal - below);
+            case integer_op_type::less_than:
+                return below;
+            case integer_op_type::less_or_equal:
+                return below_or_equal;
+            case integer_op_type::greater_than:
+                return 1.0 - below_or_equal;
+            case integer_op_type::greater_or_equal:
+                return 1.0 - below;
+        }
+        return 0.5;
+    }
+
+    const TagStats::key_stats* key_stats(std::size_t t, const char* key) const {
+        const auto& keys = m_stats(type(t)).keys;
+        const auto it = keys.find(key);
+        return it == keys.end() ? nullptr : &it->second;
+    }
+
+    double key_share(std::size_t t, const char* key) const {
+        const auto objects = m_stats(type(t)).objects;
+        const auto* ks = key_stats(t, key);
+        return (objects == 0 || !ks) ? 0.0 : double(ks->count) / double(objects);
+    }
+
+    // Values not in the list of common values are assumed to be as
+    // common as the least common value in the list.
+    double tag_share(std::size_t t, const char* key, const char* value) const {
+        const auto objects = m_stats(type(t)).objects;
+        const auto* ks = key_stats(t, key);
+        if (objects == 0 || !ks) {
+            return 0.0;
+        }
+        for (const auto& v : ks->values) {
+            if (v.first == value) {
+                return double(v.second) / double(objects);
+            }
+        }
+        auto count = ks->other_values;
+        if (!ks->values.empty()) {
+            count = std::min(count, ks->values.back().second);
+        }
+        return double(count) / double(objects);
+    }
+
+    // Number of tags, nodes, or members of an object of type t.
+    double average_count(expr_node_type count_type, std::size_t t) const noexcept {
+        switch (count_type) {
+            case expr_node_type::tags_expr:
+                return m_average_tags[t];
+            case expr_node_type::nodes_expr:
+                return type(t) == osmium::item_type::way ? m_average_length[t] : 0.0;
+            case expr_node_type::members_expr:
+                return type(t) == osmium::item_type::relation ? m_average_length[t] : 0.0;
+            default:
+                break;
+        }
+        return 0.0;
+    }
+
+    // Does the tags, nodes, or members expression count everything?
+    static bool counts_all(const ExprNode& expr) noexcept {
+        const ExprNode* sub = nullptr;
+        switch (expr.expression_type()) {
+            case expr_node_type::tags_expr:
+                sub = static_cast<const TagsExpr&>(expr).expr();
+                break;
+            case expr_node_type::nodes_expr:
+                sub = static_cast<const NodesExpr&>(expr).expr();
+                break;
+            case expr_node_type::members_expr:
+                sub = static_cast<const MembersExpr&>(expr).expr();
+                break;
+            default:
+                return false;
+        }
+        return sub->expression_type() == expr_node_type::bool_value &&
+               static_cast<const BooleanValue*>(sub)->value();
+    }
+
+    estimate count_estimate(const ExprNode& expr, const ExprNode& sub) const {
+        const auto e = calc(sub);
+        estimate result;
+        for (std::size_t t = 0; t < 3; ++t) {
+            const double count = average_count(expr.expression_type(), t);
+            result.probability[t] = count > 0.0 ? 1.0 - std::pow(1.0 - e.probability[t], count) : 0.0;
+            result.cost[t] = 1.0 + count * e.cost[t];
+        }
+        return result;
+    }
+
+    estimate binary_int_estimate(const BinaryIntOperation& expr) const {
+        const auto lhs = calc(*expr.lhs());
+        const auto rhs = calc(*expr.rhs());
+        estimate result;
+        for (std::size_t t = 0; t < 3; ++t) {
+            result.cost[t] = 1.0 + lhs.cost[t] + rhs.cost[t];
+            switch (expr.op()) {
+                case integer_op_type::equal:
+                    result.probability[t] = 0.1;
+                    break;
+                case integer_op_type::not_equal:
+                    result.probability[t] = 0.9;
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        // Comparisons like "@tags > 2" or "@nodes < 10" can be answered
+        // from the histograms.
+        if (!counts_all(*expr.lhs()) || expr.rhs()->expression_type() != expr_node_type::integer_value) {
+            return result;
+        }
+        const auto count_type = expr.lhs()->expression_type();
+        const auto value = static_cast<const IntegerValue*>(expr.rhs())->value();
+        for (std::size_t t = 0; t < 3; ++t) {
+            const auto& ts = m_stats(type(t));
+            if (count_type == expr_node_type::tags_expr) {
+                result.probability[t] = histogram_share(ts.tag_counts, expr.op(), value);
+            } else if (average_count(count_type, t) > 0.0) {
+                result.probability[t] = histogram_share(ts.lengths, expr.op(), value);
+            } else {
+                result.probability[t] = compare(expr.op(), 0, value) ? 1.0 : 0.0;
+            }
+        }
+        return result;
+    }
+
+    estimate tag_check_estimate(const ExprNode& expr) const {
+        estimate result;
+        for (std::size_t t = 0; t < 3; ++t) {
+            // Tags are searched linearly for the key.
+            result.cost[t] = 1.0 + m_average_tags[t];
+            switch (expr.expression_type()) {
+                case expr_node_type::check_has_key:
+                    result.probability[t] = key_share(t, static_cast<const CheckHasKeyExpr&>(expr).key());
+                    break;
+                case expr_node_type::check_tag_str: {
+                        const auto& e = static_cast<const CheckTagStrExpr&>(expr);
+                        const double share = tag_share(t, e.key(), e.value());
+                        result.probability[t] = e.op() == string_op_type::equal ? share : key_share(t, e.key()) - share;
+                        result.cost[t] += string_compare_cost;
+                    }
+                    break;
+                default: {
+                        const auto& e = static_cast<const CheckTagRegexExpr&>(expr);
+                        result.probability[t] = key_share(t, e.key()) / 2.0;
+                        result.cost[t] += regex_cost;
+                    }
+                    break;
+            }
+        }
+        return result;
+    }
+
+public:
+
+    // The filter is evaluated on the objects of the given types.
+    CostModel(const TagStats& stats, osmium::osm_entity_bits::type entities) :
+        m_stats(stats) {
+        double total = 0.0;
+        for (std::size_t t = 0; t < 3; ++t) {
+            const auto& ts = stats(type(t));
+            m_average_tags[t] = average(ts.tag_counts);
+            m_average_length[t] = average(ts.lengths);
+            if (entities & osmium::osm_entity_bits::from_item_type(type(t))) {
+                m_weights[t] = double(ts.objects);
+                total += m_weights[t];
+            }
+        }
+        m_objects = total;
+        for (auto& weight : m_weights) {
+            weight = total > 0.0 ? weight / total : 1.0 / 3.0;
+        }
+    }
+
+    // Weighted by the share of the objects of each type.
+    double weighted(const std::array<double, 3>& values) const noexcept {
+        return m_weights[0] * values[0] + m_weights[1] * values[1] + m_weights[2] * values[2];
+    }
+
+    estimate calc(const ExprNode& expr) const {
+        estimate result;
+
+        switch (expr.expression_type()) {
+            case expr_node_type::and_expr:
+            case expr_node_type::or_expr: {
+                    const bool is_and = expr.expression_type() == expr_node_type::and_expr;
+                    for (std::size_t t = 0; t < 3; ++t) {
+                        // Probability that the next child is evaluated.
+                        result.probability[t] = 1.0;
+                        result.cost[t] = 0.0;
+                    }
+                    for (const auto& child : static_cast<const WithSubExpr&>(expr).children()) {
+                        const auto e = calc(*child);
+                        for (std::size_t t = 0; t < 3; ++t) {
+                            result.cost[t] += result.probability[t] * e.cost[t];
+                            result.probability[t] *= is_and ? e.probability[t] : 1.0 - e.probability[t];
+                        }
+                    }
+                    if (!is_and) {
+                        for (auto& p : result.probability) {
+                            p = 1.0 - p;
+                        }
+                    }
+                }
+                break;
+            case expr_node_type::not_expr:
+                result = calc(*static_cast<const NotExpr&>(expr).expr());
+                for (auto& p : result.probability) {
+                    p = 1.0 - p;
+                }
+                break;
+            case expr_node_type::bool_value: {
+                    const double p = static_cast<const BooleanValue&>(expr).value() ? 1.0 : 0.0;
+                    result.probability = {{p, p, p}};
+                    result.cost = {{0.0, 0.0, 0.0}};
+                }
+                break;
+            case expr_node_type::boolean_attribute: {
+                    const auto attr = static_cast<const BooleanAttribute&>(expr).attribute();
+                    for (std::size_t t = 0; t < 3; ++t) {
+                        switch (attr) {
+                            case boolean_attribute_type::node:
+                                result.probability[t] = type(t) == osmium::item_type::node ? 1.0 : 0.0;
+                                break;
+                            case boolean_attribute_type::way:
+                                result.probability[t] = type(t) == osmium::item_type::way ? 1.0 : 0.0;
+                                break;
+                            case boolean_attribute_type::relation:
+                                result.probability[t] = type(t) == osmium::item_type::relation ? 1.0 : 0.0;
+                                break;
+                            case boolean_attribute_type::visible:
+                                result.probability[t] = 1.0;
+                                break;
+                            case boolean_attribute_type::closed_way:
+                            case boolean_attribute_type::open_way:
+                                result.probability[t] = type(t) == osmium::item_type::way ? 0.5 : 0.0;
+                                break;
+                        }
+                    }
+                }
+                break;
+            case expr_node_type::binary_int_op:
+                result = binary_int_estimate(static_cast<const BinaryIntOperation&>(expr));
+                break;
+            case expr_node_type::binary_str_op: {
+                    const auto& e = static_cast<const BinaryStrOperation&>(expr);
+                    const bool regex = e.rhs()->expression_type() == expr_node_type::regex_value;
+                    for (std::size_t t = 0; t < 3; ++t) {
+                        result.cost[t] = regex ? regex_cost : string_compare_cost;
+                    }
+                }
+                break;
+            case expr_node_type::tags_expr:
+                result = count_estimate(expr, *static_cast<const TagsExpr&>(expr).expr());
+                break;
+            case expr_node_type::nodes_expr:
+                result = count_estimate(expr, *static_cast<const NodesExpr&>(expr).expr());
+                break;
+            case expr_node_type::members_expr:
+                result = count_estimate(expr, *static_cast<const MembersExpr&>(expr).expr());
+                break;
+            case expr_node_type::in_integer_list: {
+                    const auto& e = static_cast<const InIntegerList&>(expr);
+                    const auto size = e.linear_size();
+                    for (std::size_t t = 0; t < 3; ++t) {
+                        const auto objects = m_stats(type(t)).objects;
+                        double p = 0.1;
+                        if (size > 0 && objects > 0 && e.attr()->expression_type() == expr_node_type::integer_attribute &&
+                            static_cast<const IntegerAttribute*>(e.attr())->attribute() == integer_attribute_type::id) {
+                            p = std::min(1.0, double(size) / double(objects));
+                        }
+                        result.probability[t] = e.op() == list_op_type::in ? p : 1.0 - p;
+                        result.cost[t] = 1.0 + (size > 0 ? double(size) : set_lookup_cost);
+                    }
+                }
+                break;
+            case expr_node_type::in_integer_ranges: {
+                    const auto& e = static_cast<const InIntegerRanges&>(expr);
+                    for (std::size_t t = 0; t < 3; ++t) {
+                        result.cost[t] = 2.0 + std::log2(double(e.ranges().size()) + 1.0);
+                    }
+                }
+                break;
+            case expr_node_type::location_in_box:
+                result.cost = {{box_cost, box_cost, box_cost}};
+                break;
+            case expr_node_type::location_in_polygon:
+                result.cost = {{polygon_cost, polygon_cost, polygon_cost}};
+                break;
+            case expr_node_type::check_has_key:
+            case expr_node_type::check_tag_str:
+            case expr_node_type::check_tag_regex:
+                result = tag_check_estimate(expr);
+                break;
+            default:
+                break;
+        }
+
+        return result;
+    }
+
+    /**
+     * Sort key for the children of an "and" (or "or") expression.
+     * Evaluating the children with the smallest ranks first is cheapest
+     * on average: cost divided by the probability that the child decides
+     * the result.
+     */
+    double rank(const ExprNode& expr, bool in_and) const {
+        const auto e = calc(expr);
+        const double cost = weighted(e.cost);
+        const double p = weighted(e.probability);
+        const double decides = in_and ? 1.0 - p : p;
+        if (decides <= 0.0) {
+            return std::numeric_limits<double>::infinity();
+        }
+        return cost / decides;
+    }
+
+    /**
+     * Should a literal ID list with the given number of values use a set
+     * with constant time lookups instead of comparing all values? Only
+     * if it is long enough and evaluated more often than it has values,
+     * because building the set has a cost, too.
+     */
+    bool prefer_set(std::size_t linear_size) const noexcept {
+        return double(linear_size) > set_lookup_cost && m_objects > double(linear_size);
+    }
+
+}; // class CostModel
+
@@ -0,0 +1,461 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef OSMIUM_FILTER_WITH_IO_URING
+# include <liburing.h>
+#endif
+
+#include <osmium/memory/item.hpp>
+
+#include "dump_file.hpp"
+
+/**
+ * Alignment of buffers, offsets and lengths needed for O_DIRECT.
+ */
+constexpr const std::size_t direct_io_alignment = 4096;
+
+/**
+ * Interface for the different ways of reading blocks asynchronously.
+ * A block is read into one of a fixed number of slots, there can only
+ * be one read per slot in flight.
+ */
+class BlockReadBackend {
+
+public:
+
+    virtual ~BlockReadBackend() = default;
+
+    virtual void submit(unsigned slot, unsigned char* buffer, std::size_t length, std::uint64_t offset) = 0;
+
+    // Wait for the read into the slot to finish, return bytes read.
+    virtual std::size_t wait(unsigned slot) = 0;
+
+}; // class BlockReadBackend
+
+/**
+ * Reads blocks with pread() in a pool of threads.
+ */
+class PreadBackend : public BlockReadBackend {
+
+    struct request {
+        unsigned slot;
+        unsigned char* buffer;
+        std::size_t length;
+        std::uint64_t offset;
+    };
+
+    int m_fd;
+    std::vector<std::thread> m_threads;
+    std::deque<request> m_queue;
+    std::vector<char> m_done;
+    std::vector<ssize_t> m_result;
+    std::mutex m_mutex;
+    std::condition_variable m_cv_queue;
+    std::condition_variable m_cv_done;
+    bool m_shutdown = false;
+
+    void worker() {
+        while (true) {
+            request r;
+            {
+                std::unique_lock<std::mutex> lock{m_mutex};
+                m_cv_queue.wait(lock, [this](){
+                    return m_shutdown || !m_queue.empty();
+                });
+                if (m_queue.empty()) {
+                    return;
+                }
+                r = m_queue.front();
+                m_queue.pop_front();
+            }
+
+            const ssize_t result = ::pread(m_fd, r.buffer, r.length, static_cast<off_t>(r.offset));
+            const int error = errno;
+
+            std::lock_guard<std::mutex> lock{m_mutex};
+            m_result[r.slot] = result < 0 ? -error : result;
+            m_done[r.slot] = 1;
+            m_cv_done.notify_all();
+        }
+    }
+
+public:
+
+    PreadBackend(int fd, unsigned num_slots, unsigned num_threads) :
+        m_fd(fd),
+        m_done(num_slots, 0),
+        m_result(num_slots, 0) {
+        for (unsigned i = 0; i < num_threads; ++i) {
+            m_threads.emplace_back(&PreadBackend::worker, this);
+        }
+    }
+
+    ~PreadBackend() {
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            m_shutdown = true;
+            m_queue.clear();
+        }
+        m_cv_queue.notify_all();
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    void submit(unsigned slot, unsigned char* buffer, std::size_t length, std::uint64_t offset) override final {
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            m_done[slot] = 0;
+            m_queue.push_back(request{slot, buffer, length, offset});
+        }
+        m_cv_queue.notify_one();
+    }
+
+    std::size_t wait(unsigned slot) override final {
+        std::unique_lock<std::mutex> lock{m_mutex};
+        m_cv_done.wait(lock, [this, slot](){
+            return m_done[slot] != 0;
+        });
+        if (m_result[slot] < 0) {
+            throw std::system_error{static_cast<int>(-m_result[slot]), std::system_category(), "Read error"};
+        }
+        return static_cast<std::size_t>(m_result[slot]);
+    }
+
+}; // class PreadBackend
+
+#ifdef OSMIUM_FILTER_WITH_IO_URING
+/**
+ * Reads blocks using io_uring.
+ */
+class UringBackend : public BlockReadBackend {
+
+    io_uring m_ring;
+    int m_fd;
+    std::vector<char> m_done;
+    std::vector<int> m_result;
+
+public:
+
+    UringBackend(int fd, unsigned num_slots) :
+        m_fd(fd),
+        m_done(num_slots, 0),
+        m_result(num_slots, 0) {
+        const int result = io_uring_queue_init(num_slots, &m_ring, 0);
+        if (result < 0) {
+            throw std::system_error{-result, std::system_category(), "io_uring_queue_init failed"};
+        }
+    }
+
+    ~UringBackend() {
+        io_uring_queue_exit(&m_ring);
+    }
+
+    void submit(unsigned slot, unsigned char* buffer, std::size_t length, std::uint64_t offset) override final {
+        io_uring_sqe* sqe = io_uring_get_sqe(&m_ring);
+        if (!sqe) {
+            throw std::runtime_error{"io_uring submission queue full"};
+        }
+        io_uring_prep_read(sqe, m_fd, buffer, static_cast<unsigned>(length), offset);
+        io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(static_cast<std::uintptr_t>(slot)));
+        m_done[slot] = 0;
+        const int result = io_uring_submit(&m_ring);
+        if (result < 0) {
+            throw std::system_error{-result, std::system_category(), "io_uring_submit failed"};
+        }
+    }
+
+    std::size_t wait(unsigned slot) override final {
+        while (!m_done[slot]) {
+            io_uring_cqe* cqe;
+            const int result = io_uring_wait_cqe(&m_ring, &cqe);
+            if (result < 0) {
+                throw std::system_error{-result, std::system_category(), "io_uring_wait_cqe failed"};
+            }
+            const auto s = static_cast<unsigned>(reinterpret_cast<std::uintptr_t>(io_uring_cqe_get_data(cqe)));
+            m_result[s] = cqe->res;
+            m_done[s] = 1;
+            io_uring_cqe_seen(&m_ring, cqe);
+        }
+        if (m_result[slot] < 0) {
+            throw std::system_error{-m_result[slot], std::system_category(), "Read error"};
+        }
+        return static_cast<std::size_t>(m_result[slot]);
+    }
+
+}; // class UringBackend
+#endif
+
+/**
+ * Reads an osmium dump with direct I/O (bypassing the page cache if the
+ * file system allows it) into a fixed ring of buffers and hands out
+ * segments of the dump that always contain complete items. Memory use
+ * is bounded by the number and size of the buffers (plus the size of the
+ * largest item in the dump).
+ */
+class DirectDumpReader {
+
+    struct aligned_free {
+        void operator()(unsigned char* ptr) const noexcept {
+            std::free(ptr);
+        }
+    };
+
+    using aligned_buffer = std::unique_ptr<unsigned char, aligned_free>;
+
+    int m_fd;
+    std::uint64_t m_file_size;
+    std::uint64_t m_data_offset = 0;
+    std::uint64_t m_data_size;
+    std::size_t m_block_size;
+    std::vector<aligned_buffer> m_buffers;
+    std::unique_ptr<BlockReadBackend> m_backend;
+
+    static aligned_buffer allocate(std::size_t size) {
+        void* ptr = nullptr;
+        if (::posix_memalign(&ptr, direct_io_alignment, size) != 0) {
+            throw std::bad_alloc{};
+        }
+        return aligned_buffer{static_cast<unsigned char*>(ptr)};
+    }
+
+    static std::size_t item_size(const unsigned char* data) noexcept {
+        return reinterpret_cast<const osmium::memory::Item*>(data)->padded_size();
+    }
+
+    // Expected length of block starting at offset in the data.
+    std::size_t expected_length(std::uint64_t offset) const noexcept {
+        const auto rest = m_data_size - offset;
+        return rest < m_block_size ? static_cast<std::size_t>(rest) : m_block_size;
+    }
+
+    // Make sure the whole block was read, short reads are retried
+    // synchronously. O_DIRECT needs aligned buffers, offsets, and lengths,
+    // so the rest of the block is read again from the last aligned
+    // position.
+    void complete_block(unsigned char* buffer, std::size_t length, std::size_t expected, std::uint64_t offset) const {
+        while (length < expected) {
+            const auto start = length / direct_io_alignment * direct_io_alignment;
+            const ssize_t result = ::pread(m_fd, buffer + start, m_block_size - start, static_cast<off_t>(offset + start));
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0 || start + static_cast<std::size_t>(result) <= length) {
+                throw std::runtime_error{"Short read from dump"};
+            }
+            length = start + static_cast<std::size_t>(result);
+        }
+    }
+
+public:
+
+    /**
+     * Open the dump file. The block size is rounded up to the needed
+     * alignment. If use_uring is set and io_uring support was compiled
+     * in, it is used, otherwise pread() is called from a thread pool.
+     */
+    DirectDumpReader(const std::string& filename, std::size_t block_size, unsigned num_buffers, bool use_uring) :
+        m_fd(::open(filename.c_str(), O_RDONLY | O_DIRECT)),
+        m_file_size(0),
+        m_block_size((block_size + direct_io_alignment - 1) / direct_io_alignment * direct_io_alignment) {
+        if (m_fd < 0 && errno == EINVAL) {
+            // File system doesn't support O_DIRECT.
+            m_fd = ::open(filename.c_str(), O_RDONLY);
+        }
+        if (m_fd < 0) {
+            throw std::system_error{errno, std::system_category(), "Can not open '" + filename + "'"};
+        }
+
+        // Close the file if anything fails after opening it.
+        try {
+            if (m_block_size == 0 || m_block_size > std::numeric_limits<std::uint32_t>::max()) {
+                throw std::runtime_error{"Invalid block size for direct I/O"};
+            }
+
+            struct stat s;
+            if (::fstat(m_fd, &s) != 0) {
+                throw std::system_error{errno, std::system_category(), "Can not stat '" + filename + "'"};
+            }
+            m_file_size = static_cast<std::uint64_t>(s.st_size);
+            m_data_size = m_file_size;
+
+            if (num_buffers < 2) {
+                num_buffers = 2;
+            }
+            for (unsigned i = 0; i < num_buffers; ++i) {
+                m_buffers.push_back(allocate(m_block_size));
+            }
+
+            // Dumps with header only have the objects in the data section.
+            const auto length = ::pread(m_fd, m_buffers[0].get(), dump_file::header_size, 0);
+            if (length > 0 && dump_file::has_header(m_buffers[0].get(), static_cast<std::size_t>(length))) {
+                const auto header = dump_file::read_header(m_buffers[0].get(), m_file_size);
+                m_data_offset = header.data_offset;
+                m_data_size = header.data_size;
+            }
+
+#ifdef OSMIUM_FILTER_WITH_IO_URING
+            if (use_uring) {
+                m_backend.reset(new UringBackend{m_fd, num_buffers});
+            }
+#else
+            (void)use_uring;
+#endif
+            if (!m_backend) {
+                m_backend.reset(new PreadBackend{m_fd, num_buffers, num_buffers - 1});
+            }
+        } catch (...) {
+            ::close(m_fd);
+            throw;
+        }
+    }
+
+    DirectDumpReader(const DirectDumpReader&) = delete;
+    DirectDumpReader& operator=(const DirectDumpReader&) = delete;
+
+    ~DirectDumpReader() {
+        m_backend.reset();
+        ::close(m_fd);
+    }
+
+    std::uint64_t file_size() const noexcept {
+        return m_file_size;
+    }
+
+    // Size of the data in the dump (without header and index).
+    std::uint64_t data_size() const noexcept {
+        return m_data_size;
+    }
+
+    static bool has_uring() noexcept {
+#ifdef OSMIUM_FILTER_WITH_IO_URING
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /**
+     * Read the whole dump and call func(data, size) for each segment of
+     * complete items in file order. The data is only valid during the
+     * call. All buffers except the one currently being processed are
+     * kept busy reading ahead. Reading stops early if func returns false.
+     */
+    void read(const std::function<bool(unsigned char*, std::size_t)>& func) {
+        const auto num_buffers = static_cast<unsigned>(m_buffers.size());
+        const std::uint64_t num_blocks = (m_data_size + m_block_size - 1) / m_block_size;
+
+        const auto submit = [&](std::uint64_t block) {
+            const auto slot = static_cast<unsigned>(block % num_buffers);
+            const auto offset = m_data_offset + block * m_block_size;
+            m_backend->submit(slot, m_buffers[slot].get(), m_block_size, offset);
+        };
+
+        for (std::uint64_t block = 0; block < num_blocks && block < num_buffers - 1; ++block) {
+            submit(block);
+        }
+
+        // Wait for the reads still running after the given block.
+        const auto stop = [&](std::uint64_t block) {
+            for (auto next = block + 1; next < num_blocks && next < block + num_buffers; ++next) {
+                m_backend->wait(static_cast<unsigned>(next % num_buffers));
+            }
+        };
+
+        // Incomplete item at the end of the previous block(s).
+        std::vector<unsigned char> carry;
+
+        for (std::uint64_t block = 0; block < num_blocks; ++block) {
+            if (block + num_buffers - 1 < num_blocks) {
+                submit(block + num_buffers - 1);
+            }
+
+            const auto slot = static_cast<unsigned>(block % num_buffers);
+            unsigned char* data = m_buffers[slot].get();
+            const auto offset = block * m_block_size;
+            const auto length = expected_length(offset);
+            complete_block(data, m_backend->wait(slot), length, m_data_offset + offset);
+
+            std::size_t pos = 0;
+
+            // Complete the item started in the previous block.
+            if (!carry.empty()) {
+                if (carry.size() < sizeof(osmium::memory::item_size_type)) {
+                    const auto n = std::min(sizeof(osmium::memory::item_size_type) - carry.size(), length);
+                    carry.insert(carry.end(), data, data + n);
+                    pos = n;
+                }
+                if (carry.size() >= sizeof(osmium::memory::item_size_type)) {
+                    const auto size = item_size(carry.data());
+                    if (size == 0) {
+                        throw std::runtime_error{"Invalid item in dump (size 0)"};
+                    }
+                    if (size < carry.size()) {
+                        throw std::runtime_error{"Invalid item in dump"};
+                    }
+                    const auto n = std::min(size - carry.size(), length - pos);
+                    carry.insert(carry.end(), data + pos, data + pos + n);
+                    pos += n;
+                    if (carry.size() == size) {
+                        if (!func(carry.data(), carry.size())) {
+                            stop(block);
+                            return;
+                        }
+                        carry.clear();
+                    }
+                }
+                if (!carry.empty()) {
+                    continue;
+                }
+            }
+
+            // Find the end of the last complete item in this block.
+            std::size_t end = pos;
+            while (end + sizeof(osmium::memory::item_size_type) <= length) {
+                const auto size = item_size(data + end);
+                if (size == 0) {
+                    throw std::runtime_error{"Invalid item in dump (size 0)"};
+                }
+                if (end + size > length) {
+                    break;
+                }
+                end += size;
+            }
+
+            if (end > pos && !func(data + pos, end - pos)) {
+                stop(block);
+                return;
+            }
+
+            carry.assign(data + end, data + length);
+        }
+
+        if (!carry.empty()) {
+            throw std::runtime_error{"Dump is truncated"};
+        }
+    }
+
+}; // class DirectDumpReader
+
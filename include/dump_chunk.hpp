@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#include <osmium/osm/entity_bits.hpp>
+#include <osmium/osm/object.hpp>
+
+/**
+ * Default (minimum) size of chunks the dump is split into for parallel
+ * processing.
+ */
+constexpr const std::size_t default_chunk_size = 16 * 1024 * 1024;
+
+/**
+ * A part of an osmium dump. Chunks always start and end at item
+ * boundaries, so they can be used as (read-only) buffers of their own.
+ * Written as is into index files, so only fixed-size members.
+ */
+struct dump_chunk {
+    std::uint64_t offset = 0;
+    std::uint64_t size = 0;
+    std::int64_t min_id = std::numeric_limits<std::int64_t>::max();
+    std::int64_t max_id = std::numeric_limits<std::int64_t>::min();
+    std::uint32_t types = osmium::osm_entity_bits::nothing;
+    std::uint32_t min_timestamp = std::numeric_limits<std::uint32_t>::max();
+    std::uint32_t max_timestamp = 0;
+    std::uint32_t padding = 0;
+
+    dump_chunk() = default;
+
+    explicit dump_chunk(std::uint64_t start) :
+        offset(start) {
+    }
+
+    void add(const osmium::OSMObject& object) noexcept {
+        types |= osmium::osm_entity_bits::from_item_type(object.type());
+        if (object.id() < min_id) {
+            min_id = object.id();
+        }
+        if (object.id() > max_id) {
+            max_id = object.id();
+        }
+        const auto timestamp = std::uint32_t(object.timestamp());
+        if (timestamp < min_timestamp) {
+            min_timestamp = timestamp;
+        }
+        if (timestamp > max_timestamp) {
+            max_timestamp = timestamp;
+        }
+    }
+
+    osmium::osm_entity_bits::type entities() const noexcept {
+        return static_cast<osmium::osm_entity_bits::type>(types);
+    }
+
+    bool contains_ids(std::int64_t first, std::int64_t last) const noexcept {
+        return min_id <= last && max_id >= first;
+    }
+
+    // Timestamps are in seconds since the epoch.
+    bool contains_timestamps(std::int64_t first, std::int64_t last) const noexcept {
+        return std::int64_t(min_timestamp) <= last && std::int64_t(max_timestamp) >= first;
+    }
+
+}; // struct dump_chunk
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <osmium/memory/item.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/object.hpp>
+
+#include "dump_chunk.hpp"
+#include "dump_file.hpp"
+#include "dump_index.hpp"
+
+/**
+ * Split the dump in data/size into chunks of at least chunk_size bytes.
+ * (The last chunk can be smaller.) This has to follow the items one after
+ * the other, because their sizes are only known from their headers. Use
+ * a dump index (see dump_index.hpp) to avoid this scan.
+ */
+inline std::vector<dump_chunk> split_into_chunks(const unsigned char* data, std::size_t size, std::size_t chunk_size = default_chunk_size) {
+    std::vector<dump_chunk> chunks;
+
+    dump_chunk chunk{0};
+    std::size_t pos = 0;
+    while (pos < size) {
+        if (size - pos < sizeof(osmium::memory::Item)) {
+            throw std::runtime_error{"Dump is truncated"};
+        }
+        const auto& item = *reinterpret_cast<const osmium::memory::Item*>(data + pos);
+        if (item.byte_size() == 0) {
+            throw std::runtime_error{"Invalid item in dump (size 0)"};
+        }
+        if (item.padded_size() > size - pos) {
+            throw std::runtime_error{"Dump is truncated"};
+        }
+        if (item.type() == osmium::item_type::node ||
+            item.type() == osmium::item_type::way ||
+            item.type() == osmium::item_type::relation) {
+            chunk.add(static_cast<const osmium::OSMObject&>(item));
+        }
+        pos += item.padded_size();
+        if (pos - chunk.offset >= chunk_size) {
+            chunk.size = pos - chunk.offset;
+            chunks.push_back(chunk);
+            chunk = dump_chunk{pos};
+        }
+    }
+
+    if (pos > chunk.offset) {
+        chunk.size = pos - chunk.offset;
+        chunks.push_back(chunk);
+    }
+
+    return chunks;
+}
+
+/**
+ * Chunks and data section of a dump (see load_dump_chunks()).
+ */
+struct dump_layout {
+    std::size_t data_offset = 0;
+    std::size_t data_size = 0;
+    std::vector<dump_chunk> chunks;
+};
+
+/**
+ * Find the chunks of the dump in data/size, mapped from the file fd.
+ * Dumps with header have their own chunk index (see dump_file.hpp).
+ * Otherwise the index is read from index_filename if it belongs to this
+ * dump, or the dump is split into chunks and the index written to
+ * index_filename (if not empty).
+ */
+inline dump_layout load_dump_chunks(int fd, const unsigned char* data, std::size_t size, const std::string& index_filename) {
+    dump_layout layout;
+    layout.data_size = size;
+
+    if (dump_file::has_header(data, size)) {
+        const auto header = dump_file::read_header(data, size);
+        layout.chunks = dump_file::read_chunks(data, header);
+        layout.data_offset = header.data_offset;
+        layout.data_size = header.data_size;
+    } else if (index_filename.empty()) {
+        layout.chunks = split_into_chunks(data, size);
+    } else {
+        auto dump = dump_index::identify(fd);
+        dump.size = size; // what is mapped, even if the file grew since
+        if (dump_index::is_current(index_filename, dump)) {
+            layout.chunks = dump_index::read(index_filename, data, dump);
+        } else {
+            layout.chunks = split_into_chunks(data, size);
+            dump_index::write(index_filename, dump, layout.chunks);
+        }
+    }
+
+    return layout;
+}
+
+/**
+ * A fixed set of worker threads for running jobs like
+ * process_chunks_ordered() many times without starting new threads for
+ * each job.
+ */
+class ChunkWorkerPool {
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_cv_work;
+    std::condition_variable m_cv_done;
+
+    // State of the current job, protected by the mutex.
+    std::function<void(unsigned, std::size_t)> m_process;
+    std::size_t m_num_chunks = 0;
+    std::size_t m_next_chunk = 0;
+    std::vector<char> m_done;
+    unsigned m_active = 0;
+    std::exception_ptr m_error;
+    bool m_shutdown = false;
+
+    void worker(unsigned thread_num) {
+        std::unique_lock<std::mutex> lock{m_mutex};
+        while (true) {
+            m_cv_work.wait(lock, [this](){
+                return m_shutdown || m_next_chunk < m_num_chunks;
+            });
+            if (m_shutdown) {
+                return;
+            }
+            const std::size_t n = m_next_chunk++;
+            ++m_active;
+            lock.unlock();
+            try {
+                m_process(thread_num, n);
+                lock.lock();
+                m_done[n] = 1;
+            } catch (...) {
+                lock.lock();
+                if (!m_error) {
+                    m_error = std::current_exception();
+                }
+                m_next_chunk = m_num_chunks;
+            }
+            --m_active;
+            m_cv_done.notify_all();
+        }
+    }
+
+    // Stop handing out chunks and wait for the running ones.
+    void finish(std::unique_lock<std::mutex>& lock) {
+        m_next_chunk = m_num_chunks;
+        m_cv_done.wait(lock, [this](){
+            return m_active == 0;
+        });
+        m_process = nullptr;
+    }
+
+public:
+
+    explicit ChunkWorkerPool(unsigned num_threads) {
+        if (num_threads == 0) {
+            num_threads = 1;
+        }
+        m_threads.reserve(num_threads);
+        for (unsigned t = 0; t < num_threads; ++t) {
+            m_threads.emplace_back(&ChunkWorkerPool::worker, this, t);
+        }
+    }
+
+    ChunkWorkerPool(const ChunkWorkerPool&) = delete;
+    ChunkWorkerPool& operator=(const ChunkWorkerPool&) = delete;
+
+    ~ChunkWorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            m_shutdown = true;
+        }
+        m_cv_work.notify_all();
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    /**
+     * Call process(thread_num, chunk_num) for all chunk numbers from 0 to
+     * num_chunks-1 on the worker threads. Chunks are handed out in order
+     * to the next free thread. In the calling thread output(chunk_num) is
+     * called for each chunk in order as soon as that chunk is done. If
+     * output() returns false, no further chunks are started or output.
+     *
+     * If any process() call throws, no further chunks are started and the
+     * exception is re-thrown in the calling thread.
+     */
+    template <typename TProcess, typename TOutput>
+    void run(std::size_t num_chunks, TProcess&& process, TOutput&& output) {
+        std::unique_lock<std::mutex> lock{m_mutex};
+        m_process = [&process](unsigned thread_num, std::size_t n) {
+            process(thread_num, n);
+        };
+        m_done.assign(num_chunks, 0);
+        m_error = nullptr;
+        m_next_chunk = 0;
+        m_num_chunks = num_chunks;
+        m_cv_work.notify_all();
+
+        try {
+            for (std::size_t n = 0; n < num_chunks; ++n) {
+                m_cv_done.wait(lock, [&](){
+                    return m_done[n] || m_error;
+                });
+                if (m_error) {
+                    break;
+                }
+                lock.unlock();
+                const bool more = output(n);
+                lock.lock();
+                if (!more) {
+                    break;
+                }
+            }
+        } catch (...) {
+            if (!lock.owns_lock()) {
+                lock.lock();
+            }
+            finish(lock);
+            throw;
+        }
+
+        finish(lock);
+        if (m_error) {
+            std::rethrow_exception(m_error);
+        }
+    }
+
+}; // class ChunkWorkerPool
+
+/**
+ * Run process and output on all chunks as described for
+ * ChunkWorkerPool::run() on num_threads new threads.
+ */
+template <typename TProcess, typename TOutput>
+void process_chunks_ordered(std::size_t num_chunks, unsigned num_threads, TProcess&& process, TOutput&& output) {
+    ChunkWorkerPool pool{num_threads};
+    pool.run(num_chunks, std::forward<TProcess>(process), std::forward<TOutput>(output));
+}
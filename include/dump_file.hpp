@@ -0,0 +1,205 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/object.hpp>
+
+#include "dump_chunk.hpp"
+
+/**
+ * Osmium dump files with header and chunk index.
+ *
+ * A plain osmium dump is just the contents of osmium buffers written one
+ * after the other. The dump files written by DumpWriter have a header in
+ * front of the data and the chunk index (see dump_chunk) at the end, so
+ * they can be memory mapped and processed in parallel without any
+ * scanning or decoding.
+ *
+ * File format (all numbers in native byte order):
+ *
+ *   header_size bytes  header (see struct header), padded with zeros
+ *   data_size bytes    buffer data, starting at data_offset
+ *   num_chunks entries chunk index (dump_chunk structs) at index_offset
+ *
+ * Chunk offsets in the index are relative to the start of the data. The
+ * data starts page aligned, items are aligned as in osmium buffers.
+ */
+namespace dump_file {
+
+    constexpr const char magic[8] = {'O', 'S', 'M', 'F', 'D', 'U', 'M', 'P'};
+    constexpr const std::uint32_t version = 2;
+    constexpr const std::size_t header_size = 4096;
+
+    struct header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t entry_size;
+        std::uint64_t data_offset;
+        std::uint64_t data_size;
+        std::uint64_t index_offset;
+        std::uint64_t num_chunks;
+    };
+
+    static_assert(sizeof(header) == 48, "unexpected padding in dump_file::header");
+
+    /// Does the data (start of a file) look like a dump with header?
+    inline bool has_header(const unsigned char* data, std::size_t size) noexcept {
+        return size >= sizeof(header) && !std::memcmp(data, magic, sizeof(magic));
+    }
+
+    /**
+     * Read and check header from the start of a dump file with the given
+     * size.
+     */
+    inline header read_header(const unsigned char* data, std::size_t size) {
+        if (!has_header(data, size)) {
+            throw std::runtime_error{"Not a dump file with header"};
+        }
+
+        header h;
+        std::memcpy(&h, data, sizeof(h));
+
+        if (h.version != version || h.entry_size != sizeof(dump_chunk)) {
+            throw std::runtime_error{"Unsupported dump file version"};
+        }
+
+        if (h.data_offset + h.data_size > size ||
+            h.index_offset + h.num_chunks * sizeof(dump_chunk) > size) {
+            throw std::runtime_error{"Dump file is truncated"};
+        }
+
+        return h;
+    }
+
+    /// Get chunk index from a dump file mapped into memory.
+    inline std::vector<dump_chunk> read_chunks(const unsigned char* data, const header& h) {
+        std::vector<dump_chunk> chunks(h.num_chunks);
+        std::memcpy(chunks.data(), data + h.index_offset, chunks.size() * sizeof(dump_chunk));
+        return chunks;
+    }
+
+} // namespace dump_file
+
+/**
+ * Writes OSM objects into a dump file with header and chunk index.
+ * Objects are collected into a buffer which is written out as a chunk
+ * once it is large enough. The output has to be a real file, because
+ * the header is written last.
+ */
+class DumpWriter {
+
+    int m_fd;
+    std::size_t m_chunk_size;
+    osmium::memory::Buffer m_buffer;
+    std::vector<dump_chunk> m_chunks;
+    dump_chunk m_chunk{0};
+    std::uint64_t m_offset = 0;
+
+    void write_all(const void* data, std::size_t size) {
+        const char* ptr = static_cast<const char*>(data);
+        while (size > 0) {
+            const auto result = ::write(m_fd, ptr, size);
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error{errno, std::system_category(), "Write failed"};
+            }
+            ptr += result;
+            size -= static_cast<std::size_t>(result);
+        }
+    }
+
+    void flush_chunk() {
+        if (m_buffer.committed() == 0) {
+            return;
+        }
+
+        write_all(m_buffer.data(), m_buffer.committed());
+
+        m_chunk.size = m_buffer.committed();
+        m_chunks.push_back(m_chunk);
+        m_offset += m_chunk.size;
+        m_chunk = dump_chunk{m_offset};
+
+        m_buffer.clear();
+    }
+
+public:
+
+    explicit DumpWriter(const std::string& filename, std::size_t chunk_size = default_chunk_size) :
+        m_fd(-1),
+        m_chunk_size(chunk_size),
+        m_buffer(chunk_size + 64 * 1024, osmium::memory::Buffer::auto_grow::yes) {
+        if (filename.empty() || filename == "-") {
+            throw std::runtime_error{"Dump output needs a file name"};
+        }
+
+        m_fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (m_fd < 0) {
+            throw std::system_error{errno, std::system_category(), "Can not open '" + filename + "' for writing"};
+        }
+
+        // Placeholder for the header, it is written in close().
+        const std::vector<char> zeros(dump_file::header_size, 0);
+        write_all(zeros.data(), zeros.size());
+    }
+
+    DumpWriter(const DumpWriter&) = delete;
+    DumpWriter& operator=(const DumpWriter&) = delete;
+
+    ~DumpWriter() {
+        if (m_fd >= 0) {
+            ::close(m_fd);
+        }
+    }
+
+    void operator()(const osmium::OSMObject& object) {
+        m_buffer.push_back(object);
+        m_chunk.add(object);
+        if (m_buffer.committed() >= m_chunk_size) {
+            flush_chunk();
+        }
+    }
+
+    void close() {
+        if (m_fd < 0) {
+            return;
+        }
+
+        flush_chunk();
+
+        write_all(m_chunks.data(), m_chunks.size() * sizeof(dump_chunk));
+
+        dump_file::header h;
+        std::memcpy(h.magic, dump_file::magic, sizeof(dump_file::magic));
+        h.version = dump_file::version;
+        h.entry_size = sizeof(dump_chunk);
+        h.data_offset = dump_file::header_size;
+        h.data_size = m_offset;
+        h.index_offset = dump_file::header_size + m_offset;
+        h.num_chunks = m_chunks.size();
+
+        if (::pwrite(m_fd, &h, sizeof(h), 0) != sizeof(h)) {
+            throw std::system_error{errno, std::system_category(), "Write failed"};
+        }
+
+        if (::close(m_fd) != 0) {
+            m_fd = -1;
+            throw std::system_error{errno, std::system_category(), "Close failed"};
+        }
+        m_fd = -1;
+    }
+
+}; // class DumpWriter
+
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include <osmium/memory/item.hpp>
+
+#include "dump_chunk.hpp"
+
+/**
+ * An index for osmium dump files. It stores the boundaries of the chunks
+ * the dump is split into together with the object types and ID ranges in
+ * each chunk (see dump_chunk).
+ *
+ * File format (all numbers in native byte order):
+ *
+ *   8 bytes   magic "OSMFIDX\0"
+ *   uint32_t  format version
+ *   uint32_t  size of each chunk entry in bytes
+ *   uint64_t  size of the dump file this index belongs to
+ *   uint64_t  device of the dump file
+ *   uint64_t  inode of the dump file
+ *   int64_t   modification time of the dump file (ns since the epoch)
+ *   uint64_t  number of chunk entries
+ *   ...       chunk entries (dump_chunk structs)
+ */
+namespace dump_index {
+
+    constexpr const char magic[8] = {'O', 'S', 'M', 'F', 'I', 'D', 'X', '\0'};
+    constexpr const std::uint32_t version = 3;
+
+    /**
+     * The file an index belongs to. An index is only used for the same
+     * file, unchanged since the index was written.
+     */
+    struct dump_identity {
+        std::uint64_t size = 0;
+        std::uint64_t device = 0;
+        std::uint64_t inode = 0;
+        std::int64_t mtime = 0;
+
+        bool operator==(const dump_identity& other) const noexcept {
+            return size == other.size && device == other.device &&
+                   inode == other.inode && mtime == other.mtime;
+        }
+    };
+
+    struct header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t entry_size;
+        dump_identity dump;
+        std::uint64_t num_entries;
+    };
+
+    static_assert(sizeof(header) == 56, "unexpected padding in dump_index::header");
+    static_assert(sizeof(dump_chunk) == 48, "unexpected padding in dump_chunk");
+
+    inline dump_identity identify(int fd) {
+        struct stat s;
+        if (::fstat(fd, &s) != 0) {
+            throw std::system_error{errno, std::system_category(), "Can not stat dump"};
+        }
+
+        dump_identity id;
+        id.size = static_cast<std::uint64_t>(s.st_size);
+        id.device = static_cast<std::uint64_t>(s.st_dev);
+        id.inode = static_cast<std::uint64_t>(s.st_ino);
+        id.mtime = static_cast<std::int64_t>(s.st_mtim.tv_sec) * 1000000000 + s.st_mtim.tv_nsec;
+        return id;
+    }
+
+    inline void write(const std::string& filename, const dump_identity& dump, const std::vector<dump_chunk>& chunks) {
+        std::ofstream out{filename, std::ios::binary | std::ios::trunc};
+        if (!out) {
+            throw std::runtime_error{"Can not open index file '" + filename + "' for writing"};
+        }
+
+        header h;
+        std::memcpy(h.magic, magic, sizeof(magic));
+        h.version = version;
+        h.entry_size = sizeof(dump_chunk);
+        h.dump = dump;
+        h.num_entries = chunks.size();
+
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        out.write(reinterpret_cast<const char*>(chunks.data()), chunks.size() * sizeof(dump_chunk));
+
+        if (!out) {
+            throw std::runtime_error{"Error writing index file '" + filename + "'"};
+        }
+    }
+
+    /**
+     * Is there an index for this dump in the file? Returns false if the
+     * file doesn't exist or is an index of another (or an older version
+     * of this) dump, so it should be recreated. Throws if the file is not
+     * an index at all.
+     */
+    inline bool is_current(const std::string& filename, const dump_identity& dump) {
+        std::ifstream in{filename, std::ios::binary};
+        if (!in) {
+            return false;
+        }
+
+        header h;
+        if (!in.read(reinterpret_cast<char*>(&h), sizeof(h)) || std::memcmp(h.magic, magic, sizeof(magic))) {
+            throw std::runtime_error{"Not a dump index file: '" + filename + "'"};
+        }
+
+        return h.version == version && h.entry_size == sizeof(dump_chunk) && h.dump == dump;
+    }
+
+    /**
+     * Read index from file. Throws if the index doesn't match the dump
+     * in data (with the given identity) or is corrupt.
+     */
+    inline std::vector<dump_chunk> read(const std::string& filename, const unsigned char* data, const dump_identity& dump) {
+        std::ifstream in{filename, std::ios::binary | std::ios::ate};
+        if (!in) {
+            throw std::runtime_error{"Can not open index file '" + filename + "'"};
+        }
+        const auto file_size = static_cast<std::uint64_t>(in.tellg());
+        in.seekg(0);
+
+        header h;
+        if (!in.read(reinterpret_cast<char*>(&h), sizeof(h)) || std::memcmp(h.magic, magic, sizeof(magic))) {
+            throw std::runtime_error{"Not a dump index file: '" + filename + "'"};
+        }
+
+        if (h.version != version || h.entry_size != sizeof(dump_chunk)) {
+            throw std::runtime_error{"Unsupported dump index version in '" + filename + "'"};
+        }
+
+        if (!(h.dump == dump)) {
+            throw std::runtime_error{"Index '" + filename + "' does not belong to this dump"};
+        }
+
+        if (h.num_entries != (file_size - sizeof(h)) / sizeof(dump_chunk) ||
+            (file_size - sizeof(h)) % sizeof(dump_chunk) != 0) {
+            throw std::runtime_error{"Index file '" + filename + "' is corrupt"};
+        }
+
+        std::vector<dump_chunk> chunks(h.num_entries);
+        if (!in.read(reinterpret_cast<char*>(chunks.data()), chunks.size() * sizeof(dump_chunk))) {
+            throw std::runtime_error{"Index file '" + filename + "' is truncated"};
+        }
+
+        // Every chunk must start with an item that fits into it, so the
+        // chunks can be used as buffers.
+        std::uint64_t expected_offset = 0;
+        for (const auto& chunk : chunks) {
+            if (chunk.offset != expected_offset || chunk.size < sizeof(osmium::memory::Item) ||
+                chunk.size > dump.size - chunk.offset) {
+                throw std::runtime_error{"Index file '" + filename + "' is corrupt"};
+            }
+            const auto& item = *reinterpret_cast<const osmium::memory::Item*>(data + chunk.offset);
+            if (item.byte_size() == 0 || item.padded_size() > chunk.size) {
+                throw std::runtime_error{"Index file '" + filename + "' does not match the dump"};
+            }
+            expected_offset += chunk.size;
+        }
+        if (expected_offset != dump.size) {
+            throw std::runtime_error{"Index file '" + filename + "' is corrupt"};
+        }
+
+        return chunks;
+    }
+
+} // namespace dump_index
+
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/**
+ * Gives the kernel hints about how a memory mapped dump is accessed:
+ * ranges that will be needed soon are announced (MADV_WILLNEED), ranges
+ * that are done can be dropped from the process and, optionally, from
+ * the page cache. All hints are best-effort, errors are ignored.
+ */
+class MappingAdvisor {
+
+    unsigned char* m_data;
+    std::size_t m_size;
+    std::size_t m_page_size;
+    int m_fd;
+    off_t m_file_offset;
+    bool m_drop_behind;
+
+    // Pages are rounded on absolute addresses, the data itself doesn't
+    // have to be page aligned (there is a header before it in dump files).
+    std::uintptr_t address(std::size_t offset) const noexcept {
+        return reinterpret_cast<std::uintptr_t>(m_data) + offset;
+    }
+
+    std::uintptr_t round_down(std::uintptr_t addr) const noexcept {
+        return addr - (addr % m_page_size);
+    }
+
+    std::uintptr_t round_up(std::uintptr_t addr) const noexcept {
+        const auto r = round_down(addr + m_page_size - 1);
+        const auto last = round_down(address(m_size) + m_page_size - 1);
+        return r > last ? last : r;
+    }
+
+    bool advise(std::uintptr_t start, std::uintptr_t end, int advice) const noexcept {
+        return ::madvise(reinterpret_cast<void*>(start), end - start, advice) == 0;
+    }
+
+public:
+
+    // The data is at file_offset in the file fd. It must be part of a
+    // mapping of that file, which starts page aligned.
+    MappingAdvisor(unsigned char* data, std::size_t size, int fd, off_t file_offset, bool drop_behind) :
+        m_data(data),
+        m_size(size),
+        m_page_size(static_cast<std::size_t>(::sysconf(_SC_PAGESIZE))),
+        m_fd(fd),
+        m_file_offset(file_offset),
+        m_drop_behind(drop_behind) {
+    }
+
+    /**
+     * Tell the kernel the mapping is read sequentially and ask for
+     * transparent huge pages. Returns false if huge pages are not
+     * available for this mapping.
+     */
+    bool advise_sequential() const noexcept {
+        const auto start = round_down(address(0));
+        const auto end = round_up(address(m_size));
+        advise(start, end, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+        return advise(start, end, MADV_HUGEPAGE);
+#else
+        return false;
+#endif
+    }
+
+    /// Announce that the given range will be needed soon.
+    void will_need(std::size_t offset, std::size_t length) const noexcept {
+        const auto start = round_down(address(offset));
+        const auto end = round_up(address(offset + length));
+        if (end > start) {
+            advise(start, end, MADV_WILLNEED);
+        }
+    }
+
+    /**
+     * Announce that the given range is not needed any more. Only whole
+     * pages inside the range are released, because the pages at the
+     * edges can be shared with neighbouring ranges that are still in use.
+     */
+    void done_with(std::size_t offset, std::size_t length) const noexcept {
+        if (!m_drop_behind) {
+            return;
+        }
+        const auto start = round_up(address(offset));
+        const auto end = round_down(address(offset + length));
+        if (end > start) {
+            advise(start, end, MADV_DONTNEED);
+            ::posix_fadvise(m_fd, m_file_offset + static_cast<off_t>(start - address(0)), static_cast<off_t>(end - start), POSIX_FADV_DONTNEED);
+        }
+    }
+
+}; // class MappingAdvisor
+
+/**
+ * Collects statistics about I/O: page faults, bytes processed and the
+ * time it took.
+ */
+class IOStats {
+
+    std::chrono::steady_clock::time_point m_start;
+    long m_major_faults;
+    long m_minor_faults;
+    std::uint64_t m_bytes = 0;
+
+    static rusage get_usage() noexcept {
+        rusage usage;
+        ::getrusage(RUSAGE_SELF, &usage);
+        return usage;
+    }
+
+public:
+
+    IOStats() :
+        m_start(std::chrono::steady_clock::now()) {
+        const auto usage = get_usage();
+        m_major_faults = usage.ru_majflt;
+        m_minor_faults = usage.ru_minflt;
+    }
+
+    void add_bytes(std::uint64_t bytes) noexcept {
+        m_bytes += bytes;
+    }
+
+    void print(std::ostream& out) const {
+        const auto usage = get_usage();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - m_start;
+        const double seconds = elapsed.count();
+
+        out << "I/O statistics:\n"
+            << "  bytes processed: " << m_bytes << "\n"
+            << "  elapsed time: " << seconds << " s\n"
+            << "  throughput: " << (seconds > 0 ? double(m_bytes) / seconds / (1024 * 1024) : 0.0) << " MB/s\n"
+            << "  major page faults: " << (usage.ru_majflt - m_major_faults) << "\n"
+            << "  minor page faults: " << (usage.ru_minflt - m_minor_faults) << "\n";
+    }
+
+}; // class IOStats
+
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/tag.hpp>
+
+/**
+ * Number of matching objects by type for --count, and optionally by
+ * the value of one tag (--count-by).
+ */
+struct match_counts {
+
+    using counts_type = std::array<std::uint64_t, 3>; // by nwr index
+
+    counts_type objects{{0, 0, 0}};
+
+    // Only used with --count-by. Objects without the tag are counted in
+    // without_key.
+    std::map<std::string, counts_type> by_value;
+    counts_type without_key{{0, 0, 0}};
+
+    void add(const match_counts& other) {
+        for (std::size_t i = 0; i < objects.size(); ++i) {
+            objects[i] += other.objects[i];
+            without_key[i] += other.without_key[i];
+        }
+        for (const auto& value : other.by_value) {
+            auto& counts = by_value[value.first];
+            for (std::size_t i = 0; i < counts.size(); ++i) {
+                counts[i] += value.second[i];
+            }
+        }
+    }
+
+    // Count object, by the value of its tag with the given key if that
+    // is not nullptr.
+    void add(const osmium::OSMObject& object, const char* key) {
+        const auto index = osmium::item_type_to_nwr_index(object.type());
+        ++objects[index];
+        if (!key) {
+            return;
+        }
+        const char* value = object.tags().get_value_by_key(key);
+        if (value) {
+            ++by_value[value][index];
+        } else {
+            ++without_key[index];
+        }
+    }
+
+    std::uint64_t total() const noexcept {
+        return objects[0] + objects[1] + objects[2];
+    }
+
+    // Print counts as tab separated table. The by_value lines are
+    // printed if key is not nullptr.
+    void print(std::ostream& out, const char* key) const {
+        const auto print_line = [&out](const std::string& label, const counts_type& counts) {
+            out << label << '\t' << counts[0] << '\t' << counts[1] << '\t' << counts[2] << '\t'
+                << (counts[0] + counts[1] + counts[2]) << '\n';
+        };
+
+        out << "\tnodes\tways\trelations\ttotal\n";
+        if (key) {
+            for (const auto& value : by_value) {
+                print_line(std::string{key} + '=' + value.first, value.second);
+            }
+            print_line(std::string{"no "} + key, without_key);
+        }
+        print_line("all", objects);
+    }
+
+}; // struct match_counts
+
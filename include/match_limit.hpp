@@ -0,0 +1,81 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <initializer_list>
+
+#include <osmium/osm/entity_bits.hpp>
+#include <osmium/osm/item_type.hpp>
+
+/**
+ * Limits for the number of matching objects written (--limit and
+ * --limit-per-type). A limit of 0 means no limit.
+ */
+class MatchLimit {
+
+    std::uint64_t m_total;
+    std::uint64_t m_per_type;
+    osmium::osm_entity_bits::type m_entities;
+
+    std::uint64_t m_count = 0;
+    std::array<std::uint64_t, 3> m_type_counts{{0, 0, 0}};
+
+public:
+
+    /**
+     * Only objects of the given types can match, so the per-type limit is
+     * reached when it is reached for all of them.
+     */
+    MatchLimit(std::uint64_t total, std::uint64_t per_type, osmium::osm_entity_bits::type entities) noexcept :
+        m_total(total),
+        m_per_type(per_type),
+        m_entities(entities) {
+    }
+
+    bool enabled() const noexcept {
+        return m_total > 0 || m_per_type > 0;
+    }
+
+    /**
+     * Count a matching object. Returns false if it is over a limit and
+     * must not be written.
+     */
+    bool add(osmium::item_type type) noexcept {
+        if (m_total > 0 && m_count >= m_total) {
+            return false;
+        }
+        auto& type_count = m_type_counts[osmium::item_type_to_nwr_index(type)];
+        if (m_per_type > 0 && type_count >= m_per_type) {
+            return false;
+        }
+        ++m_count;
+        ++type_count;
+        return true;
+    }
+
+    /**
+     * Have the limits been reached, so that no more objects can be
+     * written and reading the input can stop?
+     */
+    bool reached() const noexcept {
+        if (m_total > 0 && m_count >= m_total) {
+            return true;
+        }
+        if (m_per_type == 0) {
+            return false;
+        }
+        for (const auto type : {osmium::item_type::node, osmium::item_type::way, osmium::item_type::relation}) {
+            if ((m_entities & osmium::osm_entity_bits::from_item_type(type)) &&
+                m_type_counts[osmium::item_type_to_nwr_index(type)] < m_per_type) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::uint64_t count() const noexcept {
+        return m_count;
+    }
+
+}; // class MatchLimit
+
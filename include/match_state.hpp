@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <osmium/index/id_set.hpp>
+#include <osmium/index/nwr_array.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/types.hpp>
+
+/**
+ * The match state of a filter run: The IDs of all objects the filter
+ * expression matched. Written by "osmium-filter --state" and used by
+ * "osmium-filter apply-changes" to update an extract from change files
+ * without having to run the filter on the whole input again.
+ *
+ * Nodes only added to the output because they are referenced from a
+ * matching way (--complete-ways) are not in the state, they are found
+ * through the ways in the extract.
+ *
+ * File format (all numbers in native byte order):
+ *
+ *   8 bytes   magic "OSMFSTA\0"
+ *   uint32_t  format version
+ *   uint32_t  flags (bit 0: extract was written with --complete-ways)
+ *   uint64_t  number of node IDs
+ *   uint64_t  number of way IDs
+ *   uint64_t  number of relation IDs
+ *   ...       sorted node, way, and relation IDs (uint64_t each)
+ */
+namespace match_state {
+
+    using id_set_type = osmium::index::IdSetDense<osmium::unsigned_object_id_type>;
+
+    constexpr const char magic[8] = {'O', 'S', 'M', 'F', 'S', 'T', 'A', '\0'};
+    constexpr const std::uint32_t version = 1;
+
+    constexpr const std::uint32_t flag_complete_ways = 1;
+
+    struct header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t flags;
+        std::uint64_t count[3];
+    };
+
+    static_assert(sizeof(header) == 40, "unexpected padding in match_state::header");
+
+    constexpr const osmium::item_type types[3] = {
+        osmium::item_type::node,
+        osmium::item_type::way,
+        osmium::item_type::relation
+    };
+
+    inline void write(const std::string& filename, const osmium::nwr_array<id_set_type>& matched, bool complete_ways) {
+        std::ofstream out{filename, std::ios::binary | std::ios::trunc};
+        if (!out) {
+            throw std::runtime_error{"Can not open state file '" + filename + "' for writing"};
+        }
+
+        header h;
+        std::memcpy(h.magic, magic, sizeof(magic));
+        h.version = version;
+        h.flags = complete_ways ? flag_complete_ways : 0;
+        for (int i = 0; i < 3; ++i) {
+            h.count[i] = matched(types[i]).size();
+        }
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+
+        std::vector<std::uint64_t> ids;
+        const auto flush = [&]() {
+            out.write(reinterpret_cast<const char*>(ids.data()), ids.size() * sizeof(std::uint64_t));
+            ids.clear();
+        };
+        for (const auto type : types) {
+            for (const auto id : matched(type)) {
+                ids.push_back(id);
+                if (ids.size() == 1024 * 1024) {
+                    flush();
+                }
+            }
+        }
+        flush();
+
+        if (!out) {
+            throw std::runtime_error{"Error writing state file '" + filename + "'"};
+        }
+    }
+
+    /**
+     * Read state from file into the (empty) ID sets. Returns whether the
+     * extract was written with --complete-ways.
+     */
+    inline bool read(const std::string& filename, osmium::nwr_array<id_set_type>& matched) {
+        std::ifstream in{filename, std::ios::binary};
+        if (!in) {
+            throw std::runtime_error{"Can not open state file '" + filename + "'"};
+        }
+
+        header h;
+        if (!in.read(reinterpret_cast<char*>(&h), sizeof(h)) || std::memcmp(h.magic, magic, sizeof(magic))) {
+            throw std::runtime_error{"Not a state file: '" + filename + "'"};
+        }
+
+        if (h.version != version) {
+            throw std::runtime_error{"Unsupported state file version in '" + filename + "'"};
+        }
+
+        // Read in batches to keep memory use low for large states.
+        std::vector<std::uint64_t> ids;
+        for (int i = 0; i < 3; ++i) {
+            for (std::uint64_t left = h.count[i]; left > 0; left -= ids.size()) {
+                ids.resize(std::min<std::uint64_t>(left, 1024 * 1024));
+                if (!in.read(reinterpret_cast<char*>(ids.data()), ids.size() * sizeof(std::uint64_t))) {
+                    throw std::runtime_error{"State file '" + filename + "' is truncated"};
+                }
+                for (const auto id : ids) {
+                    matched(types[i]).set(id);
+                }
+            }
+        }
+
+        return (h.flags & flag_complete_ways) != 0;
+    }
+
+} // namespace match_state
+
@@ -1,36 +1,46 @@
 #pragma once
 
 #include <algorithm>
+#include <cassert>
+#include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
 #include <memory>
 #include <numeric>
 #include <regex>
 #include <stdexcept>
 #include <string>
-#include <tuple>
 #include <utility>
 #include <vector>
 
-#include <boost/optional.hpp>
-
 #include <osmium/index/id_set.hpp>
+#include <osmium/osm/box.hpp>
 #include <osmium/osm/entity_bits.hpp>
 #include <osmium/osm/item_type.hpp>
+#include <osmium/osm/location.hpp>
 #include <osmium/osm/node.hpp>
 #include <osmium/osm/node_ref.hpp>
 #include <osmium/osm/object.hpp>
 #include <osmium/osm/relation.hpp>
+#include <osmium/osm/timestamp.hpp>
+#include <osmium/osm/types.hpp>
 #include <osmium/osm/way.hpp>
 
+#include "polygon_index.hpp"
+
 enum class integer_attribute_type {
     id,
     version,
     changeset,
     uid,
-    ref
+    ref,
+    timestamp
 };
 
 inline const char* attribute_name(integer_attribute_type attr) noexcept {
@@ -39,7 +49,8 @@ inline const char* attribute_name(integer_attribute_type attr) noexcept {
         "version",
         "changeset",
         "uid",
-        "ref"
+        "ref",
+        "timestamp"
     };
 
     return names[int(attr)];
@@ -107,6 +118,24 @@ inline const char* operator_name(integer_op_type op) noexcept {
     return names[int(op)];
 }
 
+// Returns the operator op2 so that "a op b" is the same as "b op2 a".
+inline integer_op_type mirrored_op(integer_op_type op) noexcept {
+    switch (op) {
+        case integer_op_type::less_than:
+            return integer_op_type::greater_than;
+        case integer_op_type::less_or_equal:
+            return integer_op_type::greater_or_equal;
+        case integer_op_type::greater_than:
+            return integer_op_type::less_than;
+        case integer_op_type::greater_or_equal:
+            return integer_op_type::less_or_equal;
+        default:
+            break;
+    }
+
+    return op;
+}
+
 enum class string_op_type {
     equal,
     not_equal,
@@ -165,116 +194,126 @@ enum class expr_node_type : int {
     check_has_type,
     check_has_key,
     check_tag_str,
-    check_tag_regex
+    check_tag_regex,
+    in_integer_ranges,
+    location_in_box,
+    location_in_polygon
 };
 
-using entity_bits_pair = std::pair<osmium::osm_entity_bits::type,
-                                   osmium::osm_entity_bits::type>;
-
-class unused {};
+// Static type of the value of an expression.
+enum class expr_value_type : std::uint8_t {
+    boolean,
+    integer,
+    string,
+    regex
+};
 
-class ExprNode;
-class WithSubExpr;
+// What an expression is evaluated on: the whole object, or one of its
+// tags, node refs, or members (inside "@tags[...]", "@nodes[...]", and
+// "@members[...]").
+enum class eval_context : std::uint8_t {
+    object,
+    tag,
+    node_ref,
+    member
+};
 
-// This is a horrible hack to make boost::spirit work with unique_ptr.
-// I could not find a cleaner way than this. Basically we wrap the unique_ptr
-// in this class to make it copyable (by doing a move inside the copy of the
-// wrapper class).
-template <typename T>
-struct expr_node {
+using entity_bits_pair = std::pair<osmium::osm_entity_bits::type,
+                                   osmium::osm_entity_bits::type>;
 
-    mutable std::unique_ptr<ExprNode> m_data;
+// Parts of OSM objects (besides type and ID) an expression looks at.
+namespace object_parts {
 
-    using value_type = expr_node<ExprNode>;
+    enum type : unsigned {
+        nothing   = 0x00,
+        metadata  = 0x01, // version, changeset, uid, user, timestamp, visible
+        tags      = 0x02,
+        node_refs = 0x04,
+        members   = 0x08,
+        all       = 0x0f
+    };
 
-    expr_node() :
-        m_data(nullptr) {
+    inline type operator|(type lhs, type rhs) noexcept {
+        return static_cast<type>(static_cast<unsigned>(lhs) | static_cast<unsigned>(rhs));
     }
 
-    expr_node(unused) :
-        m_data(new T) {
+    inline type& operator|=(type& lhs, type rhs) noexcept {
+        lhs = lhs | rhs;
+        return lhs;
     }
 
-    // Used for AndExpr and OrExpr
-    expr_node(const std::vector<expr_node<ExprNode>>& expressions) :
-        m_data(nullptr) {
-        if (expressions.size() == 1) {
-            m_data.reset(expressions[0].release());
-        } else {
-            m_data.reset(new T(expressions));
-        }
-    }
+} // namespace object_parts
 
-    template <typename... Args>
-    expr_node(Args&&... args) :
-        m_data(new T(std::forward<Args>(args)...)) {
-    }
+// Range of integers (first and last included)
+using integer_range = std::pair<std::int64_t, std::int64_t>;
 
-    expr_node(const expr_node& other) :
-        m_data(std::move(other.m_data)) {
-    }
+inline integer_range full_integer_range() noexcept {
+    return std::make_pair(std::numeric_limits<std::int64_t>::min(),
+                          std::numeric_limits<std::int64_t>::max());
+}
 
-    template <typename D, typename std::enable_if<std::is_base_of<T, D>{}, int>::type = 0>
-    expr_node(const expr_node<D>& other) {
-        m_data.reset(other.m_data.release());
-    }
+class CostModel;
+class ExprNode;
+class TagStats;
+class WithSubExpr;
 
-    expr_node(expr_node&& other) = default;
+class ExprNode {
 
-    template <typename D, typename std::enable_if<std::is_base_of<T, D>{}, int>::type = 0>
-    expr_node(expr_node<D>&& other) {
-        m_data.reset(other.m_data.release());
-    }
+    std::size_t m_position = std::numeric_limits<std::size_t>::max();
+    expr_value_type m_static_type = expr_value_type::boolean;
+    eval_context m_context = eval_context::object;
 
-    expr_node& operator=(const expr_node& other) {
-        m_data = std::move(other.m_data);
-        return *this;
-    }
+protected:
 
-    template <typename D, typename std::enable_if<std::is_base_of<T, D>{}, int>::type = 0>
-    expr_node& operator=(const expr_node<D>& other) {
-        m_data = std::move(other.m_data);
-        return *this;
-    }
+    virtual void do_print(std::ostream& out, int level) const = 0;
 
-    expr_node& operator=(expr_node&& other) = default;
+public:
 
-    template <typename D, typename std::enable_if<std::is_base_of<T, D>{}, int>::type = 0>
-    expr_node& operator=(expr_node<D>&& other) {
-        m_data = std::move(other.m_data);
-        return *this;
-    }
+    static constexpr const std::size_t unknown_position = std::numeric_limits<std::size_t>::max();
 
-    ExprNode* release() const {
-        return m_data.release();
-    }
+    ExprNode() = default;
 
-    ExprNode* get() const {
-        return m_data.get();
+    virtual ~ExprNode() {
     }
 
-}; // class expr_node
-
-class ExprNode {
-
-protected:
+    virtual expr_node_type expression_type() const noexcept = 0;
 
-    virtual void do_print(std::ostream& out, int level) const = 0;
+    // Position of the expression in the input of the parser.
+    std::size_t position() const noexcept {
+        return m_position;
+    }
 
-public:
+    void set_position(std::size_t position) noexcept {
+        m_position = position;
+    }
 
-    ExprNode() = default;
+    // Static type and evaluation context. They are set by the semantic
+    // analysis after parsing (see OSMObjectFilter).
+    expr_value_type static_type() const noexcept {
+        return m_static_type;
+    }
 
-    virtual ~ExprNode() {
+    eval_context context() const noexcept {
+        return m_context;
     }
 
-    virtual expr_node_type expression_type() const noexcept = 0;
+    void set_static_type(expr_value_type type, eval_context context) noexcept {
+        m_static_type = type;
+        m_context = context;
+    }
 
     virtual entity_bits_pair calc_entities() const noexcept {
         return std::make_pair(osmium::osm_entity_bits::nwr,
                               osmium::osm_entity_bits::nwr);
     }
 
+    // Returns the range of values the integer attribute attr can have in
+    // all objects this (boolean) expression can be true for. This can be
+    // larger than the real range, but never smaller.
+    virtual integer_range calc_range(integer_attribute_type /*attr*/) const noexcept {
+        return full_integer_range();
+    }
+
     void indent(std::ostream& out, int level) const {
         while (level > 0) {
             out << ' ';
@@ -290,143 +329,15 @@ public:
     virtual void prepare() {
     }
 
-    virtual bool eval_bool(const osmium::OSMObject& /*object*/) const {
-        throw std::runtime_error{"Expected a bool expression"};
-    }
-
-    virtual std::int64_t eval_int(const osmium::OSMObject& /*object*/) const {
-        throw std::runtime_error{"Expected an integer expression"};
-    }
-
-    virtual const char* eval_string(const osmium::OSMObject& /*object*/) const {
-        throw std::runtime_error{"Expected a string expression"};
-    }
-
-    virtual bool eval_bool(const osmium::Tag& /*tag*/) const {
-        throw std::runtime_error{"Expected a bool expression for tags"};
-    }
-
-    virtual std::int64_t eval_int(const osmium::Tag& /*tag*/) const {
-        throw std::runtime_error{"Expected an integer expression for tags"};
-    }
-
-    virtual const char* eval_string(const osmium::Tag& /*tag*/) const {
-        throw std::runtime_error{"Expected a string expression for tags"};
-    }
-
-    virtual bool eval_bool(const osmium::NodeRef& /*nr*/) const {
-        throw std::runtime_error{"Expected a bool expression for a node ref"};
-    }
-
-    virtual std::int64_t eval_int(const osmium::NodeRef& /*nr*/) const {
-        throw std::runtime_error{"Expected an integer expression for node refs"};
-    }
-
-    virtual const char* eval_string(const osmium::NodeRef& /*nr*/) const {
-        throw std::runtime_error{"Expected a string expression for node refs"};
-    }
-
-    virtual bool eval_bool(const osmium::RelationMember& /*member*/) const {
-        throw std::runtime_error{"Expected a bool expression for members"};
-    }
-
-    virtual std::int64_t eval_int(const osmium::RelationMember& /*member*/) const {
-        throw std::runtime_error{"Expected an integer expression for members"};
-    }
-
-    virtual const char* eval_string(const osmium::RelationMember& /*member*/) const {
-        throw std::runtime_error{"Expected a string expression for member"};
+    // Reorder subexpressions and pick evaluation strategies using the
+    // cost model (see OSMObjectFilter::optimize()). This must not change
+    // the result of the expression.
+    virtual void optimize(const CostModel& /*model*/) {
     }
 
 }; // class ExprNode
 
-class BoolExpression : public ExprNode {
-
-public:
-
-    std::int64_t eval_int(const osmium::OSMObject& object) const override final {
-        return eval_bool(object) ? 1 : 0;
-    }
-
-    std::int64_t eval_int(const osmium::Tag& tag) const override final {
-        return eval_bool(tag) ? 1 : 0;
-    }
-
-    std::int64_t eval_int(const osmium::NodeRef& nr) const override final {
-        return eval_bool(nr) ? 1 : 0;
-    }
-
-    std::int64_t eval_int(const osmium::RelationMember& member) const override final {
-        return eval_bool(member) ? 1 : 0;
-    }
-
-}; // class BoolExpression
-
-class IntegerExpression : public ExprNode {
-
-public:
-
-    bool eval_bool(const osmium::OSMObject& object) const override final {
-        return eval_int(object) > 0;
-    }
-
-    bool eval_bool(const osmium::Tag& tag) const override final {
-        return eval_int(tag) > 0;
-    }
-
-    bool eval_bool(const osmium::NodeRef& nr) const override final {
-        return eval_int(nr) > 0;
-    }
-
-    bool eval_bool(const osmium::RelationMember& member) const override final {
-        return eval_int(member) > 0;
-    }
-
-}; // class IntegerExpression
-
-class StringExpression : public ExprNode {
-
-public:
-
-    bool eval_bool(const osmium::OSMObject& object) const override final {
-        const char* str = eval_string(object);
-        return str && str[0] != '\0';
-    }
-
-    std::int64_t eval_int(const osmium::OSMObject& object) const override final {
-        return std::atoll(eval_string(object));
-    }
-
-    bool eval_bool(const osmium::Tag& tag) const override final {
-        const char* str = eval_string(tag);
-        return str && str[0] != '\0';
-    }
-
-    std::int64_t eval_int(const osmium::Tag& tag) const override final {
-        return std::atoll(eval_string(tag));
-    }
-
-    bool eval_bool(const osmium::NodeRef& nr) const override final {
-        const char* str = eval_string(nr);
-        return str && str[0] != '\0';
-    }
-
-    std::int64_t eval_int(const osmium::NodeRef& nr) const override final {
-        return std::atoll(eval_string(nr));
-    }
-
-    bool eval_bool(const osmium::RelationMember& member) const override final {
-        const char* str = eval_string(member);
-        return str && str[0] != '\0';
-    }
-
-    std::int64_t eval_int(const osmium::RelationMember& member) const override final {
-        return std::atoll(eval_string(member));
-    }
-
-}; // class StringExpression
-
-class BooleanValue : public BoolExpression {
+class BooleanValue : public ExprNode {
 
     bool m_value;
 
@@ -446,25 +357,13 @@ public:
         return expr_node_type::bool_value;
     }
 
-    bool eval_bool(const osmium::OSMObject& /*object*/) const noexcept override final {
-        return m_value;
-    }
-
-    bool eval_bool(const osmium::Tag& /*tag*/) const noexcept override final {
-        return m_value;
-    }
-
-    bool eval_bool(const osmium::NodeRef& /*nr*/) const noexcept override final {
-        return m_value;
-    }
-
-    bool eval_bool(const osmium::RelationMember& /*member*/) const noexcept override final {
+    bool value() const noexcept {
         return m_value;
     }
 
 }; // class BooleanValue
 
-class WithSubExpr : public BoolExpression {
+class WithSubExpr : public ExprNode {
 
     std::vector<std::unique_ptr<ExprNode>> m_children;
 
@@ -479,13 +378,6 @@ public:
 #endif
     }
 
-    explicit WithSubExpr(const std::vector<expr_node<ExprNode>>& children) {
-        for (auto& child : children) {
-            assert(child.get());
-            m_children.emplace_back(child.release());
-        }
-    }
-
     const std::vector<std::unique_ptr<ExprNode>>& children() const noexcept {
         return m_children;
     }
@@ -496,19 +388,14 @@ public:
         }
     }
 
+    // Sort children so that the ones most likely to decide the result
+    // cheaply are evaluated first.
+    void optimize(const CostModel& model) override final;
+
 }; // class WithSubExpr
 
 class AndExpr : public WithSubExpr {
 
-    template <typename T>
-    bool eval_bool_impl(const T& t) const {
-        const auto it = std::find_if(children().cbegin(), children().cend(), [&t](const std::unique_ptr<ExprNode>& e){
-            return !e->eval_bool(t);
-        });
-
-        return it == children().cend();
-    }
-
 protected:
 
     void do_print(std::ostream& out, int level) const override final {
@@ -524,10 +411,6 @@ public:
         WithSubExpr(std::move(children)) {
     }
 
-    explicit AndExpr(const std::vector<expr_node<ExprNode>>& children) :
-        WithSubExpr(children) {
-    }
-
     expr_node_type expression_type() const noexcept override final {
         return expr_node_type::and_expr;
     }
@@ -540,35 +423,17 @@ public:
         });
     }
 
-    bool eval_bool(const osmium::OSMObject& object) const override final {
-        return eval_bool_impl(object);
-    }
-
-    bool eval_bool(const osmium::Tag& tag) const override final {
-        return eval_bool_impl(tag);
-    }
-
-    bool eval_bool(const osmium::NodeRef& nr) const override final {
-        return eval_bool_impl(nr);
-    }
-
-    bool eval_bool(const osmium::RelationMember& member) const override final {
-        return eval_bool_impl(member);
+    integer_range calc_range(integer_attribute_type attr) const noexcept override final {
+        return std::accumulate(children().begin(), children().end(), full_integer_range(), [attr](integer_range r, const std::unique_ptr<ExprNode>& e) {
+            const auto x = e->calc_range(attr);
+            return std::make_pair(std::max(r.first, x.first), std::min(r.second, x.second));
+        });
     }
 
 }; // class AndExpr
 
 class OrExpr : public WithSubExpr {
 
-    template <typename T>
-    bool eval_bool_impl(const T& t) const {
-        const auto it = std::find_if(children().cbegin(), children().cend(), [&t](const std::unique_ptr<ExprNode>& e){
-            return e->eval_bool(t);
-        });
-
-        return it != children().cend();
-    }
-
 protected:
 
     void do_print(std::ostream& out, int level) const override final {
@@ -584,10 +449,6 @@ public:
         WithSubExpr(std::move(children)) {
     }
 
-    explicit OrExpr(const std::vector<expr_node<ExprNode>>& children) :
-        WithSubExpr(children) {
-    }
-
     expr_node_type expression_type() const noexcept override final {
         return expr_node_type::or_expr;
     }
@@ -600,25 +461,17 @@ public:
         });
     }
 
-    bool eval_bool(const osmium::OSMObject& object) const override final {
-        return eval_bool_impl(object);
-    }
-
-    bool eval_bool(const osmium::Tag& tag) const override final {
-        return eval_bool_impl(tag);
-    }
-
-    bool eval_bool(const osmium::NodeRef& nr) const override final {
-        return eval_bool_impl(nr);
-    }
-
-    bool eval_bool(const osmium::RelationMember& member) const override final {
-        return eval_bool_impl(member);
+    integer_range calc_range(integer_attribute_type attr) const noexcept override final {
+        const auto range = std::make_pair(std::numeric_limits<std::int64_t>::max(), std::numeric_limits<std::int64_t>::min());
+        return std::accumulate(children().begin(), children().end(), range, [attr](integer_range r, const std::unique_ptr<ExprNode>& e) {
+            const auto x = e->calc_range(attr);
+            return std::make_pair(std::min(r.first, x.first), std::max(r.second, x.second));
+        });
     }
 
 }; // class OrExpr
 
-class NotExpr : public BoolExpression {
+class NotExpr : public ExprNode {
 
     std::unique_ptr<ExprNode> m_expr;
 
@@ -637,16 +490,11 @@ public:
         assert(m_expr);
     }
 
-    explicit NotExpr(expr_node<ExprNode> expr) :
-        m_expr(expr.release()) {
-        assert(m_expr);
-    }
-
     expr_node_type expression_type() const noexcept override final {
         return expr_node_type::not_expr;
     }
 
-    const ExprNode* expr() const noexcept {
+    ExprNode* expr() const noexcept {
         return m_expr.get();
     }
 
@@ -659,25 +507,13 @@ public:
         m_expr->prepare();
     }
 
-    bool eval_bool(const osmium::OSMObject& object) const override final {
-        return !expr()->eval_bool(object);
-    }
-
-    bool eval_bool(const osmium::Tag& tag) const override final {
-        return !expr()->eval_bool(tag);
-    }
-
-    bool eval_bool(const osmium::NodeRef& nr) const override final {
-        return !expr()->eval_bool(nr);
-    }
-
-    bool eval_bool(const osmium::RelationMember& member) const override final {
-        return !expr()->eval_bool(member);
+    void optimize(const CostModel& model) override final {
+        m_expr->optimize(model);
     }
 
 }; // class NotExpr
 
-class IntegerValue : public IntegerExpression {
+class IntegerValue : public ExprNode {
 
     std::int64_t m_value;
 
@@ -701,25 +537,9 @@ public:
         return m_value;
     }
 
-    std::int64_t eval_int(const osmium::OSMObject& /*object*/) const noexcept override final {
-        return m_value;
-    }
-
-    std::int64_t eval_int(const osmium::Tag& /*tag*/) const noexcept override final {
-        return m_value;
-    }
-
-    std::int64_t eval_int(const osmium::NodeRef& /*nr*/) const noexcept override final {
-        return m_value;
-    }
-
-    std::int64_t eval_int(const osmium::RelationMember& /*member*/) const noexcept override final {
-        return m_value;
-    }
-
 }; // class IntegerValue
 
-class StringValue : public StringExpression {
+class StringValue : public ExprNode {
 
     std::string m_value;
 
@@ -743,22 +563,6 @@ public:
         return m_value;
     }
 
-    const char* eval_string(const osmium::OSMObject& /*object*/) const noexcept override final {
-        return m_value.c_str();
-    }
-
-    const char* eval_string(const osmium::Tag& /*tag*/) const noexcept override final {
-        return m_value.c_str();
-    }
-
-    const char* eval_string(const osmium::NodeRef& /*nr*/) const noexcept override final {
-        return m_value.c_str();
-    }
-
-    const char* eval_string(const osmium::RelationMember& /*member*/) const noexcept override final {
-        return m_value.c_str();
-    }
-
 }; // class StringValue
 
 class RegexValue : public ExprNode {
@@ -794,7 +598,7 @@ public:
 
 }; // class RegexValue
 
-class IntegerAttribute : public IntegerExpression {
+class IntegerAttribute : public ExprNode {
 
     integer_attribute_type m_attribute;
 
@@ -818,36 +622,9 @@ public:
         return m_attribute;
     }
 
-    std::int64_t eval_int(const osmium::OSMObject& object) const override final {
-        switch (m_attribute) {
-            case integer_attribute_type::id:
-                return object.id();
-            case integer_attribute_type::version:
-                return object.version();
-            case integer_attribute_type::changeset:
-                return object.changeset();
-            case integer_attribute_type::uid:
-                return object.uid();
-            default:
-                break;
-        }
-
-        throw std::runtime_error{"should never be here"};
-    }
-
-    std::int64_t eval_int(const osmium::NodeRef& nr) const override final {
-        assert(m_attribute == integer_attribute_type::ref);
-        return nr.ref();
-    }
-
-    std::int64_t eval_int(const osmium::RelationMember& member) const override final {
-        assert(m_attribute == integer_attribute_type::ref);
-        return member.ref();
-    }
-
 }; // class IntegerAttribute
 
-class StringAttribute : public StringExpression {
+class StringAttribute : public ExprNode {
 
     string_attribute_type m_attribute;
 
@@ -871,31 +648,9 @@ public:
         return m_attribute;
     }
 
-    const char* eval_string(const osmium::OSMObject& object) const override final {
-        assert(m_attribute == string_attribute_type::user);
-
-        return object.user();
-    }
-
-    const char* eval_string(const osmium::Tag& tag) const override final {
-        if (m_attribute == string_attribute_type::key) {
-            return tag.key();
-        } else if (m_attribute == string_attribute_type::value) {
-            return tag.value();
-        }
-
-        throw std::runtime_error{"should never be here"};
-    }
-
-    const char* eval_string(const osmium::RelationMember& member) const override final {
-        assert(m_attribute == string_attribute_type::role);
-
-        return member.role();
-    }
-
 }; // class StringAttribute
 
-class BooleanAttribute : public BoolExpression {
+class BooleanAttribute : public ExprNode {
 
     boolean_attribute_type m_attribute;
 
@@ -939,54 +694,14 @@ public:
         return std::make_pair(osmium::osm_entity_bits::nothing, osmium::osm_entity_bits::nothing);
     }
 
-    bool eval_bool(const osmium::OSMObject& object) const override final {
-        switch (m_attribute) {
-            case boolean_attribute_type::node:
-                return object.type() == osmium::item_type::node;
-            case boolean_attribute_type::way:
-                return object.type() == osmium::item_type::way;
-            case boolean_attribute_type::relation:
-                return object.type() == osmium::item_type::relation;
-            case boolean_attribute_type::visible:
-                return object.visible();
-            case boolean_attribute_type::closed_way:
-                return object.type() == osmium::item_type::way && static_cast<const osmium::Way&>(object).is_closed();
-            case boolean_attribute_type::open_way:
-                return object.type() == osmium::item_type::way && !static_cast<const osmium::Way&>(object).is_closed();
-        }
-
-        throw std::runtime_error{"should never be here"};
-    }
-
 }; // class BooleanAttribute
 
-class BinaryIntOperation : public BoolExpression {
+class BinaryIntOperation : public ExprNode {
 
     std::unique_ptr<ExprNode> m_lhs;
     std::unique_ptr<ExprNode> m_rhs;
     integer_op_type m_op;
 
-    bool compare(std::int64_t lhs, std::int64_t rhs) const {
-        switch (m_op) {
-            case integer_op_type::equal:
-                return lhs == rhs;
-            case integer_op_type::not_equal:
-                return lhs != rhs;
-            case integer_op_type::less_than:
-                return lhs < rhs;
-            case integer_op_type::less_or_equal:
-                return lhs <= rhs;
-            case integer_op_type::greater_than:
-                return lhs > rhs;
-            case integer_op_type::greater_or_equal:
-                return lhs >= rhs;
-            default:
-                break;
-        }
-
-        throw std::runtime_error{"unknown op"};
-    }
-
 protected:
 
     void do_print(std::ostream& out, int level) const override final {
@@ -1003,14 +718,8 @@ public:
         m_lhs(std::move(lhs)),
         m_rhs(std::move(rhs)),
         m_op(op) {
-        assert(lhs);
-        assert(rhs);
-    }
-
-    explicit BinaryIntOperation(const std::tuple<expr_node<ExprNode>, integer_op_type, expr_node<ExprNode>>& params) noexcept :
-        m_lhs(std::get<0>(params).release()),
-        m_rhs(std::get<2>(params).release()),
-        m_op(std::get<1>(params)) {
+        assert(m_lhs);
+        assert(m_rhs);
     }
 
     expr_node_type expression_type() const noexcept override final {
@@ -1035,58 +744,64 @@ public:
         return m_op;
     }
 
-    void prepare() override final {
-        lhs()->prepare();
-        rhs()->prepare();
-    }
+    integer_range calc_range(integer_attribute_type attr) const noexcept override final {
+        const auto is_attr = [attr](const ExprNode* e) {
+            return e->expression_type() == expr_node_type::integer_attribute &&
+                   static_cast<const IntegerAttribute*>(e)->attribute() == attr;
+        };
+
+        const auto is_value = [](const ExprNode* e) {
+            return e->expression_type() == expr_node_type::integer_value;
+        };
+
+        auto op = m_op;
+        std::int64_t value;
+        if (is_attr(lhs()) && is_value(rhs())) {
+            value = static_cast<const IntegerValue*>(rhs())->value();
+        } else if (is_value(lhs()) && is_attr(rhs())) {
+            value = static_cast<const IntegerValue*>(lhs())->value();
+            op = mirrored_op(op);
+        } else {
+            return full_integer_range();
+        }
+
+        const auto range = full_integer_range();
+        switch (op) {
+            case integer_op_type::equal:
+                return std::make_pair(value, value);
+            case integer_op_type::less_than:
+                return value == range.first ? std::make_pair(range.second, range.first) : std::make_pair(range.first, value - 1);
+            case integer_op_type::less_or_equal:
+                return std::make_pair(range.first, value);
+            case integer_op_type::greater_than:
+                return value == range.second ? std::make_pair(range.second, range.first) : std::make_pair(value + 1, range.second);
+            case integer_op_type::greater_or_equal:
+                return std::make_pair(value, range.second);
+            default:
+                break;
+        }
 
-    bool eval_bool(const osmium::OSMObject& object) const override final {
-        return compare(lhs()->eval_int(object),
-                       rhs()->eval_int(object));
+        return range;
     }
 
-    bool eval_bool(const osmium::NodeRef& nr) const override final {
-        return compare(lhs()->eval_int(nr),
-                       rhs()->eval_int(nr));
+    void prepare() override final {
+        lhs()->prepare();
+        rhs()->prepare();
     }
 
-    bool eval_bool(const osmium::RelationMember& member) const override final {
-        return compare(lhs()->eval_int(member),
-                       rhs()->eval_int(member));
+    void optimize(const CostModel& model) override final {
+        lhs()->optimize(model);
+        rhs()->optimize(model);
     }
 
 }; // class BinaryIntOperation
 
-class BinaryStrOperation : public BoolExpression {
+class BinaryStrOperation : public ExprNode {
 
     std::unique_ptr<ExprNode> m_lhs;
     std::unique_ptr<ExprNode> m_rhs;
     string_op_type m_op;
 
-    template <typename T>
-    bool eval_bool_impl(const T& t) const {
-        const char* value = lhs()->eval_string(t);
-
-        switch (m_op) {
-            case string_op_type::equal:
-                return !std::strcmp(value, m_rhs->eval_string(t));
-            case string_op_type::not_equal:
-                return std::strcmp(value, m_rhs->eval_string(t));
-            case string_op_type::prefix_equal:
-                return !std::strncmp(value, m_rhs->eval_string(t), std::strlen(m_rhs->eval_string(t)));
-            case string_op_type::prefix_not_equal:
-                return std::strncmp(value, m_rhs->eval_string(t), std::strlen(m_rhs->eval_string(t)));
-            case string_op_type::match:
-                return std::regex_search(value, *(dynamic_cast<RegexValue*>(rhs())->value()));
-            case string_op_type::not_match:
-                return !std::regex_search(value, *(dynamic_cast<RegexValue*>(rhs())->value()));
-            default:
-                break;
-        }
-
-        throw std::runtime_error{"unknown op"};
-    }
-
 protected:
 
     void do_print(std::ostream& out, int level) const override final {
@@ -1103,14 +818,8 @@ public:
         m_lhs(std::move(lhs)),
         m_rhs(std::move(rhs)),
         m_op(op) {
-        assert(lhs);
-        assert(rhs);
-    }
-
-    explicit BinaryStrOperation(const std::tuple<expr_node<ExprNode>, string_op_type, expr_node<ExprNode>>& params) noexcept :
-        m_lhs(std::get<0>(params).release()),
-        m_rhs(std::get<2>(params).release()),
-        m_op(std::get<1>(params)) {
+        assert(m_lhs);
+        assert(m_rhs);
     }
 
     expr_node_type expression_type() const noexcept override final {
@@ -1140,21 +849,9 @@ public:
         rhs()->prepare();
     }
 
-    bool eval_bool(const osmium::OSMObject& object) const override final {
-        return eval_bool_impl(object);
-    }
-
-    bool eval_bool(const osmium::Tag& tag) const override final {
-        return eval_bool_impl(tag);
-    }
-
-    bool eval_bool(const osmium::RelationMember& member) const override final {
-        return eval_bool_impl(member);
-    }
-
 }; // class BinaryStrOperation
 
-class TagsExpr : public IntegerExpression {
+class TagsExpr : public ExprNode {
 
     std::unique_ptr<ExprNode> m_expr;
 
@@ -1176,11 +873,6 @@ public:
         assert(m_expr);
     }
 
-    explicit TagsExpr(expr_node<ExprNode> expr) :
-        m_expr(expr.release()) {
-        assert(m_expr);
-    }
-
     expr_node_type expression_type() const noexcept override final {
         return expr_node_type::tags_expr;
     }
@@ -1193,15 +885,13 @@ public:
         m_expr->prepare();
     }
 
-    std::int64_t eval_int(const osmium::OSMObject& object) const override final {
-        return std::count_if(object.tags().cbegin(), object.tags().cend(), [this](const osmium::Tag& tag){
-            return expr()->eval_bool(tag);
-        });
+    void optimize(const CostModel& model) override final {
+        m_expr->optimize(model);
     }
 
 }; // class TagsExpr
 
-class NodesExpr : public IntegerExpression {
+class NodesExpr : public ExprNode {
 
     std::unique_ptr<ExprNode> m_expr;
 
@@ -1223,11 +913,6 @@ public:
         assert(m_expr);
     }
 
-    explicit NodesExpr(expr_node<ExprNode> expr) :
-        m_expr(expr.release()) {
-        assert(m_expr);
-    }
-
     expr_node_type expression_type() const noexcept override final {
         return expr_node_type::nodes_expr;
     }
@@ -1240,15 +925,8 @@ public:
         m_expr->prepare();
     }
 
-    std::int64_t eval_int(const osmium::OSMObject& object) const override final {
-        if (object.type() != osmium::item_type::way) {
-            return 0;
-        }
-
-        const auto& nodes = static_cast<const osmium::Way&>(object).nodes();
-        return std::count_if(nodes.cbegin(), nodes.cend(), [this](const osmium::NodeRef& nr){
-            return expr()->eval_bool(nr);
-        });
+    void optimize(const CostModel& model) override final {
+        m_expr->optimize(model);
     }
 
     entity_bits_pair calc_entities() const noexcept override final {
@@ -1258,7 +936,7 @@ public:
 
 }; // class NodesExpr
 
-class MembersExpr : public IntegerExpression {
+class MembersExpr : public ExprNode {
 
     std::unique_ptr<ExprNode> m_expr;
 
@@ -1280,11 +958,6 @@ public:
         assert(m_expr);
     }
 
-    explicit MembersExpr(expr_node<ExprNode> expr) :
-        m_expr(expr.release()) {
-        assert(m_expr);
-    }
-
     expr_node_type expression_type() const noexcept override final {
         return expr_node_type::members_expr;
     }
@@ -1297,15 +970,8 @@ public:
         m_expr->prepare();
     }
 
-    std::int64_t eval_int(const osmium::OSMObject& object) const override final {
-        if (object.type() != osmium::item_type::relation) {
-            return 0;
-        }
-
-        const auto& members = static_cast<const osmium::Relation&>(object).members();
-        return std::count_if(members.cbegin(), members.cend(), [this](const osmium::RelationMember& member){
-            return expr()->eval_bool(member);
-        });
+    void optimize(const CostModel& model) override final {
+        m_expr->optimize(model);
     }
 
     entity_bits_pair calc_entities() const noexcept override final {
@@ -1315,7 +981,7 @@ public:
 
 }; // class MembersExpr
 
-class CheckHasKeyExpr : public BoolExpression {
+class CheckHasKeyExpr : public ExprNode {
 
     std::string m_key;
 
@@ -1339,13 +1005,9 @@ public:
         return m_key.c_str();
     }
 
-    bool eval_bool(const osmium::OSMObject& object) const noexcept override final {
-        return object.tags().has_key(m_key.c_str());
-    }
-
 }; // class CheckHasKeyExpr
 
-class CheckTagStrExpr : public BoolExpression {
+class CheckTagStrExpr : public ExprNode {
 
     std::string m_key;
     std::string m_value;
@@ -1367,10 +1029,6 @@ public:
         m_op(op) {
     }
 
-    explicit CheckTagStrExpr(const std::tuple<std::string, string_op_type, std::string>& params) :
-        CheckTagStrExpr(std::get<0>(params), std::get<1>(params), std::get<2>(params)) {
-    }
-
     expr_node_type expression_type() const noexcept override final {
         return expr_node_type::check_tag_str;
     }
@@ -1387,18 +1045,9 @@ public:
         return m_value.c_str();
     }
 
-    bool eval_bool(const osmium::OSMObject& object) const noexcept override final {
-        const char* tag_value = object.tags().get_value_by_key(m_key.c_str());
-        if (!tag_value) {
-            return false;
-        }
-        const bool has_tag = !std::strcmp(tag_value, value());
-        return m_op == string_op_type::equal ? has_tag : !has_tag;
-    }
-
 }; // class CheckTagStrExpr
 
-class CheckTagRegexExpr : public BoolExpression {
+class CheckTagRegexExpr : public ExprNode {
 
     std::string m_key;
     std::string m_value;
@@ -1417,12 +1066,12 @@ public:
     explicit CheckTagRegexExpr(const std::string& key,
                                string_op_type op,
                                const std::string& value,
-                               const boost::optional<char>& ci) :
+                               bool case_insensitive) :
         m_key(key),
         m_value(value),
         m_value_regex(),
         m_op(op),
-        m_case_insensitive(ci == 'i') {
+        m_case_insensitive(case_insensitive) {
         auto options = std::regex::nosubs | std::regex::optimize;
         if (m_case_insensitive) {
             options |= std::regex::icase;
@@ -1430,10 +1079,6 @@ public:
         m_value_regex = std::regex{m_value, options};
     }
 
-    explicit CheckTagRegexExpr(const std::tuple<std::string, string_op_type, std::string, boost::optional<char>>& params) :
-        CheckTagRegexExpr(std::get<0>(params), std::get<1>(params), std::get<2>(params), std::get<3>(params)) {
-    }
-
     expr_node_type expression_type() const noexcept override final {
         return expr_node_type::check_tag_regex;
     }
@@ -1454,21 +1099,61 @@ public:
         return m_case_insensitive;
     }
 
-    bool eval_bool(const osmium::OSMObject& object) const noexcept override final {
-        const char* tag_value = object.tags().get_value_by_key(m_key.c_str());
-        if (!tag_value) {
-            return false;
+}; // class CheckTagRegexExpr
+
+// IDs in a sorted vector with O(log n) lookups. Used instead of an
+// IdSetDense for long literal lists with negative or far apart values.
+class SortedIdSet : public osmium::index::IdSet<std::uint64_t> {
+
+    std::vector<std::uint64_t> m_ids;
+
+public:
+
+    template <typename TIterator>
+    SortedIdSet(TIterator begin, TIterator end) :
+        m_ids(begin, end) {
+        std::sort(m_ids.begin(), m_ids.end());
+        m_ids.erase(std::unique(m_ids.begin(), m_ids.end()), m_ids.end());
+    }
+
+    void set(std::uint64_t id) override final {
+        const auto it = std::lower_bound(m_ids.begin(), m_ids.end(), id);
+        if (it == m_ids.end() || *it != id) {
+            m_ids.insert(it, id);
         }
-        const bool has_tag = std::regex_search(tag_value, m_value_regex);
-        return m_op == string_op_type::match ? has_tag : !has_tag;
     }
 
-}; // class CheckTagRegexExpr
+    bool get(std::uint64_t id) const noexcept override final {
+        return std::binary_search(m_ids.cbegin(), m_ids.cend(), id);
+    }
+
+    bool empty() const override final {
+        return m_ids.empty();
+    }
 
-class InIntegerList : public BoolExpression {
+    void clear() override final {
+        m_ids.clear();
+    }
+
+    std::size_t used_memory() const noexcept override final {
+        return m_ids.capacity() * sizeof(std::uint64_t);
+    }
+
+}; // class SortedIdSet
+
+class InIntegerList : public ExprNode {
 
     std::unique_ptr<ExprNode> m_attr;
     std::unique_ptr<osmium::index::IdSet<std::uint64_t>> m_values;
+
+    // Copy of a literal list in a set with faster lookups if optimize()
+    // decided to use it instead of the linear search.
+    std::unique_ptr<osmium::index::IdSet<std::uint64_t>> m_lookup;
+
+    // Largest difference between the values of a list that is copied
+    // into an IdSetDense, which allocates memory for the whole range.
+    static constexpr const std::uint64_t max_dense_range = 1ull << 24;
+
     std::string m_filename;
     list_op_type m_op;
 
@@ -1512,7 +1197,7 @@ protected:
 
 public:
 
-    explicit InIntegerList(std::unique_ptr<ExprNode>& attr, list_op_type op, const std::vector<std::int64_t>& values) :
+    explicit InIntegerList(std::unique_ptr<ExprNode>&& attr, list_op_type op, const std::vector<std::int64_t>& values) :
         m_attr(std::move(attr)),
         m_values(new osmium::index::IdSetSmall<std::uint64_t>),
         m_filename(),
@@ -1523,22 +1208,12 @@ public:
         }
     }
 
-    explicit InIntegerList(const std::tuple<expr_node<ExprNode>, list_op_type, std::vector<std::int64_t>>& params) :
-        m_attr(std::get<0>(params).release()),
-        m_values(new osmium::index::IdSetSmall<std::uint64_t>),
-        m_filename(),
-        m_op(std::get<1>(params)) {
-        assert(m_attr);
-        for (auto value : std::get<2>(params)) {
-            m_values->set(std::uint64_t(value));
-        }
-    }
-
-    explicit InIntegerList(const std::tuple<expr_node<ExprNode>, list_op_type, std::string>& params) :
-        m_attr(std::get<0>(params).release()),
+    // The values are read from the file in prepare().
+    explicit InIntegerList(std::unique_ptr<ExprNode>&& attr, list_op_type op, const std::string& filename) :
+        m_attr(std::move(attr)),
         m_values(),
-        m_filename(std::get<2>(params)),
-        m_op(std::get<1>(params)) {
+        m_filename(filename),
+        m_op(op) {
         assert(m_attr);
     }
 
@@ -1546,6 +1221,51 @@ public:
         return expr_node_type::in_integer_list;
     }
 
+    ExprNode* attr() const noexcept {
+        return m_attr.get();
+    }
+
+    list_op_type op() const noexcept {
+        return m_op;
+    }
+
+    const osmium::index::IdSet<std::uint64_t>* values() const noexcept {
+        return m_lookup ? m_lookup.get() : m_values.get();
+    }
+
+    // Empty for literal lists.
+    const std::string& filename() const noexcept {
+        return m_filename;
+    }
+
+    // Number of values compared one by one on each lookup, 0 if a set
+    // with faster lookups is used.
+    std::size_t linear_size() const noexcept {
+        if (m_lookup || !m_filename.empty()) {
+            return 0;
+        }
+        const auto* ids = dynamic_cast<const osmium::index::IdSetSmall<std::uint64_t>*>(m_values.get());
+        return ids ? ids->size() : 0;
+    }
+
+    integer_range calc_range(integer_attribute_type attr) const noexcept override final {
+        if (m_op != list_op_type::in ||
+            m_attr->expression_type() != expr_node_type::integer_attribute ||
+            static_cast<const IntegerAttribute*>(m_attr.get())->attribute() != attr) {
+            return full_integer_range();
+        }
+
+        const auto* ids = dynamic_cast<const osmium::index::IdSetSmall<std::uint64_t>*>(m_values.get());
+        if (!ids || ids->empty()) {
+            return full_integer_range();
+        }
+
+        const auto minmax = std::minmax_element(ids->cbegin(), ids->cend(), [](std::uint64_t a, std::uint64_t b) {
+            return std::int64_t(a) < std::int64_t(b);
+        });
+        return std::make_pair(std::int64_t(*minmax.first), std::int64_t(*minmax.second));
+    }
+
     void prepare() override final {
         m_attr->prepare();
         if (!m_filename.empty()) {
@@ -1558,70 +1278,1302 @@ public:
         }
     }
 
-    bool eval_bool(const osmium::OSMObject& object) const noexcept override final {
-        assert(m_values);
-        const std::int64_t value = m_attr->eval_int(object);
-        const bool comp = m_values->get(std::uint64_t(value));
-        return comp == (m_op == list_op_type::in);
-    }
+    // Use a set with faster lookups for long literal lists.
+    void optimize(const CostModel& model) override final;
 
 }; // class InIntegerList
 
-class expression_parser_error : public std::runtime_error {
+// Is the value in one of a list of ranges? Used for lists with ranges
+// ("@timestamp in (2016-01-01:2016-12-31, ...)"), single values in the
+// list are stored as ranges containing only that value.
+class InIntegerRanges : public ExprNode {
 
-    std::string m_input;
-    int m_pos;
+    std::unique_ptr<ExprNode> m_attr;
+    std::vector<integer_range> m_ranges;
+    list_op_type m_op;
+
+protected:
+
+    void do_print(std::ostream& out, int level) const override final {
+        out << "IN_INT_RANGES[" << operator_name(m_op) << "]\n";
+        m_attr->print(out, level + 1);
+        indent(out, level + 1);
+        out << "RANGES[";
+        auto it = m_ranges.cbegin();
+        for (int i = 5; i > 0 && it != m_ranges.cend(); ++it, --i) {
+            if (it != m_ranges.cbegin()) {
+                out << ", ";
+            }
+            out << it->first << ':' << it->second;
+        }
+        if (it != m_ranges.cend()) {
+            out << ", ...";
+        }
+        out << "]\n";
+    }
 
 public:
 
-    expression_parser_error(const std::string& input) :
-        std::runtime_error(std::string{"Expression parsing error"}),
-        m_input(input),
-        m_pos(-1) {
+    // Ranges must not be empty (first > last), the parser checks this.
+    explicit InIntegerRanges(std::unique_ptr<ExprNode>&& attr, list_op_type op, const std::vector<integer_range>& ranges) :
+        m_attr(std::move(attr)),
+        m_ranges(ranges),
+        m_op(op) {
+        assert(m_attr);
+#ifndef NDEBUG
+        for (const auto& range : m_ranges) {
+            assert(range.first <= range.second);
+        }
+#endif
+
+        // Sort and merge overlapping ranges, so a binary search finds
+        // the only range that can contain a value.
+        std::sort(m_ranges.begin(), m_ranges.end());
+        std::vector<integer_range> merged;
+        for (const auto& range : m_ranges) {
+            if (!merged.empty() && range.first <= merged.back().second) {
+                merged.back().second = std::max(merged.back().second, range.second);
+            } else {
+                merged.push_back(range);
+            }
+        }
+        m_ranges = std::move(merged);
     }
 
-    expression_parser_error(const std::string& input, int pos) :
-        std::runtime_error(std::string{"Expression parsing error at position "} + std::to_string(pos)),
-        m_input(input),
-        m_pos(pos) {
+    expr_node_type expression_type() const noexcept override final {
+        return expr_node_type::in_integer_ranges;
     }
 
-    const std::string& input() const noexcept {
-        return m_input;
+    ExprNode* attr() const noexcept {
+        return m_attr.get();
     }
 
-    int pos() const noexcept {
-        return m_pos;
+    list_op_type op() const noexcept {
+        return m_op;
     }
 
-}; // class expression_parser_error
+    const std::vector<integer_range>& ranges() const noexcept {
+        return m_ranges;
+    }
 
-class OSMObjectFilter {
+    integer_range calc_range(integer_attribute_type attr) const noexcept override final {
+        if (m_op != list_op_type::in ||
+            m_attr->expression_type() != expr_node_type::integer_attribute ||
+            static_cast<const IntegerAttribute*>(m_attr.get())->attribute() != attr) {
+            return full_integer_range();
+        }
 
-    std::unique_ptr<ExprNode> m_root = std::unique_ptr<ExprNode>(new BooleanValue);
+        if (m_ranges.empty()) {
+            return std::make_pair(full_integer_range().second, full_integer_range().first);
+        }
+
+        return std::make_pair(m_ranges.front().first, m_ranges.back().second);
+    }
+
+    void prepare() override final {
+        m_attr->prepare();
+    }
+
+    static bool contains(const integer_range* first, const integer_range* last, std::int64_t value) noexcept {
+        const auto it = std::upper_bound(first, last, value, [](std::int64_t v, const integer_range& range) {
+            return v < range.first;
+        });
+        return it != first && value <= std::prev(it)->second;
+    }
+
+}; // class InIntegerRanges
+
+// Base class for spatial predicates ("@location in AREA"). Nodes are
+// checked against their location. Ways are in the area if any of their
+// nodes is, relations if any of their member nodes or ways is. For this
+// the IDs of those nodes and ways have to be collected from the input
+// (see collect()) before the ways and relations are evaluated, which works
+// in a single pass over sorted input. Relation members that are
+// relations are not taken into account.
+class LocationPredicate : public ExprNode {
+
+    using id_set_type = osmium::index::IdSetDense<osmium::unsigned_object_id_type>;
+
+    // These are filled from the input, not from the expression.
+    mutable id_set_type m_nodes;
+    mutable id_set_type m_ways;
+    list_op_type m_op;
+
+protected:
+
+    virtual bool contains(const osmium::Location& location) const noexcept = 0;
 
 public:
 
-    explicit OSMObjectFilter(const std::string& input);
+    explicit LocationPredicate(list_op_type op) :
+        m_op(op) {
+    }
 
-    const ExprNode* root() const noexcept {
-        return m_root.get();
+    list_op_type op() const noexcept {
+        return m_op;
     }
 
-    void print_tree(std::ostream& out) const {
-        m_root->print(out, 0);
+    bool contains(const osmium::Node& node) const noexcept {
+        const auto location = node.location();
+        return location.valid() && contains(location);
     }
 
-    osmium::osm_entity_bits::type entities() const noexcept {
-        return m_root->calc_entities().first;
+    // Remember nodes and ways in the area. Must be called for all nodes
+    // and ways in order before relations and ways are evaluated.
+    void collect(const osmium::OSMObject& object) const {
+        if (object.type() == osmium::item_type::node) {
+            if (contains(static_cast<const osmium::Node&>(object))) {
+                m_nodes.set(object.positive_id());
+            }
+        } else if (object.type() == osmium::item_type::way) {
+            const auto& nodes = static_cast<const osmium::Way&>(object).nodes();
+            if (std::any_of(nodes.cbegin(), nodes.cend(), [this](const osmium::NodeRef& nr) {
+                    return m_nodes.get(nr.positive_ref());
+                })) {
+                m_ways.set(object.positive_id());
+            }
+        }
     }
 
-    void prepare() {
-        return m_root->prepare();
+    bool in_area(const osmium::OSMObject& object) const noexcept {
+        switch (object.type()) {
+            case osmium::item_type::node:
+                return contains(static_cast<const osmium::Node&>(object));
+            case osmium::item_type::way:
+                return m_ways.get(object.positive_id());
+            case osmium::item_type::relation: {
+                    const auto& members = static_cast<const osmium::Relation&>(object).members();
+                    return std::any_of(members.cbegin(), members.cend(), [this](const osmium::RelationMember& member) {
+                        return (member.type() == osmium::item_type::node && m_nodes.get(member.positive_ref())) ||
+                               (member.type() == osmium::item_type::way && m_ways.get(member.positive_ref()));
+                    });
+                }
+            default:
+                break;
+        }
+
+        return false;
     }
 
-    bool match(const osmium::OSMObject& object) const {
-        return m_root->eval_bool(object);
+}; // class LocationPredicate
+
+class LocationInBox : public LocationPredicate {
+
+    osmium::Box m_box;
+
+protected:
+
+    void do_print(std::ostream& out, int /*level*/) const override final {
+        out << "LOCATION_IN_BOX[" << operator_name(op()) << "]["
+            << m_box.bottom_left().lon() << "," << m_box.bottom_left().lat() << ","
+            << m_box.top_right().lon() << "," << m_box.top_right().lat() << "]\n";
+    }
+
+    bool contains(const osmium::Location& location) const noexcept override final {
+        return location.x() >= m_box.bottom_left().x() &&
+               location.x() <= m_box.top_right().x() &&
+               location.y() >= m_box.bottom_left().y() &&
+               location.y() <= m_box.top_right().y();
+    }
+
+public:
+
+    explicit LocationInBox(list_op_type op, double minlon, double minlat, double maxlon, double maxlat) :
+        LocationPredicate(op),
+        m_box(osmium::Location{minlon, minlat}, osmium::Location{maxlon, maxlat}) {
+        if (!m_box.valid() || minlon > maxlon || minlat > maxlat) {
+            throw std::runtime_error{"Invalid bounding box"};
+        }
+    }
+
+    expr_node_type expression_type() const noexcept override final {
+        return expr_node_type::location_in_box;
+    }
+
+    const osmium::Box& box() const noexcept {
+        return m_box;
+    }
+
+}; // class LocationInBox
+
+class LocationInPolygon : public LocationPredicate {
+
+    std::string m_filename;
+    PolygonIndex m_polygon;
+
+protected:
+
+    void do_print(std::ostream& out, int /*level*/) const override final {
+        out << "LOCATION_IN_POLYGON[" << operator_name(op()) << "][" << m_filename << "]\n";
+    }
+
+    bool contains(const osmium::Location& location) const noexcept override final {
+        return m_polygon.contains(location);
+    }
+
+public:
+
+    explicit LocationInPolygon(list_op_type op, const std::string& filename) :
+        LocationPredicate(op),
+        m_filename(filename),
+        m_polygon() {
+    }
+
+    expr_node_type expression_type() const noexcept override final {
+        return expr_node_type::location_in_polygon;
+    }
+
+    const std::string& filename() const noexcept {
+        return m_filename;
+    }
+
+    void prepare() override final {
+        m_polygon = PolygonIndex::from_file(m_filename);
+    }
+
+}; // class LocationInPolygon
+
+/**
+ * Results of the string predicates of an ExprArena on the entries of a
+ * string table, usually the one of a PBF block. Every predicate is
+ * evaluated at most once for each entry, tag checks on the objects from
+ * that block then only look up the string table indexes of their tags.
+ *
+ * One predicate can use several slots (see ExprArena::string_slots()),
+ * results are computed on demand.
+ */
+class StringTableMatcher {
+
+    const char* const* m_strings = nullptr;
+    std::size_t m_size = 0;
+
+    // For each slot and string: -1 not yet known, 0 false, 1 true
+    std::vector<std::int8_t> m_results;
+
+public:
+
+    void reset(const char* const* strings, std::size_t size, std::size_t slots) {
+        m_strings = strings;
+        m_size = size;
+        m_results.assign(slots * size, -1);
+    }
+
+    const char* string(std::uint32_t index) const noexcept {
+        assert(index < m_size);
+        return m_strings[index];
+    }
+
+    std::int8_t& result(std::size_t slot, std::uint32_t index) noexcept {
+        assert(index < m_size);
+        return m_results[slot * m_size + index];
+    }
+
+}; // class StringTableMatcher
+
+// A relation member of a raw_object.
+struct raw_member {
+    osmium::item_type type;
+    std::int64_t ref;
+    const char* role;
+};
+
+/**
+ * The attributes of an OSM object before it is built into a buffer, for
+ * instance while decoding a PBF block. Filters can be evaluated on this,
+ * so objects that don't match don't have to be built at all. Tags are
+ * given as pairs of string table indexes (key and value) into the string
+ * table of the matcher.
+ */
+struct raw_object {
+    osmium::item_type type = osmium::item_type::undefined;
+    std::int64_t id = 0;
+    std::int64_t version = 0;
+    std::int64_t changeset = 0;
+    std::int64_t uid = 0;
+    std::int64_t timestamp = 0; // seconds since the epoch
+    const char* user = "";
+    bool visible = true;
+    osmium::Location location{};
+
+    const std::uint32_t* tags = nullptr;
+    const std::uint32_t* tags_end = nullptr;
+    const std::int64_t* refs = nullptr; // node IDs of ways
+    const std::int64_t* refs_end = nullptr;
+    const raw_member* members = nullptr;
+    const raw_member* members_end = nullptr;
+
+    StringTableMatcher* matcher = nullptr;
+};
+
+// A tag of a raw_object.
+struct indexed_tag {
+    std::uint32_t key;
+    std::uint32_t value;
+    StringTableMatcher& matcher;
+};
+
+/**
+ * Compact form of an expression tree used for evaluation.
+ *
+ * All nodes are stored in one vector in pre-order, so evaluation walks
+ * through memory mostly front to back. The first child of a node is
+ * always the next node in the vector, further children are found through
+ * the "next" index, which points to the node after the subtree. Constant
+ * strings are interned into a single string pool, regexes and ID sets
+ * are referenced from the expression tree, which must outlive the arena.
+ *
+ * Tag checks get slots in a StringTableMatcher, so they can be evaluated
+ * on string table indexes instead of the strings (see raw_object).
+ */
+class ExprArena {
+
+public:
+
+    struct node {
+        expr_node_type type;
+        std::uint8_t op;       // operator or attribute, depending on type
+        std::uint8_t padding = 0;
+        std::uint16_t slot = 0; // first StringTableMatcher slot + 1, 0 if none
+        std::uint32_t next;    // index of the node after this subtree
+        std::uint32_t str;     // offset into the string pool or range table
+                               // (for binary_str_op: the rhs string)
+        union {
+            std::int64_t value;
+            std::uint32_t str2;
+            std::uint32_t count;
+            const std::regex* regex;
+            const osmium::index::IdSet<std::uint64_t>* ids;
+            const LocationPredicate* location;
+        };
+
+        explicit node(expr_node_type t) noexcept :
+            type(t),
+            op(0),
+            next(0),
+            str(0),
+            value(0) {
+        }
+    };
+
+    static_assert(sizeof(node) == 24, "unexpected padding in ExprArena::node");
+
+private:
+
+    std::vector<node> m_nodes;
+    std::vector<char> m_strings;
+    std::vector<integer_range> m_ranges;
+    std::vector<const LocationPredicate*> m_location_predicates;
+    std::vector<std::string> m_input_files;
+    std::size_t m_string_slots = 0;
+    object_parts::type m_used_parts = object_parts::nothing;
+
+    std::uint32_t intern(const std::string& str, std::map<std::string, std::uint32_t>& index) {
+        const auto it = index.find(str);
+        if (it != index.end()) {
+            return it->second;
+        }
+        const auto offset = static_cast<std::uint32_t>(m_strings.size());
+        m_strings.insert(m_strings.end(), str.cbegin(), str.cend());
+        m_strings.push_back('\0');
+        index.emplace(str, offset);
+        return offset;
+    }
+
+    // Tag checks use one slot for the key and one for the value, binary
+    // string operations on tag keys or values one for the result.
+    void add_slots(node& n, std::size_t count) noexcept {
+        if (m_string_slots + count < std::numeric_limits<std::uint16_t>::max()) {
+            n.slot = static_cast<std::uint16_t>(m_string_slots + 1);
+            m_string_slots += count;
+        }
+    }
+
+    // Parts of the object a node looks at, not counting its children.
+    // Attributes inside tags, node refs, and members expressions are
+    // covered by those.
+    static object_parts::type used_parts(const node& n) noexcept {
+        switch (n.type) {
+            case expr_node_type::integer_attribute:
+                switch (integer_attribute_type(n.op)) {
+                    case integer_attribute_type::version:
+                    case integer_attribute_type::changeset:
+                    case integer_attribute_type::uid:
+                    case integer_attribute_type::timestamp:
+                        return object_parts::metadata;
+                    default:
+                        break;
+                }
+                break;
+            case expr_node_type::string_attribute:
+                if (string_attribute_type(n.op) == string_attribute_type::user) {
+                    return object_parts::metadata;
+                }
+                break;
+            case expr_node_type::boolean_attribute:
+                switch (boolean_attribute_type(n.op)) {
+                    case boolean_attribute_type::visible:
+                        return object_parts::metadata;
+                    case boolean_attribute_type::closed_way:
+                    case boolean_attribute_type::open_way:
+                        return object_parts::node_refs;
+                    default:
+                        break;
+                }
+                break;
+            case expr_node_type::tags_expr:
+            case expr_node_type::check_has_key:
+            case expr_node_type::check_tag_str:
+            case expr_node_type::check_tag_regex:
+                return object_parts::tags;
+            case expr_node_type::nodes_expr:
+                return object_parts::node_refs;
+            case expr_node_type::members_expr:
+                return object_parts::members;
+            case expr_node_type::location_in_box:
+            case expr_node_type::location_in_polygon:
+                // Locations of ways and relations are found through
+                // their node refs and members.
+                return object_parts::all;
+            default:
+                break;
+        }
+        return object_parts::nothing;
+    }
+
+    void add(const ExprNode& expr, std::map<std::string, std::uint32_t>& strings) {
+        const std::size_t pos = m_nodes.size();
+        m_nodes.emplace_back(expr.expression_type());
+
+        switch (expr.expression_type()) {
+            case expr_node_type::and_expr:
+            case expr_node_type::or_expr:
+                for (const auto& child : static_cast<const WithSubExpr&>(expr).children()) {
+                    add(*child, strings);
+                }
+                break;
+            case expr_node_type::not_expr:
+                add(*static_cast<const NotExpr&>(expr).expr(), strings);
+                break;
+            case expr_node_type::bool_value:
+                m_nodes[pos].value = static_cast<const BooleanValue&>(expr).value();
+                break;
+            case expr_node_type::integer_value:
+                m_nodes[pos].value = static_cast<const IntegerValue&>(expr).value();
+                break;
+            case expr_node_type::string_value:
+                m_nodes[pos].str = intern(static_cast<const StringValue&>(expr).value(), strings);
+                break;
+            case expr_node_type::regex_value:
+                m_nodes[pos].regex = static_cast<const RegexValue&>(expr).value();
+                break;
+            case expr_node_type::integer_attribute:
+                m_nodes[pos].op = std::uint8_t(static_cast<const IntegerAttribute&>(expr).attribute());
+                break;
+            case expr_node_type::string_attribute:
+                m_nodes[pos].op = std::uint8_t(static_cast<const StringAttribute&>(expr).attribute());
+                break;
+            case expr_node_type::boolean_attribute:
+                m_nodes[pos].op = std::uint8_t(static_cast<const BooleanAttribute&>(expr).attribute());
+                break;
+            case expr_node_type::binary_int_op: {
+                    const auto& e = static_cast<const BinaryIntOperation&>(expr);
+                    m_nodes[pos].op = std::uint8_t(e.op());
+                    add(*e.lhs(), strings);
+                    add(*e.rhs(), strings);
+                }
+                break;
+            case expr_node_type::binary_str_op: {
+                    const auto& e = static_cast<const BinaryStrOperation&>(expr);
+                    m_nodes[pos].op = std::uint8_t(e.op());
+                    // Resolve the right hand side here, so evaluation
+                    // does not have to look at it.
+                    if (e.rhs()->expression_type() == expr_node_type::regex_value) {
+                        m_nodes[pos].regex = static_cast<const RegexValue*>(e.rhs())->value();
+                    } else if (e.rhs()->expression_type() == expr_node_type::string_value) {
+                        const auto& value = static_cast<const StringValue*>(e.rhs())->value();
+                        m_nodes[pos].str = intern(value, strings);
+                        m_nodes[pos].count = static_cast<std::uint32_t>(value.size());
+                    }
+                    if (e.lhs()->expression_type() == expr_node_type::string_attribute &&
+                        (e.rhs()->expression_type() == expr_node_type::string_value ||
+                         e.rhs()->expression_type() == expr_node_type::regex_value)) {
+                        const auto attr = static_cast<const StringAttribute*>(e.lhs())->attribute();
+                        if (attr == string_attribute_type::key || attr == string_attribute_type::value) {
+                            add_slots(m_nodes[pos], 1);
+                        }
+                    }
+                    add(*e.lhs(), strings);
+                    add(*e.rhs(), strings);
+                }
+                break;
+            case expr_node_type::tags_expr:
+                add(*static_cast<const TagsExpr&>(expr).expr(), strings);
+                break;
+            case expr_node_type::nodes_expr:
+                add(*static_cast<const NodesExpr&>(expr).expr(), strings);
+                break;
+            case expr_node_type::members_expr:
+                add(*static_cast<const MembersExpr&>(expr).expr(), strings);
+                break;
+            case expr_node_type::in_integer_list: {
+                    const auto& e = static_cast<const InIntegerList&>(expr);
+                    m_nodes[pos].op = std::uint8_t(e.op());
+                    m_nodes[pos].ids = e.values();
+                    if (!e.filename().empty()) {
+                        m_input_files.push_back(e.filename());
+                    }
+                    add(*e.attr(), strings);
+                }
+                break;
+            case expr_node_type::in_integer_ranges: {
+                    const auto& e = static_cast<const InIntegerRanges&>(expr);
+                    m_nodes[pos].op = std::uint8_t(e.op());
+                    m_nodes[pos].str = static_cast<std::uint32_t>(m_ranges.size());
+                    m_nodes[pos].count = static_cast<std::uint32_t>(e.ranges().size());
+                    m_ranges.insert(m_ranges.end(), e.ranges().cbegin(), e.ranges().cend());
+                    add(*e.attr(), strings);
+                }
+                break;
+            case expr_node_type::location_in_box:
+            case expr_node_type::location_in_polygon: {
+                    const auto& e = static_cast<const LocationPredicate&>(expr);
+                    m_nodes[pos].op = std::uint8_t(e.op());
+                    m_nodes[pos].location = &e;
+                    m_location_predicates.push_back(&e);
+                    if (expr.expression_type() == expr_node_type::location_in_polygon) {
+                        m_input_files.push_back(static_cast<const LocationInPolygon&>(expr).filename());
+                    }
+                }
+                break;
+            case expr_node_type::check_has_key:
+                m_nodes[pos].str = intern(static_cast<const CheckHasKeyExpr&>(expr).key(), strings);
+                add_slots(m_nodes[pos], 1);
+                break;
+            case expr_node_type::check_tag_str: {
+                    const auto& e = static_cast<const CheckTagStrExpr&>(expr);
+                    m_nodes[pos].op = std::uint8_t(e.op());
+                    m_nodes[pos].str = intern(e.key(), strings);
+                    m_nodes[pos].str2 = intern(e.value(), strings);
+                    add_slots(m_nodes[pos], 2);
+                }
+                break;
+            case expr_node_type::check_tag_regex: {
+                    const auto& e = static_cast<const CheckTagRegexExpr&>(expr);
+                    m_nodes[pos].op = std::uint8_t(e.op());
+                    m_nodes[pos].str = intern(e.key(), strings);
+                    m_nodes[pos].regex = e.value_regex();
+                    add_slots(m_nodes[pos], 2);
+                }
+                break;
+            default:
+                throw std::runtime_error{"Unsupported expression type"};
+        }
+
+        m_nodes[pos].next = static_cast<std::uint32_t>(m_nodes.size());
+        m_used_parts |= used_parts(m_nodes[pos]);
+    }
+
+    const char* string(std::uint32_t offset) const noexcept {
+        return m_strings.data() + offset;
+    }
+
+    static bool compare(integer_op_type op, std::int64_t lhs, std::int64_t rhs) noexcept {
+        switch (op) {
+            case integer_op_type::equal:
+                return lhs == rhs;
+            case integer_op_type::not_equal:
+                return lhs != rhs;
+            case integer_op_type::less_than:
+                return lhs < rhs;
+            case integer_op_type::less_or_equal:
+                return lhs <= rhs;
+            case integer_op_type::greater_than:
+                return lhs > rhs;
+            case integer_op_type::greater_or_equal:
+                return lhs >= rhs;
+        }
+
+        assert(false);
+        return false;
+    }
+
+    // Compare value with the right hand side of a binary_str_op node
+    // (string and its length, or regex for the match operators).
+    bool compare_strings(const node& n, const char* value) const noexcept {
+        switch (string_op_type(n.op)) {
+            case string_op_type::equal:
+                return !std::strcmp(value, string(n.str));
+            case string_op_type::not_equal:
+                return std::strcmp(value, string(n.str)) != 0;
+            case string_op_type::prefix_equal:
+                return !std::strncmp(value, string(n.str), n.count);
+            case string_op_type::prefix_not_equal:
+                return std::strncmp(value, string(n.str), n.count) != 0;
+            case string_op_type::match:
+                return std::regex_search(value, *n.regex);
+            case string_op_type::not_match:
+                return !std::regex_search(value, *n.regex);
+        }
+
+        return false;
+    }
+
+    // Evaluate a string predicate using the given slot on a string
+    // table entry. Results are cached in the matcher.
+    bool eval_slot(std::size_t pos, std::size_t slot, std::uint32_t index, StringTableMatcher& matcher) const {
+        std::int8_t& result = matcher.result(slot, index);
+        if (result < 0) {
+            const node& n = m_nodes[pos];
+            const char* str = matcher.string(index);
+            bool value;
+            if (n.type == expr_node_type::binary_str_op) {
+                value = compare_strings(n, str);
+            } else if (slot == n.slot - 1U) {
+                value = !std::strcmp(str, string(n.str));
+            } else if (n.type == expr_node_type::check_tag_str) {
+                value = !std::strcmp(str, string(n.str2));
+            } else {
+                value = std::regex_search(str, *n.regex);
+            }
+            result = value ? 1 : 0;
+        }
+        return result != 0;
+    }
+
+    static std::int64_t int_attribute(integer_attribute_type attr, const osmium::OSMObject& object) noexcept {
+        switch (attr) {
+            case integer_attribute_type::id:
+                return object.id();
+            case integer_attribute_type::version:
+                return object.version();
+            case integer_attribute_type::changeset:
+                return object.changeset();
+            case integer_attribute_type::uid:
+                return object.uid();
+            case integer_attribute_type::timestamp:
+                return object.timestamp().seconds_since_epoch();
+            default:
+                break;
+        }
+
+        assert(false);
+        return 0;
+    }
+
+    static std::int64_t int_attribute(integer_attribute_type /*attr*/, const osmium::NodeRef& nr) noexcept {
+        return nr.ref();
+    }
+
+    static std::int64_t int_attribute(integer_attribute_type /*attr*/, const osmium::RelationMember& member) noexcept {
+        return member.ref();
+    }
+
+    static std::int64_t int_attribute(integer_attribute_type attr, const raw_object& object) noexcept {
+        switch (attr) {
+            case integer_attribute_type::id:
+                return object.id;
+            case integer_attribute_type::version:
+                return object.version;
+            case integer_attribute_type::changeset:
+                return object.changeset;
+            case integer_attribute_type::uid:
+                return object.uid;
+            case integer_attribute_type::timestamp:
+                return object.timestamp;
+            default:
+                break;
+        }
+
+        assert(false);
+        return 0;
+    }
+
+    static std::int64_t int_attribute(integer_attribute_type /*attr*/, const raw_member& member) noexcept {
+        return member.ref;
+    }
+
+    static const char* string_attribute(string_attribute_type /*attr*/, const osmium::OSMObject& object) noexcept {
+        return object.user();
+    }
+
+    static const char* string_attribute(string_attribute_type attr, const osmium::Tag& tag) noexcept {
+        return attr == string_attribute_type::key ? tag.key() : tag.value();
+    }
+
+    static const char* string_attribute(string_attribute_type /*attr*/, const osmium::RelationMember& member) noexcept {
+        return member.role();
+    }
+
+    static const char* string_attribute(string_attribute_type /*attr*/, const raw_object& object) noexcept {
+        return object.user;
+    }
+
+    static const char* string_attribute(string_attribute_type attr, const indexed_tag& tag) noexcept {
+        return tag.matcher.string(attr == string_attribute_type::key ? tag.key : tag.value);
+    }
+
+    static const char* string_attribute(string_attribute_type /*attr*/, const raw_member& member) noexcept {
+        return member.role;
+    }
+
+    // ExprChecker only allows attributes in contexts that have them,
+    // these are never called (for instance for @id on tags).
+    template <typename T>
+    static std::int64_t int_attribute(integer_attribute_type /*attr*/, const T& /*context*/) noexcept {
+        assert(false);
+        return 0;
+    }
+
+    template <typename T>
+    static const char* string_attribute(string_attribute_type /*attr*/, const T& /*context*/) noexcept {
+        assert(false);
+        return "";
+    }
+
+    template <typename T>
+    bool eval_str_op(const node& n, std::size_t pos, const T& context) const {
+        return compare_strings(n, eval_string(pos + 1, context));
+    }
+
+    bool eval_str_op(const node& n, std::size_t pos, const indexed_tag& tag) const {
+        if (n.slot == 0) {
+            return eval_str_op<indexed_tag>(n, pos, tag);
+        }
+        const auto attr = string_attribute_type(m_nodes[pos + 1].op);
+        return eval_slot(pos, n.slot - 1U, attr == string_attribute_type::key ? tag.key : tag.value, tag.matcher);
+    }
+
+    // Tag checks on a raw_object: Does the key (or value) with this
+    // string table index match? Without a slot (there are only so many)
+    // the strings are compared.
+    bool key_matches(const node& n, std::size_t pos, std::uint32_t index, StringTableMatcher& matcher) const {
+        if (n.slot != 0) {
+            return eval_slot(pos, n.slot - 1U, index, matcher);
+        }
+        return !std::strcmp(matcher.string(index), string(n.str));
+    }
+
+    bool value_matches(const node& n, std::size_t pos, std::uint32_t index, StringTableMatcher& matcher) const {
+        if (n.slot != 0) {
+            return eval_slot(pos, n.slot, index, matcher);
+        }
+        if (n.type == expr_node_type::check_tag_str) {
+            return !std::strcmp(matcher.string(index), string(n.str2));
+        }
+        return std::regex_search(matcher.string(index), *n.regex);
+    }
+
+    static bool is_closed(const raw_object& object) noexcept {
+        return object.refs != object.refs_end && *object.refs == *(object.refs_end - 1);
+    }
+
+    // Bool expressions that only work on whole objects.
+    bool eval_object_bool(const node& n, std::size_t pos, const osmium::OSMObject& object) const {
+        switch (n.type) {
+            case expr_node_type::boolean_attribute:
+                switch (boolean_attribute_type(n.op)) {
+                    case boolean_attribute_type::node:
+                        return object.type() == osmium::item_type::node;
+                    case boolean_attribute_type::way:
+                        return object.type() == osmium::item_type::way;
+                    case boolean_attribute_type::relation:
+                        return object.type() == osmium::item_type::relation;
+                    case boolean_attribute_type::visible:
+                        return object.visible();
+                    case boolean_attribute_type::closed_way:
+                        return object.type() == osmium::item_type::way && static_cast<const osmium::Way&>(object).is_closed();
+                    case boolean_attribute_type::open_way:
+                        return object.type() == osmium::item_type::way && !static_cast<const osmium::Way&>(object).is_closed();
+                }
+                break;
+            case expr_node_type::in_integer_list: {
+                    assert(n.ids);
+                    const bool comp = n.ids->get(std::uint64_t(eval_int(pos + 1, object)));
+                    return comp == (list_op_type(n.op) == list_op_type::in);
+                }
+            case expr_node_type::in_integer_ranges: {
+                    const auto* ranges = m_ranges.data() + n.str;
+                    const bool comp = InIntegerRanges::contains(ranges, ranges + n.count, eval_int(pos + 1, object));
+                    return comp == (list_op_type(n.op) == list_op_type::in);
+                }
+            case expr_node_type::location_in_box:
+            case expr_node_type::location_in_polygon:
+                return n.location->in_area(object) == (list_op_type(n.op) == list_op_type::in);
+            case expr_node_type::check_has_key:
+                return object.tags().has_key(string(n.str));
+            case expr_node_type::check_tag_str: {
+                    const char* tag_value = object.tags().get_value_by_key(string(n.str));
+                    if (!tag_value) {
+                        return false;
+                    }
+                    const bool has_tag = !std::strcmp(tag_value, string(n.str2));
+                    return string_op_type(n.op) == string_op_type::equal ? has_tag : !has_tag;
+                }
+            case expr_node_type::check_tag_regex: {
+                    const char* tag_value = object.tags().get_value_by_key(string(n.str));
+                    if (!tag_value) {
+                        return false;
+                    }
+                    const bool has_tag = std::regex_search(tag_value, *n.regex);
+                    return string_op_type(n.op) == string_op_type::match ? has_tag : !has_tag;
+                }
+            default:
+                break;
+        }
+
+        assert(false);
+        return false;
+    }
+
+    bool eval_object_bool(const node& n, std::size_t pos, const raw_object& object) const {
+        switch (n.type) {
+            case expr_node_type::boolean_attribute:
+                switch (boolean_attribute_type(n.op)) {
+                    case boolean_attribute_type::node:
+                        return object.type == osmium::item_type::node;
+                    case boolean_attribute_type::way:
+                        return object.type == osmium::item_type::way;
+                    case boolean_attribute_type::relation:
+                        return object.type == osmium::item_type::relation;
+                    case boolean_attribute_type::visible:
+                        return object.visible;
+                    case boolean_attribute_type::closed_way:
+                        return object.type == osmium::item_type::way && is_closed(object);
+                    case boolean_attribute_type::open_way:
+                        return object.type == osmium::item_type::way && !is_closed(object);
+                }
+                break;
+            case expr_node_type::in_integer_list: {
+                    assert(n.ids);
+                    const bool comp = n.ids->get(std::uint64_t(eval_int(pos + 1, object)));
+                    return comp == (list_op_type(n.op) == list_op_type::in);
+                }
+            case expr_node_type::in_integer_ranges: {
+                    const auto* ranges = m_ranges.data() + n.str;
+                    const bool comp = InIntegerRanges::contains(ranges, ranges + n.count, eval_int(pos + 1, object));
+                    return comp == (list_op_type(n.op) == list_op_type::in);
+                }
+            case expr_node_type::location_in_box:
+            case expr_node_type::location_in_polygon:
+                // Location checks need complete objects, see match().
+                break;
+            case expr_node_type::check_has_key:
+                for (const auto* tag = object.tags; tag != object.tags_end; tag += 2) {
+                    if (key_matches(n, pos, tag[0], *object.matcher)) {
+                        return true;
+                    }
+                }
+                return false;
+            case expr_node_type::check_tag_str:
+            case expr_node_type::check_tag_regex:
+                for (const auto* tag = object.tags; tag != object.tags_end; tag += 2) {
+                    if (key_matches(n, pos, tag[0], *object.matcher)) {
+                        const bool has_tag = value_matches(n, pos, tag[1], *object.matcher);
+                        const auto op = string_op_type(n.op);
+                        return (op == string_op_type::equal || op == string_op_type::match) ? has_tag : !has_tag;
+                    }
+                }
+                return false;
+            default:
+                break;
+        }
+
+        assert(false);
+        return false;
+    }
+
+    // ExprChecker only allows these in the object context.
+    template <typename T>
+    bool eval_object_bool(const node& /*n*/, std::size_t /*pos*/, const T& /*context*/) const noexcept {
+        assert(false);
+        return false;
+    }
+
+    // Integer expressions that only work on whole objects.
+    std::int64_t eval_object_int(const node& n, std::size_t pos, const osmium::OSMObject& object) const {
+        switch (n.type) {
+            case expr_node_type::tags_expr:
+                return std::count_if(object.tags().cbegin(), object.tags().cend(), [this, pos](const osmium::Tag& tag){
+                    return eval_bool(pos + 1, tag);
+                });
+            case expr_node_type::nodes_expr: {
+                    if (object.type() != osmium::item_type::way) {
+                        return 0;
+                    }
+                    const auto& nodes = static_cast<const osmium::Way&>(object).nodes();
+                    return std::count_if(nodes.cbegin(), nodes.cend(), [this, pos](const osmium::NodeRef& nr){
+                        return eval_bool(pos + 1, nr);
+                    });
+                }
+            case expr_node_type::members_expr: {
+                    if (object.type() != osmium::item_type::relation) {
+                        return 0;
+                    }
+                    const auto& members = static_cast<const osmium::Relation&>(object).members();
+                    return std::count_if(members.cbegin(), members.cend(), [this, pos](const osmium::RelationMember& member){
+                        return eval_bool(pos + 1, member);
+                    });
+                }
+            default:
+                break;
+        }
+
+        assert(false);
+        return 0;
+    }
+
+    std::int64_t eval_object_int(const node& n, std::size_t pos, const raw_object& object) const {
+        std::int64_t count = 0;
+        switch (n.type) {
+            case expr_node_type::tags_expr:
+                for (const auto* tag = object.tags; tag != object.tags_end; tag += 2) {
+                    if (eval_bool(pos + 1, indexed_tag{tag[0], tag[1], *object.matcher})) {
+                        ++count;
+                    }
+                }
+                return count;
+            case expr_node_type::nodes_expr:
+                for (const auto* ref = object.refs; ref != object.refs_end; ++ref) {
+                    if (eval_bool(pos + 1, osmium::NodeRef{*ref})) {
+                        ++count;
+                    }
+                }
+                return count;
+            case expr_node_type::members_expr:
+                for (const auto* member = object.members; member != object.members_end; ++member) {
+                    if (eval_bool(pos + 1, *member)) {
+                        ++count;
+                    }
+                }
+                return count;
+            default:
+                break;
+        }
+
+        assert(false);
+        return 0;
+    }
+
+    template <typename T>
+    std::int64_t eval_object_int(const node& /*n*/, std::size_t /*pos*/, const T& /*context*/) const noexcept {
+        assert(false);
+        return 0;
+    }
+
+    template <typename T>
+    bool eval_bool(std::size_t pos, const T& context) const {
+        const node& n = m_nodes[pos];
+
+        switch (n.type) {
+            case expr_node_type::and_expr:
+                for (std::size_t child = pos + 1; child != n.next; child = m_nodes[child].next) {
+                    if (!eval_bool(child, context)) {
+                        return false;
+                    }
+                }
+                return true;
+            case expr_node_type::or_expr:
+                for (std::size_t child = pos + 1; child != n.next; child = m_nodes[child].next) {
+                    if (eval_bool(child, context)) {
+                        return true;
+                    }
+                }
+                return false;
+            case expr_node_type::not_expr:
+                return !eval_bool(pos + 1, context);
+            case expr_node_type::bool_value:
+                return n.value != 0;
+            case expr_node_type::integer_value:
+            case expr_node_type::integer_attribute:
+            case expr_node_type::tags_expr:
+            case expr_node_type::nodes_expr:
+            case expr_node_type::members_expr:
+                return eval_int(pos, context) > 0;
+            case expr_node_type::string_value:
+            case expr_node_type::string_attribute: {
+                    const char* str = eval_string(pos, context);
+                    return str && str[0] != '\0';
+                }
+            case expr_node_type::binary_int_op: {
+                    const std::size_t rhs = m_nodes[pos + 1].next;
+                    return compare(integer_op_type(n.op), eval_int(pos + 1, context), eval_int(rhs, context));
+                }
+            case expr_node_type::binary_str_op:
+                return eval_str_op(n, pos, context);
+            case expr_node_type::boolean_attribute:
+            case expr_node_type::in_integer_list:
+            case expr_node_type::in_integer_ranges:
+            case expr_node_type::location_in_box:
+            case expr_node_type::location_in_polygon:
+            case expr_node_type::check_has_key:
+            case expr_node_type::check_tag_str:
+            case expr_node_type::check_tag_regex:
+                return eval_object_bool(n, pos, context);
+            default:
+                break;
+        }
+
+        assert(false);
+        return false;
+    }
+
+    template <typename T>
+    std::int64_t eval_int(std::size_t pos, const T& context) const {
+        const node& n = m_nodes[pos];
+
+        switch (n.type) {
+            case expr_node_type::integer_value:
+                return n.value;
+            case expr_node_type::integer_attribute:
+                return int_attribute(integer_attribute_type(n.op), context);
+            case expr_node_type::tags_expr:
+            case expr_node_type::nodes_expr:
+            case expr_node_type::members_expr:
+                return eval_object_int(n, pos, context);
+            case expr_node_type::string_value:
+            case expr_node_type::string_attribute:
+                return std::atoll(eval_string(pos, context));
+            case expr_node_type::regex_value:
+                break;
+            default:
+                return eval_bool(pos, context) ? 1 : 0;
+        }
+
+        assert(false);
+        return 0;
+    }
+
+    template <typename T>
+    const char* eval_string(std::size_t pos, const T& context) const {
+        const node& n = m_nodes[pos];
+
+        switch (n.type) {
+            case expr_node_type::string_value:
+                return string(n.str);
+            case expr_node_type::string_attribute:
+                return string_attribute(string_attribute_type(n.op), context);
+            default:
+                break;
+        }
+
+        assert(false);
+        return "";
+    }
+
+public:
+
+    ExprArena() = default;
+
+    explicit ExprArena(const ExprNode& root) {
+        std::map<std::string, std::uint32_t> strings;
+        add(root, strings);
+    }
+
+    const std::vector<node>& nodes() const noexcept {
+        return m_nodes;
+    }
+
+    const std::vector<char>& strings() const noexcept {
+        return m_strings;
+    }
+
+    const std::vector<integer_range>& ranges() const noexcept {
+        return m_ranges;
+    }
+
+    const std::vector<const LocationPredicate*>& location_predicates() const noexcept {
+        return m_location_predicates;
+    }
+
+    // Files the expression reads ID lists and polygons from.
+    const std::vector<std::string>& input_files() const noexcept {
+        return m_input_files;
+    }
+
+    // Number of slots needed in a StringTableMatcher.
+    std::size_t string_slots() const noexcept {
+        return m_string_slots;
+    }
+
+    // Parts of the objects the expression looks at.
+    object_parts::type used_parts() const noexcept {
+        return m_used_parts;
+    }
+
+    // Keys used in tag checks and in comparisons like @key == 'name'.
+    // Keys only matched by prefix or regex are not included.
+    std::vector<std::string> tag_keys() const {
+        std::vector<std::string> keys;
+        for (std::size_t pos = 0; pos < m_nodes.size(); ++pos) {
+            const node& n = m_nodes[pos];
+            switch (n.type) {
+                case expr_node_type::check_has_key:
+                case expr_node_type::check_tag_str:
+                case expr_node_type::check_tag_regex:
+                    keys.emplace_back(string(n.str));
+                    break;
+                case expr_node_type::binary_str_op: {
+                        const node& lhs = m_nodes[pos + 1];
+                        const node& rhs = m_nodes[lhs.next];
+                        if (string_op_type(n.op) == string_op_type::equal &&
+                            lhs.type == expr_node_type::string_attribute &&
+                            string_attribute_type(lhs.op) == string_attribute_type::key &&
+                            rhs.type == expr_node_type::string_value) {
+                            keys.emplace_back(string(rhs.str));
+                        }
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+        return keys;
+    }
+
+    bool match(const osmium::OSMObject& object) const {
+        return eval_bool(0, object);
+    }
+
+    // The matcher of the object must have been reset() with
+    // string_slots() slots. There must be no location predicates.
+    bool match(const raw_object& object) const {
+        return eval_bool(0, object);
+    }
+
+}; // class ExprArena
+
+class expression_parser_error : public std::runtime_error {
+
+    std::string m_input;
+    int m_pos;
+    std::string m_message;
+
+public:
+
+    expression_parser_error(const std::string& input) :
+        std::runtime_error(std::string{"Expression parsing error"}),
+        m_input(input),
+        m_pos(-1) {
+    }
+
+    expression_parser_error(const std::string& input, int pos) :
+        std::runtime_error(std::string{"Expression parsing error at position "} + std::to_string(pos)),
+        m_input(input),
+        m_pos(pos) {
+    }
+
+    // Semantic error found after parsing, pos is -1 if unknown.
+    expression_parser_error(const std::string& input, int pos, const std::string& message) :
+        std::runtime_error(message + (pos >= 0 ? " at position " + std::to_string(pos) : std::string{})),
+        m_input(input),
+        m_pos(pos),
+        m_message(message) {
+    }
+
+    const std::string& input() const noexcept {
+        return m_input;
+    }
+
+    int pos() const noexcept {
+        return m_pos;
+    }
+
+    // Description of the error, empty for syntax errors.
+    const std::string& message() const noexcept {
+        return m_message;
+    }
+
+}; // class expression_parser_error
+
+class OSMObjectFilter {
+
+    std::unique_ptr<ExprNode> m_root = std::unique_ptr<ExprNode>(new BooleanValue);
+    ExprArena m_arena{*m_root};
+
+public:
+
+    explicit OSMObjectFilter(const std::string& input);
+
+    const ExprNode* root() const noexcept {
+        return m_root.get();
+    }
+
+    void print_tree(std::ostream& out) const {
+        m_root->print(out, 0);
+    }
+
+    osmium::osm_entity_bits::type entities() const noexcept {
+        return m_root->calc_entities().first;
+    }
+
+    bool has_location_predicates() const noexcept {
+        return !m_arena.location_predicates().empty();
+    }
+
+    // Entities that have to be read from the input. This can be more than
+    // entities(), because location predicates need nodes and ways.
+    osmium::osm_entity_bits::type input_entities() const noexcept {
+        if (has_location_predicates()) {
+            return entities() | osmium::osm_entity_bits::node | osmium::osm_entity_bits::way;
+        }
+        return entities();
+    }
+
+    // Must be called for each object in the input before match() if
+    // there are location predicates.
+    void collect(const osmium::OSMObject& object) const {
+        for (const auto* predicate : m_arena.location_predicates()) {
+            predicate->collect(object);
+        }
+    }
+
+    const ExprArena& arena() const noexcept {
+        return m_arena;
+    }
+
+    // Parts of the objects match() looks at. Everything else doesn't have
+    // to be read from the input unless it is needed for the output.
+    object_parts::type used_parts() const noexcept {
+        return m_arena.used_parts();
+    }
+
+    // Files read by prepare() (see ExprArena::input_files()).
+    const std::vector<std::string>& input_files() const noexcept {
+        return m_arena.input_files();
+    }
+
+    // Keys of the tags the expression checks (see ExprArena::tag_keys()).
+    std::vector<std::string> tag_keys() const {
+        return m_arena.tag_keys();
+    }
+
+    // Use statistics about the input (see TagStats) to reorder "and" and
+    // "or" expressions and to pick evaluation strategies. The result of
+    // match() doesn't change. Can be called before or after prepare().
+    void optimize(const TagStats& stats);
+
+    void prepare() {
+        m_root->prepare();
+        m_arena = ExprArena{*m_root};
+    }
+
+    // Range of IDs of objects that can match. Available after prepare().
+    integer_range id_range() const noexcept {
+        return m_root->calc_range(integer_attribute_type::id);
+    }
+
+    // Range of timestamps (in seconds since the epoch) of objects that
+    // can match. Available after prepare().
+    integer_range timestamp_range() const noexcept {
+        return m_root->calc_range(integer_attribute_type::timestamp);
+    }
+
+    bool match(const osmium::OSMObject& object) const {
+        return m_arena.match(object);
+    }
+
+    bool match(const raw_object& object) const {
+        return m_arena.match(object);
     }
 
 }; // class OSMObjectFilter
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <osmium/builder/osm_object_builder.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/tag.hpp>
+#include <osmium/osm/way.hpp>
+
+#include "object_filter.hpp"
+
+/**
+ * The parts of the objects written to the output (see the --keep-tags,
+ * --keep-tags-from-expression, and --strip-metadata options). By default
+ * everything is kept.
+ *
+ * Objects are rebuilt with only the wanted parts directly in the buffer
+ * they are added to.
+ */
+class ObjectProjection {
+
+    // Keys of the tags to keep, sorted.
+    std::vector<std::string> m_keys;
+    bool m_filter_tags = false;
+    bool m_strip_metadata = false;
+
+    template <typename TBuilder>
+    void build_object(const osmium::OSMObject& object, TBuilder& builder) const {
+        builder.set_id(object.id());
+        builder.set_visible(object.visible());
+        if (!m_strip_metadata) {
+            builder.set_version(object.version());
+            builder.set_changeset(object.changeset());
+            builder.set_timestamp(object.timestamp());
+            builder.set_uid(object.uid());
+            builder.set_user(object.user());
+        }
+
+        if (object.tags().empty()) {
+            return;
+        }
+        if (!m_filter_tags) {
+            builder.add_item(object.tags());
+            return;
+        }
+        if (m_keys.empty()) {
+            return;
+        }
+        osmium::builder::TagListBuilder tl_builder{builder};
+        for (const auto& tag : object.tags()) {
+            if (keep_tag(tag.key())) {
+                tl_builder.add_tag(tag);
+            }
+        }
+    }
+
+public:
+
+    // Only keep tags with these keys.
+    void keep_tags(std::vector<std::string> keys) {
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        m_keys = std::move(keys);
+        m_filter_tags = true;
+    }
+
+    // Remove version, changeset, timestamp, uid, and user.
+    void strip_metadata() noexcept {
+        m_strip_metadata = true;
+    }
+
+    bool keeps_everything() const noexcept {
+        return !m_filter_tags && !m_strip_metadata;
+    }
+
+    bool filters_tags() const noexcept {
+        return m_filter_tags;
+    }
+
+    bool strips_metadata() const noexcept {
+        return m_strip_metadata;
+    }
+
+    const std::vector<std::string>& keys() const noexcept {
+        return m_keys;
+    }
+
+    bool keep_tag(const char* key) const {
+        if (!m_filter_tags) {
+            return true;
+        }
+        const auto it = std::lower_bound(m_keys.cbegin(), m_keys.cend(), key, [](const std::string& lhs, const char* rhs) {
+            return std::strcmp(lhs.c_str(), rhs) < 0;
+        });
+        return it != m_keys.cend() && *it == key;
+    }
+
+    // Parts of the objects that have to be read for the output.
+    object_parts::type needed_parts() const noexcept {
+        auto parts = object_parts::node_refs | object_parts::members;
+        if (!m_strip_metadata) {
+            parts |= object_parts::metadata;
+        }
+        if (!m_filter_tags || !m_keys.empty()) {
+            parts |= object_parts::tags;
+        }
+        return parts;
+    }
+
+    // Add the wanted parts of the object to the buffer and commit it.
+    void add(const osmium::OSMObject& object, osmium::memory::Buffer& buffer) const {
+        if (keeps_everything()) {
+            buffer.add_item(object);
+            buffer.commit();
+            return;
+        }
+
+        switch (object.type()) {
+            case osmium::item_type::node: {
+                    osmium::builder::NodeBuilder builder{buffer};
+                    builder.set_location(static_cast<const osmium::Node&>(object).location());
+                    build_object(object, builder);
+                }
+                break;
+            case osmium::item_type::way: {
+                    osmium::builder::WayBuilder builder{buffer};
+                    build_object(object, builder);
+                    const auto& nodes = static_cast<const osmium::Way&>(object).nodes();
+                    if (!nodes.empty()) {
+                        builder.add_item(nodes);
+                    }
+                }
+                break;
+            case osmium::item_type::relation: {
+                    osmium::builder::RelationBuilder builder{buffer};
+                    build_object(object, builder);
+                    const auto& members = static_cast<const osmium::Relation&>(object).members();
+                    if (!members.empty()) {
+                        builder.add_item(members);
+                    }
+                }
+                break;
+            default:
+                buffer.add_item(object);
+                break;
+        }
+        buffer.commit();
+    }
+
+}; // class ObjectProjection
+
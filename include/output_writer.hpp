@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <osmium/io/any_output.hpp>
+#include <osmium/io/file.hpp>
+#include <osmium/io/writer_options.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/object.hpp>
+
+#include "dump_file.hpp"
+#include "object_projection.hpp"
+
+/**
+ * Is this output supposed to be written as osmium dump? This is the
+ * case for output format "dump" or, if no format is given, for the
+ * suffix ".dump".
+ */
+inline bool is_dump_output(const std::string& filename, const std::string& format) {
+    if (!format.empty()) {
+        return format == "dump";
+    }
+
+    const std::string suffix{".dump"};
+    return filename.size() > suffix.size() &&
+           filename.compare(filename.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+/**
+ * Writes OSM objects either through a normal osmium::io::Writer or into
+ * an osmium dump (see DumpWriter).
+ *
+ * If there is a projection, single objects are written with only the
+ * parts it keeps. They are built into a buffer of our own which is then
+ * handed to the writer. Complete buffers are written as they are, the
+ * projection must already have been applied to them.
+ */
+class OutputWriter {
+
+    static constexpr const std::size_t buffer_size = 1024 * 1024;
+
+    std::unique_ptr<osmium::io::Writer> m_writer;
+    std::unique_ptr<DumpWriter> m_dump_writer;
+    const ObjectProjection* m_projection;
+    osmium::memory::Buffer m_buffer;
+
+    void write_buffer(osmium::memory::Buffer&& buffer) {
+        if (m_dump_writer) {
+            for (const auto& object : buffer.select<osmium::OSMObject>()) {
+                (*m_dump_writer)(object);
+            }
+        } else {
+            (*m_writer)(std::move(buffer));
+        }
+    }
+
+    void flush() {
+        if (m_buffer && m_buffer.committed() > 0) {
+            write_buffer(std::move(m_buffer));
+            m_buffer = osmium::memory::Buffer{};
+        }
+    }
+
+public:
+
+    OutputWriter(const std::string& filename, const std::string& format, const ObjectProjection* projection = nullptr) :
+        m_projection(projection && !projection->keeps_everything() ? projection : nullptr) {
+        if (is_dump_output(filename, format)) {
+            m_dump_writer.reset(new DumpWriter{filename});
+        } else {
+            osmium::io::File output_file{filename, format};
+            m_writer.reset(new osmium::io::Writer{output_file, osmium::io::overwrite::allow});
+        }
+    }
+
+    void operator()(const osmium::OSMObject& object) {
+        if (m_projection) {
+            if (!m_buffer) {
+                m_buffer = osmium::memory::Buffer{buffer_size, osmium::memory::Buffer::auto_grow::yes};
+            }
+            m_projection->add(object, m_buffer);
+            if (m_buffer.committed() > buffer_size / 2) {
+                flush();
+            }
+            return;
+        }
+        if (m_dump_writer) {
+            (*m_dump_writer)(object);
+        } else {
+            (*m_writer)(object);
+        }
+    }
+
+    void operator()(osmium::memory::Buffer&& buffer) {
+        flush();
+        write_buffer(std::move(buffer));
+    }
+
+    void close() {
+        flush();
+        if (m_dump_writer) {
+            m_dump_writer->close();
+        } else {
+            m_writer->close();
+        }
+    }
+
+}; // class OutputWriter
+
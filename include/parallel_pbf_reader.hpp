@@ -0,0 +1,540 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <protozero/pbf_reader.hpp>
+
+#include <osmium/io/detail/pbf_decoder.hpp>
+#include <osmium/io/file.hpp>
+#include <osmium/io/file_format.hpp>
+#include <osmium/io/reader.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/memory/item.hpp>
+#include <osmium/osm/entity_bits.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/util/file.hpp>
+
+#include "match_counts.hpp"
+#include "pbf_block_decoder.hpp"
+#include "pbf_output.hpp"
+#include "work_stealing.hpp"
+
+/**
+ * Can this input file be read with the ParallelPBFReader? This is the
+ * case for uncompressed PBF files (PBF blobs are compressed internally).
+ */
+inline bool is_parallel_pbf_input(const std::string& filename) {
+    if (filename.empty() || filename == "-") {
+        return false;
+    }
+    const osmium::io::File file{filename};
+    return file.format() == osmium::io::file_format::pbf &&
+           file.compression() == osmium::io::file_compression::none;
+}
+
+/**
+ * Reads a PBF file with several threads. One thread reads the raw blobs
+ * from the file and submits a decode task for each to a WorkStealingPool.
+ * The decode task decompresses and decodes the blob and splits the
+ * resulting buffer at item boundaries into parts of about part_size
+ * bytes. For each part a task is submitted which calls the process
+ * function on it; the process function copies the objects it wants to
+ * keep into the output buffer of the part. Blocks with expensive objects
+ * (like large relations) are thus worked on by several threads.
+ *
+ * With a select function in the decode options (and no process function)
+ * objects are selected while the blob is decoded, objects not selected are
+ * never built (see PBFBlockDecoder). Blocks are not split into parts in
+ * this case. The decode options also say which parts of the objects are
+ * decoded and built. In count_only mode no objects are built at all, the
+ * counts of all blocks read so far are available from counts().
+ *
+ * The task finishing the last part of a block puts the outputs of all
+ * parts together and hands the block to the reading thread under its
+ * sequence number. read() returns the blocks in the order of the blobs
+ * in the file.
+ *
+ * The process and select functions are called from several threads at
+ * once, they must not change shared state.
+ *
+ * In encode mode the output of each block is also encoded into a complete
+ * PBF file block (see read_encoded()). A block where all objects are kept
+ * is passed on as the original compressed blob without encoding and
+ * compressing it again. For this all object types and all parts of the
+ * objects are decoded and built (the projection in the decode options is
+ * ignored), otherwise we couldn't know whether all objects were kept.
+ */
+class ParallelPBFReader {
+
+public:
+
+    using process_function = std::function<void(const osmium::memory::Buffer&, osmium::memory::Buffer&)>;
+
+private:
+
+    // Blocks are split into parts of at least this many bytes.
+    static constexpr const std::size_t part_size = 64 * 1024;
+
+    // Limits from the PBF format specification.
+    static constexpr const std::uint32_t max_blob_header_size = 64 * 1024;
+    static constexpr const std::uint32_t max_blob_size = 32 * 1024 * 1024;
+
+    struct decoded_block {
+        osmium::memory::Buffer buffer;
+        std::string encoded;
+        match_counts counts;
+        bool end = false;
+        std::exception_ptr error;
+    };
+
+    // A block while its parts are processed.
+    struct block_state {
+        std::size_t seq;
+        std::string blob;
+        decoded_pbf_block input;
+        std::vector<std::pair<std::size_t, std::size_t>> part_ranges;
+        std::vector<osmium::memory::Buffer> part_outputs;
+        std::atomic<std::size_t> parts_left{0};
+        std::mutex error_mutex;
+        std::exception_ptr error;
+
+        explicit block_state(std::size_t s) :
+            seq(s) {
+        }
+    };
+
+    int m_fd;
+    std::size_t m_file_size;
+    std::atomic<std::size_t> m_offset{0};
+    osmium::osm_entity_bits::type m_entities;
+    process_function m_process;
+    pbf_decode_options m_options;
+    bool m_encode;
+    std::size_t m_max_in_flight;
+
+    // Finished blocks by sequence number and number of blocks submitted
+    // but not yet returned from read().
+    std::mutex m_mutex;
+    std::condition_variable m_cv_done;
+    std::condition_variable m_cv_space;
+    std::map<std::size_t, decoded_block> m_done_blocks;
+    std::size_t m_in_flight = 0;
+    bool m_shutdown = false;
+
+    std::size_t m_next = 0;
+    bool m_done = false;
+    match_counts m_counts;
+
+    WorkStealingPool m_pool;
+    std::thread m_reader_thread;
+
+    // Read exactly size bytes. Returns false on end of file before the
+    // first byte, throws on end of file later.
+    bool read_exactly(char* data, std::size_t size) {
+        std::size_t done = 0;
+        while (done < size) {
+            const auto result = ::read(m_fd, data + done, size - done);
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error{errno, std::system_category(), "Read error"};
+            }
+            if (result == 0) {
+                if (done == 0) {
+                    return false;
+                }
+                throw std::runtime_error{"PBF error: truncated file"};
+            }
+            done += static_cast<std::size_t>(result);
+        }
+        m_offset += size;
+        return true;
+    }
+
+    // Read next blob and its type. Returns false at end of file.
+    bool read_blob(std::string& type, std::string& data) {
+        unsigned char size_bytes[4];
+        if (!read_exactly(reinterpret_cast<char*>(size_bytes), sizeof(size_bytes))) {
+            return false;
+        }
+        const std::uint32_t header_size = (std::uint32_t(size_bytes[0]) << 24) |
+                                          (std::uint32_t(size_bytes[1]) << 16) |
+                                          (std::uint32_t(size_bytes[2]) << 8) |
+                                           std::uint32_t(size_bytes[3]);
+        if (header_size > max_blob_header_size) {
+            throw std::runtime_error{"PBF error: invalid BlobHeader size"};
+        }
+
+        std::string header(header_size, '\0');
+        if (!read_exactly(&header[0], header.size())) {
+            throw std::runtime_error{"PBF error: truncated file"};
+        }
+
+        type.clear();
+        std::int32_t data_size = 0;
+        protozero::pbf_reader pbf{header};
+        while (pbf.next()) {
+            switch (pbf.tag()) {
+                case 1: // type
+                    type = pbf.get_string();
+                    break;
+                case 3: // datasize
+                    data_size = pbf.get_int32();
+                    break;
+                default:
+                    pbf.skip();
+            }
+        }
+        if (data_size <= 0 || std::uint32_t(data_size) > max_blob_size) {
+            throw std::runtime_error{"PBF error: invalid Blob size"};
+        }
+
+        data.resize(std::size_t(data_size));
+        if (!read_exactly(&data[0], data.size())) {
+            throw std::runtime_error{"PBF error: truncated file"};
+        }
+        return true;
+    }
+
+    void deliver(std::size_t seq, decoded_block&& block) {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_done_blocks.emplace(seq, std::move(block));
+        m_cv_done.notify_all();
+    }
+
+    // Wait until there is room for another block. Returns false on
+    // shutdown.
+    bool reserve_block() {
+        std::unique_lock<std::mutex> lock{m_mutex};
+        m_cv_space.wait(lock, [&]() {
+            return m_shutdown || m_in_flight < m_max_in_flight;
+        });
+        if (m_shutdown) {
+            return false;
+        }
+        ++m_in_flight;
+        return true;
+    }
+
+    static std::size_t count_objects(const osmium::memory::Buffer& buffer) {
+        const auto objects = buffer.select<osmium::OSMObject>();
+        return static_cast<std::size_t>(std::distance(objects.cbegin(), objects.cend()));
+    }
+
+    void finish_block(block_state& state) {
+        decoded_block block;
+        block.error = state.error;
+        if (!block.error) {
+            try {
+                if (state.part_outputs.size() == 1) {
+                    block.buffer = std::move(state.part_outputs.front());
+                } else {
+                    std::size_t size = 0;
+                    for (const auto& output : state.part_outputs) {
+                        size += output.committed();
+                    }
+                    block.buffer = osmium::memory::Buffer{std::max<std::size_t>(size, 1024),
+                                                          osmium::memory::Buffer::auto_grow::yes};
+                    for (const auto& output : state.part_outputs) {
+                        block.buffer.add_buffer(output);
+                        block.buffer.commit();
+                    }
+                }
+                if (m_encode) {
+                    static thread_local PBFBlockEncoder encoder;
+                    if (count_objects(block.buffer) == state.input.objects) {
+                        block.encoded = pbf_file_block("OSMData", state.blob);
+                    } else {
+                        block.encoded = encoder(block.buffer);
+                    }
+                }
+            } catch (...) {
+                block.error = std::current_exception();
+            }
+        }
+        deliver(state.seq, std::move(block));
+    }
+
+    void process_part(const std::shared_ptr<block_state>& state, std::size_t n) {
+        try {
+            const auto& range = state->part_ranges[n];
+            const osmium::memory::Buffer part{state->input.buffer.data() + range.first, range.second - range.first};
+            auto& output = state->part_outputs[n];
+            output = osmium::memory::Buffer{std::max<std::size_t>(range.second - range.first, 1024),
+                                            osmium::memory::Buffer::auto_grow::yes};
+            m_process(part, output);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock{state->error_mutex};
+            if (!state->error) {
+                state->error = std::current_exception();
+            }
+        }
+        if (--state->parts_left == 0) {
+            finish_block(*state);
+        }
+    }
+
+    void decode_block(std::size_t seq, std::string& blob) {
+        std::shared_ptr<block_state> state;
+        try {
+            static thread_local std::string uncompressed;
+            PBFBlockDecoder decoder{osmium::io::detail::decode_blob(blob, uncompressed),
+                                    m_entities,
+                                    m_options};
+
+            state = std::make_shared<block_state>(seq);
+            state->input = decoder();
+            if (m_encode) {
+                state->blob = std::move(blob);
+            }
+
+            // Split into parts at item boundaries.
+            const auto& input = state->input.buffer;
+            const std::size_t size = input.committed();
+            std::size_t start = 0;
+            std::size_t pos = 0;
+            while (m_process && pos < size) {
+                pos += reinterpret_cast<const osmium::memory::Item*>(input.data() + pos)->padded_size();
+                if (pos - start >= part_size || pos >= size) {
+                    state->part_ranges.emplace_back(start, pos);
+                    start = pos;
+                }
+            }
+        } catch (...) {
+            decoded_block block;
+            block.error = std::current_exception();
+            deliver(seq, std::move(block));
+            return;
+        }
+
+        if (state->input.buffer.committed() == 0) {
+            decoded_block block;
+            block.counts = std::move(state->input.counts);
+            deliver(seq, std::move(block));
+            return;
+        }
+
+        // Objects were already selected (and projected) while decoding.
+        if (!m_process) {
+            state->part_outputs.push_back(std::move(state->input.buffer));
+            finish_block(*state);
+            return;
+        }
+
+        state->part_outputs.resize(state->part_ranges.size());
+        state->parts_left = state->part_ranges.size();
+
+        // The first part is done right here, the others can be stolen by
+        // other workers in the meantime.
+        for (std::size_t n = 1; n < state->part_ranges.size(); ++n) {
+            m_pool.submit([this, state, n]() {
+                process_part(state, n);
+            });
+        }
+        process_part(state, 0);
+    }
+
+    void reader_thread() {
+        std::size_t seq = 0;
+        decoded_block last;
+        try {
+            std::string type;
+            std::string data;
+            while (read_blob(type, data)) {
+                const bool header = type == "OSMHeader" && m_encode;
+                if (!header && type != "OSMData") {
+                    continue; // OSMHeader or unknown blob types
+                }
+                if (!reserve_block()) {
+                    return;
+                }
+                if (header) {
+                    decoded_block block;
+                    block.encoded = pbf_file_block("OSMHeader", data);
+                    deliver(seq, std::move(block));
+                } else {
+                    auto blob = std::make_shared<std::string>(std::move(data));
+                    m_pool.submit([this, seq, blob]() {
+                        decode_block(seq, *blob);
+                    });
+                }
+                ++seq;
+                data = std::string{};
+            }
+            last.end = true;
+        } catch (...) {
+            last.error = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            ++m_in_flight;
+        }
+        deliver(seq, std::move(last));
+    }
+
+    // Get the next block in order. Returns false at the end of the file,
+    // rethrows exceptions from reading or decoding.
+    bool next(decoded_block& block) {
+        if (m_done) {
+            return false;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock{m_mutex};
+            m_cv_done.wait(lock, [&]() {
+                return m_shutdown || m_done_blocks.count(m_next) > 0;
+            });
+            if (m_shutdown) {
+                m_done = true;
+                return false;
+            }
+            const auto it = m_done_blocks.find(m_next);
+            block = std::move(it->second);
+            m_done_blocks.erase(it);
+            --m_in_flight;
+            m_cv_space.notify_one();
+        }
+        ++m_next;
+        m_counts.add(block.counts);
+
+        if (block.error) {
+            m_done = true;
+            std::rethrow_exception(block.error);
+        }
+        if (block.end) {
+            m_done = true;
+            return false;
+        }
+        return true;
+    }
+
+public:
+
+    /**
+     * Set either a process function or a select function in the
+     * decode options.
+     */
+    ParallelPBFReader(const std::string& filename,
+                      osmium::osm_entity_bits::type entities,
+                      unsigned num_threads,
+                      process_function process,
+                      bool encode = false,
+                      pbf_decode_options options = pbf_decode_options{}) :
+        m_fd(::open(filename.c_str(), O_RDONLY)),
+        m_file_size(0),
+        m_entities(encode ? osmium::osm_entity_bits::nwr : entities),
+        m_process(std::move(process)),
+        m_options(std::move(options)),
+        m_encode(encode),
+        m_max_in_flight(4 * std::max(1u, num_threads)),
+        m_pool(num_threads) {
+        if (m_fd < 0) {
+            throw std::system_error{errno, std::system_category(), "Can not open file '" + filename + "'"};
+        }
+        m_file_size = osmium::util::file_size(m_fd);
+        if (encode) {
+            m_options.parts = object_parts::all;
+            m_options.projection = nullptr;
+        }
+        m_reader_thread = std::thread{&ParallelPBFReader::reader_thread, this};
+    }
+
+    ParallelPBFReader(const ParallelPBFReader&) = delete;
+    ParallelPBFReader& operator=(const ParallelPBFReader&) = delete;
+
+    ~ParallelPBFReader() {
+        close();
+    }
+
+    /**
+     * Get the next output buffer. Returns an invalid buffer at the end
+     * of the file.
+     */
+    osmium::memory::Buffer read() {
+        decoded_block block;
+        while (next(block)) {
+            if (block.buffer) {
+                return std::move(block.buffer);
+            }
+        }
+        return osmium::memory::Buffer{};
+    }
+
+    /**
+     * Get the next output buffer and the encoded PBF file block (only in
+     * encode mode). The first block is the header block of the input
+     * file, it comes with an invalid buffer. The encoded data is empty if
+     * the buffer is. Returns false at the end of the file.
+     */
+    bool read_encoded(osmium::memory::Buffer& buffer, std::string& encoded) {
+        decoded_block block;
+        if (!next(block)) {
+            return false;
+        }
+        buffer = std::move(block.buffer);
+        encoded = std::move(block.encoded);
+        return true;
+    }
+
+    void close() {
+        m_done = true;
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            m_shutdown = true;
+            m_cv_done.notify_all();
+            m_cv_space.notify_all();
+        }
+        if (m_reader_thread.joinable()) {
+            m_reader_thread.join();
+        }
+        m_pool.shutdown();
+        if (m_fd >= 0) {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+    }
+
+    std::size_t file_size() const noexcept {
+        return m_file_size;
+    }
+
+    std::size_t offset() const noexcept {
+        return m_offset;
+    }
+
+    // Counts of selected objects in count_only mode (see
+    // pbf_decode_options) in all blocks returned so far.
+    const match_counts& counts() const noexcept {
+        return m_counts;
+    }
+
+    /**
+     * Statistics for the worker threads. Only available after close().
+     */
+    std::vector<worker_stats> stats() const {
+        return m_pool.stats();
+    }
+
+}; // class ParallelPBFReader
+
@@ -0,0 +1,830 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <protozero/pbf_reader.hpp>
+
+#include <osmium/builder/osm_object_builder.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/entity_bits.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/timestamp.hpp>
+#include <osmium/osm/types.hpp>
+
+#include "match_counts.hpp"
+#include "object_filter.hpp"
+#include "object_projection.hpp"
+
+/**
+ * The string table of a PBF block. The strings are copied, so they are
+ * null-terminated.
+ */
+class PBFStringTable {
+
+    std::vector<char> m_data;
+    std::vector<std::uint32_t> m_offsets;
+    std::vector<const char*> m_strings;
+
+public:
+
+    void clear() {
+        m_data.clear();
+        m_offsets.clear();
+        m_strings.clear();
+    }
+
+    void add(const char* data, std::size_t size) {
+        m_offsets.push_back(static_cast<std::uint32_t>(m_data.size()));
+        m_data.insert(m_data.end(), data, data + size);
+        m_data.push_back('\0');
+    }
+
+    // Must be called after the last add().
+    void finish() {
+        m_offsets.push_back(static_cast<std::uint32_t>(m_data.size()));
+        m_strings.clear();
+        m_strings.reserve(size());
+        for (std::size_t i = 0; i < size(); ++i) {
+            m_strings.push_back(m_data.data() + m_offsets[i]);
+        }
+    }
+
+    std::size_t size() const noexcept {
+        return m_offsets.empty() ? 0 : m_offsets.size() - 1;
+    }
+
+    // Array with pointers to all strings.
+    const char* const* strings() const noexcept {
+        return m_strings.data();
+    }
+
+    const char* get(std::uint32_t index) const {
+        if (index >= size()) {
+            throw std::runtime_error{"PBF error: string index out of range"};
+        }
+        return m_strings[index];
+    }
+
+    std::size_t length(std::uint32_t index) const noexcept {
+        return m_offsets[index + 1] - m_offsets[index] - 1;
+    }
+
+}; // class PBFStringTable
+
+/**
+ * A PBF block decoded by the PBFBlockDecoder.
+ */
+struct decoded_pbf_block {
+
+    osmium::memory::Buffer buffer;
+
+    // Number of objects of the wanted types in the block, including
+    // those that were not selected.
+    std::size_t objects = 0;
+
+    // The selected objects in count_only mode.
+    match_counts counts;
+
+}; // struct decoded_pbf_block
+
+/**
+ * Settings for the PBFBlockDecoder.
+ */
+struct pbf_decode_options {
+
+    // Called for every object before it is built, only objects for which
+    // it returns true are built. Build all objects if not set.
+    std::function<bool(const raw_object&)> select;
+
+    // Number of StringTableMatcher slots the select function needs.
+    std::size_t string_slots = 0;
+
+    // Parts of the objects that are decoded.
+    object_parts::type parts = object_parts::all;
+
+    // Parts of the objects that are built. Everything decoded is built
+    // if this is nullptr.
+    const ObjectProjection* projection = nullptr;
+
+    // Only count the selected objects (in decoded_pbf_block::counts),
+    // don't build them.
+    bool count_only = false;
+
+    // With count_only: Also count by the values of the tag with this key
+    // if it is not empty. Tags must be decoded for this.
+    std::string count_key;
+
+}; // struct pbf_decode_options
+
+/**
+ * Decodes a PBF PrimitiveBlock (the uncompressed content of an OSMData
+ * blob) into an osmium buffer like the decoder in libosmium.
+ *
+ * If there is a select function, it is called for every object with the
+ * decoded attributes (see raw_object) before the object is built, and
+ * only selected objects are built into the buffer. Tags are given to the
+ * select function as string table indexes, so filters can evaluate tag
+ * checks once for every string in the table (see StringTableMatcher).
+ *
+ * Only the parts of the objects set in the options are decoded, the
+ * others are skipped and left empty (or at their default values) in the
+ * raw_object and in the objects built. With a projection the objects are
+ * built with only the parts it keeps. In count_only mode the selected
+ * objects are only counted.
+ *
+ * Changesets in the block are ignored.
+ */
+class PBFBlockDecoder {
+
+    // Coordinates in PBF are in nanodegrees, osmium::Location has a
+    // precision of 10^-7 degrees.
+    static constexpr const std::int64_t resolution_convert = 1000000000 / osmium::detail::coordinate_precision;
+
+    using kv_type = protozero::iterator_range<protozero::pbf_reader::const_uint32_iterator>;
+
+    struct pbf_info {
+        std::int32_t version = 0;
+        std::int64_t timestamp = 0;
+        std::int64_t changeset = 0;
+        std::int32_t uid = 0;
+        std::uint32_t user_sid = 0;
+        bool visible = true;
+    };
+
+    protozero::data_view m_data;
+    osmium::osm_entity_bits::type m_entities;
+    const pbf_decode_options& m_options;
+
+    std::int64_t m_granularity = 100;
+    std::int64_t m_lat_offset = 0;
+    std::int64_t m_lon_offset = 0;
+    std::int64_t m_date_granularity = 1000;
+
+    PBFStringTable m_strings;
+    StringTableMatcher m_matcher;
+
+    // The object currently decoded.
+    raw_object m_object;
+    std::uint32_t m_user_sid = 0;
+    std::vector<std::uint32_t> m_tags;
+    std::vector<std::int64_t> m_refs;
+    std::vector<raw_member> m_members;
+
+    decoded_pbf_block m_block;
+
+    // For count_key: its index in the string table and counts by value
+    // index.
+    std::uint32_t m_count_key_index = std::numeric_limits<std::uint32_t>::max();
+    std::vector<match_counts::counts_type> m_value_counts;
+
+    std::int32_t convert_coordinate(std::int64_t offset, std::int64_t value) const noexcept {
+        return static_cast<std::int32_t>((value * m_granularity + offset) / resolution_convert);
+    }
+
+    void decode_string_table(const protozero::data_view& data) {
+        protozero::pbf_reader pbf_string_table{data};
+        while (pbf_string_table.next(1)) {
+            const auto str = pbf_string_table.get_view();
+            m_strings.add(str.data(), str.size());
+        }
+    }
+
+    pbf_info decode_info(const protozero::data_view& data) {
+        pbf_info info;
+        protozero::pbf_reader pbf_info{data};
+        while (pbf_info.next()) {
+            switch (pbf_info.tag()) {
+                case 1: // version
+                    info.version = pbf_info.get_int32();
+                    break;
+                case 2: // timestamp
+                    info.timestamp = pbf_info.get_int64();
+                    break;
+                case 3: // changeset
+                    info.changeset = pbf_info.get_int64();
+                    break;
+                case 4: // uid
+                    info.uid = pbf_info.get_int32();
+                    break;
+                case 5: // user_sid
+                    info.user_sid = pbf_info.get_uint32();
+                    break;
+                case 6: // visible
+                    info.visible = pbf_info.get_bool();
+                    break;
+                default:
+                    pbf_info.skip();
+            }
+        }
+        return info;
+    }
+
+    // Start a new object. The attributes are converted the same way the
+    // builders would do it, so filters see the same values on the
+    // raw_object and on the finished object.
+    void start_object(osmium::item_type type, std::int64_t id, const pbf_info& info) {
+        m_object.type = type;
+        m_object.id = id;
+        m_object.version = static_cast<osmium::object_version_type>(info.version);
+        m_object.changeset = static_cast<osmium::changeset_id_type>(info.changeset);
+        m_object.uid = info.uid < 0 ? 0 : info.uid;
+        m_object.timestamp = static_cast<std::uint32_t>(info.timestamp * m_date_granularity / 1000);
+        m_object.visible = info.visible;
+        m_object.location = osmium::Location{};
+        m_user_sid = info.user_sid;
+        if (m_strings.size() > 0 || m_user_sid != 0) {
+            m_object.user = m_strings.get(m_user_sid);
+        } else {
+            m_object.user = "";
+        }
+        m_tags.clear();
+        m_refs.clear();
+        m_members.clear();
+    }
+
+    void add_tag(std::uint32_t key, std::uint32_t value) {
+        if (key >= m_strings.size() || value >= m_strings.size()) {
+            throw std::runtime_error{"PBF error: string index out of range"};
+        }
+        m_tags.push_back(key);
+        m_tags.push_back(value);
+    }
+
+    void add_tags(const kv_type& keys, const kv_type& vals) {
+        auto kit = keys.begin();
+        auto vit = vals.begin();
+        while (kit != keys.end()) {
+            if (vit == vals.end()) {
+                throw std::runtime_error{"PBF error: different number of keys and values"};
+            }
+            add_tag(*kit++, *vit++);
+        }
+        if (vit != vals.end()) {
+            throw std::runtime_error{"PBF error: different number of keys and values"};
+        }
+    }
+
+    // Should the current object be built?
+    bool selected() {
+        ++m_block.objects;
+        if (!m_options.select) {
+            return true;
+        }
+        m_object.tags = m_tags.data();
+        m_object.tags_end = m_tags.data() + m_tags.size();
+        m_object.refs = m_refs.data();
+        m_object.refs_end = m_refs.data() + m_refs.size();
+        m_object.members = m_members.data();
+        m_object.members_end = m_members.data() + m_members.size();
+        m_object.matcher = &m_matcher;
+        if (!m_options.select(m_object)) {
+            return false;
+        }
+        if (m_options.count_only) {
+            count_object();
+            return false;
+        }
+        return true;
+    }
+
+    void count_object() {
+        const auto index = osmium::item_type_to_nwr_index(m_object.type);
+        ++m_block.counts.objects[index];
+        if (m_options.count_key.empty()) {
+            return;
+        }
+        for (std::size_t i = 0; i < m_tags.size(); i += 2) {
+            if (m_tags[i] == m_count_key_index) {
+                ++m_value_counts[m_tags[i + 1]][index];
+                return;
+            }
+        }
+        ++m_block.counts.without_key[index];
+    }
+
+    // Find the count_key in the string table.
+    void prepare_counts() {
+        m_value_counts.assign(m_strings.size(), match_counts::counts_type{{0, 0, 0}});
+        for (std::uint32_t i = 0; i < m_strings.size(); ++i) {
+            if (m_options.count_key == m_strings.get(i)) {
+                m_count_key_index = i;
+                return;
+            }
+        }
+    }
+
+    void finish_counts() {
+        for (std::uint32_t i = 0; i < m_value_counts.size(); ++i) {
+            const auto& counts = m_value_counts[i];
+            if (counts[0] + counts[1] + counts[2] > 0) {
+                m_block.counts.by_value.emplace(m_strings.get(i), counts);
+            }
+        }
+    }
+
+    // Set attributes, user, and tags of the current object.
+    template <typename TBuilder>
+    void build_object(TBuilder& builder) {
+        const auto* projection = m_options.projection;
+
+        builder.set_id(m_object.id);
+        builder.set_visible(m_object.visible);
+        if (!projection || !projection->strips_metadata()) {
+            builder.set_version(static_cast<osmium::object_version_type>(m_object.version));
+            builder.set_changeset(static_cast<osmium::changeset_id_type>(m_object.changeset));
+            builder.set_timestamp(osmium::Timestamp{static_cast<std::uint32_t>(m_object.timestamp)});
+            builder.set_uid(static_cast<osmium::user_id_type>(m_object.uid));
+            if (m_strings.size() > 0) {
+                builder.set_user(m_object.user, m_strings.length(m_user_sid));
+            }
+        }
+
+        if (m_tags.empty()) {
+            return;
+        }
+        osmium::builder::TagListBuilder tl_builder{builder};
+        for (std::size_t i = 0; i < m_tags.size(); i += 2) {
+            const auto key = m_tags[i];
+            const auto value = m_tags[i + 1];
+            if (!projection || projection->keep_tag(m_strings.get(key))) {
+                tl_builder.add_tag(m_strings.get(key), m_strings.length(key),
+                                   m_strings.get(value), m_strings.length(value));
+            }
+        }
+    }
+
+    void build_node() {
+        {
+            osmium::builder::NodeBuilder builder{m_block.buffer};
+            builder.set_location(m_object.location);
+            build_object(builder);
+        }
+        m_block.buffer.commit();
+    }
+
+    void decode_node(const protozero::data_view& data) {
+        std::int64_t id = 0;
+        kv_type keys;
+        kv_type vals;
+        pbf_info info;
+        std::int64_t lat = 0;
+        std::int64_t lon = 0;
+
+        protozero::pbf_reader pbf_node{data};
+        while (pbf_node.next()) {
+            switch (pbf_node.tag()) {
+                case 1: // id
+                    id = pbf_node.get_sint64();
+                    break;
+                case 2: // keys
+                    if (m_options.parts & object_parts::tags) {
+                        keys = pbf_node.get_packed_uint32();
+                    } else {
+                        pbf_node.skip();
+                    }
+                    break;
+                case 3: // vals
+                    if (m_options.parts & object_parts::tags) {
+                        vals = pbf_node.get_packed_uint32();
+                    } else {
+                        pbf_node.skip();
+                    }
+                    break;
+                case 4: // info
+                    if (m_options.parts & object_parts::metadata) {
+                        info = decode_info(pbf_node.get_view());
+                    } else {
+                        pbf_node.skip();
+                    }
+                    break;
+                case 8: // lat
+                    lat = pbf_node.get_sint64();
+                    break;
+                case 9: // lon
+                    lon = pbf_node.get_sint64();
+                    break;
+                default:
+                    pbf_node.skip();
+            }
+        }
+
+        start_object(osmium::item_type::node, id, info);
+        if (info.visible) {
+            m_object.location = osmium::Location{convert_coordinate(m_lon_offset, lon),
+                                                 convert_coordinate(m_lat_offset, lat)};
+        }
+        add_tags(keys, vals);
+        if (selected()) {
+            build_node();
+        }
+    }
+
+    void decode_dense_nodes(const protozero::data_view& data) {
+        using sint32_range = protozero::iterator_range<protozero::pbf_reader::const_sint32_iterator>;
+        using sint64_range = protozero::iterator_range<protozero::pbf_reader::const_sint64_iterator>;
+        using int32_range = protozero::iterator_range<protozero::pbf_reader::const_int32_iterator>;
+        using bool_range = protozero::iterator_range<protozero::pbf_reader::const_bool_iterator>;
+
+        sint64_range ids;
+        sint64_range lats;
+        sint64_range lons;
+        int32_range tags;
+
+        int32_range versions;
+        sint64_range timestamps;
+        sint64_range changesets;
+        sint32_range uids;
+        sint32_range user_sids;
+        bool_range visibles;
+
+        protozero::pbf_reader pbf_dense_nodes{data};
+        while (pbf_dense_nodes.next()) {
+            switch (pbf_dense_nodes.tag()) {
+                case 1: // id
+                    ids = pbf_dense_nodes.get_packed_sint64();
+                    break;
+                case 5: { // denseinfo
+                        if (!(m_options.parts & object_parts::metadata)) {
+                            pbf_dense_nodes.skip();
+                            break;
+                        }
+                        protozero::pbf_reader pbf_dense_info{pbf_dense_nodes.get_view()};
+                        while (pbf_dense_info.next()) {
+                            switch (pbf_dense_info.tag()) {
+                                case 1:
+                                    versions = pbf_dense_info.get_packed_int32();
+                                    break;
+                                case 2:
+                                    timestamps = pbf_dense_info.get_packed_sint64();
+                                    break;
+                                case 3:
+                                    changesets = pbf_dense_info.get_packed_sint64();
+                                    break;
+                                case 4:
+                                    uids = pbf_dense_info.get_packed_sint32();
+                                    break;
+                                case 5:
+                                    user_sids = pbf_dense_info.get_packed_sint32();
+                                    break;
+                                case 6:
+                                    visibles = pbf_dense_info.get_packed_bool();
+                                    break;
+                                default:
+                                    pbf_dense_info.skip();
+                            }
+                        }
+                    }
+                    break;
+                case 8: // lat
+                    lats = pbf_dense_nodes.get_packed_sint64();
+                    break;
+                case 9: // lon
+                    lons = pbf_dense_nodes.get_packed_sint64();
+                    break;
+                case 10: // keys_vals
+                    if (m_options.parts & object_parts::tags) {
+                        tags = pbf_dense_nodes.get_packed_int32();
+                    } else {
+                        pbf_dense_nodes.skip();
+                    }
+                    break;
+                default:
+                    pbf_dense_nodes.skip();
+            }
+        }
+
+        std::int64_t id = 0;
+        std::int64_t lat = 0;
+        std::int64_t lon = 0;
+        pbf_info info;
+        std::int64_t user_sid = 0;
+
+        const bool has_info = !versions.empty();
+
+        for (const auto delta_id : ids) {
+            if (lats.empty() || lons.empty()) {
+                throw std::runtime_error{"PBF error: missing coordinates in DenseNodes"};
+            }
+            id += delta_id;
+            lat += lats.front();
+            lats.drop_front();
+            lon += lons.front();
+            lons.drop_front();
+
+            if (has_info) {
+                if (versions.empty() || timestamps.empty() || changesets.empty() || uids.empty() || user_sids.empty()) {
+                    throw std::runtime_error{"PBF error: missing fields in DenseInfo"};
+                }
+                info.version = versions.front();
+                versions.drop_front();
+                info.timestamp += timestamps.front();
+                timestamps.drop_front();
+                info.changeset += changesets.front();
+                changesets.drop_front();
+                info.uid += uids.front();
+                uids.drop_front();
+                user_sid += user_sids.front();
+                user_sids.drop_front();
+                info.user_sid = static_cast<std::uint32_t>(user_sid);
+                if (!visibles.empty()) {
+                    info.visible = visibles.front();
+                    visibles.drop_front();
+                }
+            }
+
+            start_object(osmium::item_type::node, id, info);
+            if (info.visible) {
+                m_object.location = osmium::Location{convert_coordinate(m_lon_offset, lon),
+                                                     convert_coordinate(m_lat_offset, lat)};
+            }
+
+            // Tags of all nodes, each list ends with a 0.
+            while (!tags.empty()) {
+                const auto key = static_cast<std::uint32_t>(tags.front());
+                tags.drop_front();
+                if (key == 0) {
+                    break;
+                }
+                if (tags.empty()) {
+                    throw std::runtime_error{"PBF error: missing value in DenseNodes tags"};
+                }
+                add_tag(key, static_cast<std::uint32_t>(tags.front()));
+                tags.drop_front();
+            }
+
+            if (selected()) {
+                build_node();
+            }
+        }
+    }
+
+    void decode_way(const protozero::data_view& data) {
+        std::int64_t id = 0;
+        kv_type keys;
+        kv_type vals;
+        pbf_info info;
+        protozero::iterator_range<protozero::pbf_reader::const_sint64_iterator> refs;
+
+        protozero::pbf_reader pbf_way{data};
+        while (pbf_way.next()) {
+            switch (pbf_way.tag()) {
+                case 1: // id
+                    id = pbf_way.get_int64();
+                    break;
+                case 2: // keys
+                    if (m_options.parts & object_parts::tags) {
+                        keys = pbf_way.get_packed_uint32();
+                    } else {
+                        pbf_way.skip();
+                    }
+                    break;
+                case 3: // vals
+                    if (m_options.parts & object_parts::tags) {
+                        vals = pbf_way.get_packed_uint32();
+                    } else {
+                        pbf_way.skip();
+                    }
+                    break;
+                case 4: // info
+                    if (m_options.parts & object_parts::metadata) {
+                        info = decode_info(pbf_way.get_view());
+                    } else {
+                        pbf_way.skip();
+                    }
+                    break;
+                case 8: // refs
+                    if (m_options.parts & object_parts::node_refs) {
+                        refs = pbf_way.get_packed_sint64();
+                    } else {
+                        pbf_way.skip();
+                    }
+                    break;
+                default:
+                    pbf_way.skip();
+            }
+        }
+
+        start_object(osmium::item_type::way, id, info);
+        add_tags(keys, vals);
+        std::int64_t ref = 0;
+        for (const auto delta : refs) {
+            ref += delta;
+            m_refs.push_back(ref);
+        }
+        if (!selected()) {
+            return;
+        }
+
+        {
+            osmium::builder::WayBuilder builder{m_block.buffer};
+            build_object(builder);
+            if (!m_refs.empty()) {
+                osmium::builder::WayNodeListBuilder wnl_builder{builder};
+                for (const auto node_ref : m_refs) {
+                    wnl_builder.add_node_ref(node_ref);
+                }
+            }
+        }
+        m_block.buffer.commit();
+    }
+
+    void decode_relation(const protozero::data_view& data) {
+        std::int64_t id = 0;
+        kv_type keys;
+        kv_type vals;
+        pbf_info info;
+        protozero::iterator_range<protozero::pbf_reader::const_int32_iterator> roles;
+        protozero::iterator_range<protozero::pbf_reader::const_sint64_iterator> refs;
+        protozero::iterator_range<protozero::pbf_reader::const_int32_iterator> types;
+
+        protozero::pbf_reader pbf_relation{data};
+        while (pbf_relation.next()) {
+            switch (pbf_relation.tag()) {
+                case 1: // id
+                    id = pbf_relation.get_int64();
+                    break;
+                case 2: // keys
+                    if (m_options.parts & object_parts::tags) {
+                        keys = pbf_relation.get_packed_uint32();
+                    } else {
+                        pbf_relation.skip();
+                    }
+                    break;
+                case 3: // vals
+                    if (m_options.parts & object_parts::tags) {
+                        vals = pbf_relation.get_packed_uint32();
+                    } else {
+                        pbf_relation.skip();
+                    }
+                    break;
+                case 4: // info
+                    if (m_options.parts & object_parts::metadata) {
+                        info = decode_info(pbf_relation.get_view());
+                    } else {
+                        pbf_relation.skip();
+                    }
+                    break;
+                case 8: // roles_sid
+                case 9: // memids
+                case 10: // types
+                    if (!(m_options.parts & object_parts::members)) {
+                        pbf_relation.skip();
+                    } else if (pbf_relation.tag() == 8) {
+                        roles = pbf_relation.get_packed_int32();
+                    } else if (pbf_relation.tag() == 9) {
+                        refs = pbf_relation.get_packed_sint64();
+                    } else {
+                        types = pbf_relation.get_packed_enum();
+                    }
+                    break;
+                default:
+                    pbf_relation.skip();
+            }
+        }
+
+        start_object(osmium::item_type::relation, id, info);
+        add_tags(keys, vals);
+        std::int64_t ref = 0;
+        for (const auto delta : refs) {
+            if (roles.empty() || types.empty()) {
+                throw std::runtime_error{"PBF error: different number of member ids, roles, and types"};
+            }
+            ref += delta;
+            const auto role = static_cast<std::uint32_t>(roles.front());
+            roles.drop_front();
+            const auto type = types.front();
+            types.drop_front();
+            if (type < 0 || type > 2) {
+                throw std::runtime_error{"PBF error: unknown relation member type"};
+            }
+            m_members.push_back(raw_member{osmium::nwr_index_to_item_type(static_cast<unsigned int>(type)), ref, m_strings.get(role)});
+        }
+        if (!selected()) {
+            return;
+        }
+
+        {
+            osmium::builder::RelationBuilder builder{m_block.buffer};
+            build_object(builder);
+            if (!m_members.empty()) {
+                osmium::builder::RelationMemberListBuilder rml_builder{builder};
+                for (const auto& member : m_members) {
+                    rml_builder.add_member(member.type, member.ref, member.role, std::strlen(member.role));
+                }
+            }
+        }
+        m_block.buffer.commit();
+    }
+
+    void decode_group(const protozero::data_view& data) {
+        protozero::pbf_reader pbf_group{data};
+        while (pbf_group.next()) {
+            switch (pbf_group.tag()) {
+                case 1: // node
+                    if (m_entities & osmium::osm_entity_bits::node) {
+                        decode_node(pbf_group.get_view());
+                    } else {
+                        pbf_group.skip();
+                    }
+                    break;
+                case 2: // dense nodes
+                    if (m_entities & osmium::osm_entity_bits::node) {
+                        decode_dense_nodes(pbf_group.get_view());
+                    } else {
+                        pbf_group.skip();
+                    }
+                    break;
+                case 3: // way
+                    if (m_entities & osmium::osm_entity_bits::way) {
+                        decode_way(pbf_group.get_view());
+                    } else {
+                        pbf_group.skip();
+                    }
+                    break;
+                case 4: // relation
+                    if (m_entities & osmium::osm_entity_bits::relation) {
+                        decode_relation(pbf_group.get_view());
+                    } else {
+                        pbf_group.skip();
+                    }
+                    break;
+                default:
+                    pbf_group.skip();
+            }
+        }
+    }
+
+public:
+
+    /**
+     * The options must outlive the decoder.
+     */
+    PBFBlockDecoder(const protozero::data_view& data,
+                    osmium::osm_entity_bits::type entities,
+                    const pbf_decode_options& options) :
+        m_data(data),
+        m_entities(entities),
+        m_options(options) {
+    }
+
+    decoded_pbf_block operator()() {
+        m_block.buffer = osmium::memory::Buffer{std::max<std::size_t>(m_data.size() * 2, 1024),
+                                                osmium::memory::Buffer::auto_grow::yes};
+
+        // The string table and granularities can come in any order, so
+        // the groups are decoded after everything else.
+        std::vector<protozero::data_view> groups;
+        protozero::pbf_reader pbf_block{m_data};
+        while (pbf_block.next()) {
+            switch (pbf_block.tag()) {
+                case 1: // stringtable
+                    decode_string_table(pbf_block.get_view());
+                    break;
+                case 2: // primitivegroup
+                    groups.push_back(pbf_block.get_view());
+                    break;
+                case 17: // granularity
+                    m_granularity = pbf_block.get_int32();
+                    break;
+                case 18: // date_granularity
+                    m_date_granularity = pbf_block.get_int32();
+                    break;
+                case 19: // lat_offset
+                    m_lat_offset = pbf_block.get_int64();
+                    break;
+                case 20: // lon_offset
+                    m_lon_offset = pbf_block.get_int64();
+                    break;
+                default:
+                    pbf_block.skip();
+            }
+        }
+        m_strings.finish();
+        m_matcher.reset(m_strings.strings(), m_strings.size(), m_options.string_slots);
+
+        if (m_options.count_only && !m_options.count_key.empty()) {
+            prepare_counts();
+        }
+
+        for (const auto& group : groups) {
+            decode_group(group);
+        }
+
+        if (m_options.count_only && !m_options.count_key.empty()) {
+            finish_counts();
+        }
+
+        return std::move(m_block);
+    }
+
+}; // class PBFBlockDecoder
@@ -0,0 +1,376 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include <protozero/pbf_writer.hpp>
+
+#include <osmium/io/file.hpp>
+#include <osmium/io/file_format.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/tag.hpp>
+#include <osmium/osm/way.hpp>
+
+/**
+ * Can the output be written with PBFFileWriter? This is the case for PBF
+ * output without any format options (which only the osmium::io::Writer
+ * understands).
+ */
+inline bool is_plain_pbf_output(const std::string& filename, const std::string& format) {
+    if (format.find(',') != std::string::npos) {
+        return false;
+    }
+    const osmium::io::File file{filename, format};
+    return file.format() == osmium::io::file_format::pbf &&
+           file.compression() == osmium::io::file_compression::none;
+}
+
+/**
+ * Wrap blob data (a serialized Blob message) into a complete PBF file
+ * block: the size of the BlobHeader as 4 byte big endian number, the
+ * BlobHeader, and the data.
+ */
+inline std::string pbf_file_block(const char* type, const std::string& blob) {
+    std::string header;
+    {
+        protozero::pbf_writer pbf{header};
+        pbf.add_string(1, type);
+        pbf.add_int32(3, static_cast<std::int32_t>(blob.size()));
+    }
+
+    std::string block;
+    block.reserve(4 + header.size() + blob.size());
+    const auto size = static_cast<std::uint32_t>(header.size());
+    block += static_cast<char>((size >> 24) & 0xff);
+    block += static_cast<char>((size >> 16) & 0xff);
+    block += static_cast<char>((size >> 8) & 0xff);
+    block += static_cast<char>(size & 0xff);
+    block += header;
+    block += blob;
+    return block;
+}
+
+/**
+ * Encodes the objects in a buffer into one PBF PrimitiveBlock with dense
+ * nodes, compressed with zlib. Consecutive objects of the same type go
+ * into one PrimitiveGroup. The buffer should not contain more objects
+ * than fit into a PBF block (the output of filtering one input block
+ * always fits).
+ *
+ * Uses the default granularities, so coordinates are the fixed-point
+ * coordinates of osmium::Location and timestamps are in seconds.
+ */
+class PBFBlockEncoder {
+
+    std::vector<std::string> m_strings;
+    std::unordered_map<std::string, std::uint32_t> m_string_ids;
+
+    // Reused between blocks
+    std::vector<std::int64_t> m_ids;
+    std::vector<std::int64_t> m_lats;
+    std::vector<std::int64_t> m_lons;
+    std::vector<std::int32_t> m_versions;
+    std::vector<std::int64_t> m_timestamps;
+    std::vector<std::int64_t> m_changesets;
+    std::vector<std::int32_t> m_uids;
+    std::vector<std::int32_t> m_user_sids;
+    std::vector<bool> m_visibles;
+    std::vector<std::int32_t> m_keys_vals;
+    std::vector<std::uint32_t> m_keys;
+    std::vector<std::uint32_t> m_vals;
+    std::vector<std::int64_t> m_refs;
+    std::vector<std::int32_t> m_roles;
+    std::vector<std::int32_t> m_types;
+
+    std::uint32_t string_id(const char* str) {
+        const auto result = m_string_ids.emplace(str, static_cast<std::uint32_t>(m_strings.size()));
+        if (result.second) {
+            m_strings.emplace_back(str);
+        }
+        return result.first->second;
+    }
+
+    static bool has_metadata(const osmium::OSMObject& object) noexcept {
+        return object.version() != 0 || object.timestamp().valid();
+    }
+
+    void add_info(protozero::pbf_writer& parent, const osmium::OSMObject& object) {
+        if (!has_metadata(object) && object.visible()) {
+            return;
+        }
+        protozero::pbf_writer pbf{parent, 4};
+        pbf.add_int32(1, static_cast<std::int32_t>(object.version()));
+        pbf.add_int64(2, static_cast<std::int64_t>(object.timestamp().seconds_since_epoch()));
+        pbf.add_int64(3, static_cast<std::int64_t>(object.changeset()));
+        pbf.add_int32(4, static_cast<std::int32_t>(object.uid()));
+        pbf.add_uint32(5, string_id(object.user()));
+        if (!object.visible()) {
+            pbf.add_bool(6, false);
+        }
+    }
+
+    void add_tags(const osmium::OSMObject& object) {
+        m_keys.clear();
+        m_vals.clear();
+        for (const auto& tag : object.tags()) {
+            m_keys.push_back(string_id(tag.key()));
+            m_vals.push_back(string_id(tag.value()));
+        }
+    }
+
+    // Delta encode values in place.
+    template <typename T>
+    static void delta_encode(std::vector<T>& values) {
+        T last = 0;
+        for (auto& value : values) {
+            const T current = value;
+            value = current - last;
+            last = current;
+        }
+    }
+
+    void clear_dense_nodes() {
+        m_ids.clear();
+        m_lats.clear();
+        m_lons.clear();
+        m_versions.clear();
+        m_timestamps.clear();
+        m_changesets.clear();
+        m_uids.clear();
+        m_user_sids.clear();
+        m_visibles.clear();
+        m_keys_vals.clear();
+    }
+
+    void add_dense_node(const osmium::Node& node) {
+        m_ids.push_back(node.id());
+        m_lats.push_back(node.location().y());
+        m_lons.push_back(node.location().x());
+        m_versions.push_back(static_cast<std::int32_t>(node.version()));
+        m_timestamps.push_back(static_cast<std::int64_t>(node.timestamp().seconds_since_epoch()));
+        m_changesets.push_back(static_cast<std::int64_t>(node.changeset()));
+        m_uids.push_back(static_cast<std::int32_t>(node.uid()));
+        m_user_sids.push_back(static_cast<std::int32_t>(string_id(node.user())));
+        m_visibles.push_back(node.visible());
+        for (const auto& tag : node.tags()) {
+            m_keys_vals.push_back(static_cast<std::int32_t>(string_id(tag.key())));
+            m_keys_vals.push_back(static_cast<std::int32_t>(string_id(tag.value())));
+        }
+        m_keys_vals.push_back(0);
+    }
+
+    void write_dense_nodes(protozero::pbf_writer& block, bool with_metadata) {
+        delta_encode(m_ids);
+        delta_encode(m_lats);
+        delta_encode(m_lons);
+        delta_encode(m_timestamps);
+        delta_encode(m_changesets);
+        delta_encode(m_uids);
+        delta_encode(m_user_sids);
+
+        protozero::pbf_writer group{block, 2};
+        protozero::pbf_writer dense{group, 2};
+        dense.add_packed_sint64(1, m_ids.cbegin(), m_ids.cend());
+        if (with_metadata) {
+            protozero::pbf_writer info{dense, 5};
+            info.add_packed_int32(1, m_versions.cbegin(), m_versions.cend());
+            info.add_packed_sint64(2, m_timestamps.cbegin(), m_timestamps.cend());
+            info.add_packed_sint64(3, m_changesets.cbegin(), m_changesets.cend());
+            info.add_packed_sint32(4, m_uids.cbegin(), m_uids.cend());
+            info.add_packed_sint32(5, m_user_sids.cbegin(), m_user_sids.cend());
+            if (std::find(m_visibles.cbegin(), m_visibles.cend(), false) != m_visibles.cend()) {
+                info.add_packed_bool(6, m_visibles.cbegin(), m_visibles.cend());
+            }
+        }
+        dense.add_packed_sint64(8, m_lats.cbegin(), m_lats.cend());
+        dense.add_packed_sint64(9, m_lons.cbegin(), m_lons.cend());
+        if (m_keys_vals.size() > m_ids.size()) {
+            dense.add_packed_int32(10, m_keys_vals.cbegin(), m_keys_vals.cend());
+        }
+    }
+
+    void add_way(protozero::pbf_writer& group, const osmium::Way& way) {
+        protozero::pbf_writer pbf{group, 3};
+        pbf.add_int64(1, way.id());
+        add_tags(way);
+        pbf.add_packed_uint32(2, m_keys.cbegin(), m_keys.cend());
+        pbf.add_packed_uint32(3, m_vals.cbegin(), m_vals.cend());
+        add_info(pbf, way);
+        m_refs.clear();
+        for (const auto& nr : way.nodes()) {
+            m_refs.push_back(nr.ref());
+        }
+        delta_encode(m_refs);
+        pbf.add_packed_sint64(8, m_refs.cbegin(), m_refs.cend());
+    }
+
+    void add_relation(protozero::pbf_writer& group, const osmium::Relation& relation) {
+        protozero::pbf_writer pbf{group, 4};
+        pbf.add_int64(1, relation.id());
+        add_tags(relation);
+        pbf.add_packed_uint32(2, m_keys.cbegin(), m_keys.cend());
+        pbf.add_packed_uint32(3, m_vals.cbegin(), m_vals.cend());
+        add_info(pbf, relation);
+        m_roles.clear();
+        m_refs.clear();
+        m_types.clear();
+        for (const auto& member : relation.members()) {
+            m_roles.push_back(static_cast<std::int32_t>(string_id(member.role())));
+            m_refs.push_back(member.ref());
+            m_types.push_back(static_cast<std::int32_t>(osmium::item_type_to_nwr_index(member.type())));
+        }
+        delta_encode(m_refs);
+        pbf.add_packed_int32(8, m_roles.cbegin(), m_roles.cend());
+        pbf.add_packed_sint64(9, m_refs.cbegin(), m_refs.cend());
+        pbf.add_packed_int32(10, m_types.cbegin(), m_types.cend());
+    }
+
+    std::string encode_primitive_block(const osmium::memory::Buffer& buffer) {
+        m_strings.clear();
+        m_string_ids.clear();
+        string_id(""); // string 0 is always the empty string
+
+        // The string table has to be written first, but is only complete
+        // after all groups are encoded. So encode the groups separately.
+        std::string groups;
+        protozero::pbf_writer groups_writer{groups};
+        auto it = buffer.select<osmium::OSMObject>().cbegin();
+        const auto end = buffer.select<osmium::OSMObject>().cend();
+        while (it != end) {
+            const auto type = it->type();
+            if (type == osmium::item_type::node) {
+                clear_dense_nodes();
+                bool with_metadata = false;
+                for (; it != end && it->type() == type; ++it) {
+                    add_dense_node(static_cast<const osmium::Node&>(*it));
+                    with_metadata = with_metadata || has_metadata(*it) || !it->visible();
+                }
+                write_dense_nodes(groups_writer, with_metadata);
+            } else {
+                protozero::pbf_writer group{groups_writer, 2};
+                for (; it != end && it->type() == type; ++it) {
+                    if (type == osmium::item_type::way) {
+                        add_way(group, static_cast<const osmium::Way&>(*it));
+                    } else {
+                        add_relation(group, static_cast<const osmium::Relation&>(*it));
+                    }
+                }
+            }
+        }
+
+        std::string block;
+        {
+            protozero::pbf_writer pbf{block};
+            protozero::pbf_writer string_table{pbf, 1};
+            for (const auto& str : m_strings) {
+                string_table.add_bytes(1, str);
+            }
+        }
+        block += groups;
+        return block;
+    }
+
+public:
+
+    /**
+     * Encode objects into a complete PBF file block. Returns an empty
+     * string if there are no objects in the buffer.
+     */
+    std::string operator()(const osmium::memory::Buffer& buffer) {
+        if (buffer.select<osmium::OSMObject>().cbegin() == buffer.select<osmium::OSMObject>().cend()) {
+            return std::string{};
+        }
+
+        const std::string data = encode_primitive_block(buffer);
+
+        uLongf compressed_size = compressBound(static_cast<uLong>(data.size()));
+        std::string compressed(compressed_size, '\0');
+        const auto result = ::compress(reinterpret_cast<Bytef*>(&compressed[0]), &compressed_size,
+                                       reinterpret_cast<const Bytef*>(data.data()), static_cast<uLong>(data.size()));
+        if (result != Z_OK) {
+            throw std::runtime_error{"Failed to compress PBF block"};
+        }
+        compressed.resize(compressed_size);
+
+        std::string blob;
+        {
+            protozero::pbf_writer pbf{blob};
+            pbf.add_int32(2, static_cast<std::int32_t>(data.size()));
+            pbf.add_bytes(3, compressed);
+        }
+
+        return pbf_file_block("OSMData", blob);
+    }
+
+}; // class PBFBlockEncoder
+
+/**
+ * Writes complete PBF file blocks to a file (or stdout for "-").
+ */
+class PBFFileWriter {
+
+    int m_fd;
+
+public:
+
+    explicit PBFFileWriter(const std::string& filename) :
+        m_fd(filename == "-" ? 1 : ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666)) {
+        if (m_fd < 0) {
+            throw std::system_error{errno, std::system_category(), "Can not open file '" + filename + "' for writing"};
+        }
+    }
+
+    PBFFileWriter(const PBFFileWriter&) = delete;
+    PBFFileWriter& operator=(const PBFFileWriter&) = delete;
+
+    ~PBFFileWriter() {
+        try {
+            close();
+        } catch (...) {
+            // ignore errors in destructor
+        }
+    }
+
+    void write(const std::string& data) {
+        std::size_t done = 0;
+        while (done < data.size()) {
+            const auto result = ::write(m_fd, data.data() + done, data.size() - done);
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error{errno, std::system_category(), "Write error"};
+            }
+            done += static_cast<std::size_t>(result);
+        }
+    }
+
+    void close() {
+        if (m_fd > 1) {
+            if (::close(m_fd) != 0) {
+                m_fd = -1;
+                throw std::system_error{errno, std::system_category(), "Close error"};
+            }
+        }
+        m_fd = -1;
+    }
+
+}; // class PBFFileWriter
+
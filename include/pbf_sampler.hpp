@@ -0,0 +1,290 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <limits>
+#include <numeric>
+#include <ostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <protozero/pbf_reader.hpp>
+
+#include <osmium/io/detail/pbf_decoder.hpp>
+#include <osmium/osm/entity_bits.hpp>
+#include <osmium/util/file.hpp>
+
+#include "dump_chunks.hpp"
+#include "pbf_block_decoder.hpp"
+
+/**
+ * Estimate of a total from a sample with a 95% confidence interval.
+ */
+struct sample_estimate {
+    double value = 0.0;
+    double low = 0.0;
+    double high = 0.0;
+};
+
+/**
+ * Result of a PBFSampler run.
+ */
+struct sample_result {
+
+    std::size_t blocks = 0;  // data blocks in the file
+    std::size_t sampled = 0; // blocks in the sample
+
+    // Matching objects by type (nwr index).
+    std::array<sample_estimate, 3> objects;
+
+    // Size of the matching objects in the (compressed) input file,
+    // estimated from the share of matching objects in each block. This is
+    // about the size of the PBF output.
+    sample_estimate bytes;
+
+    // Time spent decoding and matching the sample (in all threads).
+    std::chrono::nanoseconds time{0};
+
+    void print(std::ostream& out, unsigned num_threads) const {
+        out << "sampled " << sampled << " of " << blocks << " blocks\n";
+        out << "\testimate\tlow\thigh\n";
+        const char* names[] = {"nodes", "ways", "relations"};
+        out << std::fixed << std::setprecision(0);
+        for (std::size_t i = 0; i < objects.size(); ++i) {
+            out << names[i] << '\t' << objects[i].value << '\t' << objects[i].low << '\t' << objects[i].high << '\n';
+        }
+        out << "bytes\t" << bytes.value << '\t' << bytes.low << '\t' << bytes.high << '\n';
+        if (sampled > 0) {
+            const double seconds = std::chrono::duration<double>(time).count() * double(blocks) / double(sampled) / double(std::max(1u, num_threads));
+            out << std::setprecision(1) << "estimated time for full run: " << seconds << "s\n";
+        }
+    }
+
+}; // struct sample_result
+
+/**
+ * Estimates how many objects in a PBF file match a filter by decoding
+ * only a random sample of its data blocks (--sample).
+ *
+ * The blob headers are read to find the blocks, the blobs themselves are
+ * skipped. A uniformly random subset of the blocks is then decoded in
+ * count_only mode (see PBFBlockDecoder). The totals are estimated from
+ * the counts in the sampled blocks (cluster sampling without
+ * replacement), so blocks with many matches next to blocks without any
+ * give wide confidence intervals.
+ */
+class PBFSampler {
+
+    // Limits from the PBF format specification.
+    static constexpr const std::uint32_t max_blob_header_size = 64 * 1024;
+    static constexpr const std::uint32_t max_blob_size = 32 * 1024 * 1024;
+
+    struct blob_position {
+        std::uint64_t offset; // of the Blob message
+        std::uint32_t size;
+    };
+
+    struct block_sample {
+        match_counts::counts_type matched{{0, 0, 0}};
+        std::size_t objects = 0;
+        std::chrono::nanoseconds time{0};
+    };
+
+    int m_fd;
+    std::vector<blob_position> m_blobs;
+
+    void read_exactly(char* data, std::size_t size, std::uint64_t offset) const {
+        std::size_t done = 0;
+        while (done < size) {
+            const auto result = ::pread(m_fd, data + done, size - done, static_cast<off_t>(offset + done));
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error{errno, std::system_category(), "Read error"};
+            }
+            if (result == 0) {
+                throw std::runtime_error{"PBF error: truncated file"};
+            }
+            done += static_cast<std::size_t>(result);
+        }
+    }
+
+    // Find all OSMData blobs.
+    void scan() {
+        const std::uint64_t file_size = osmium::util::file_size(m_fd);
+        std::uint64_t offset = 0;
+        while (offset < file_size) {
+            unsigned char size_bytes[4];
+            read_exactly(reinterpret_cast<char*>(size_bytes), sizeof(size_bytes), offset);
+            const std::uint32_t header_size = (std::uint32_t(size_bytes[0]) << 24) |
+                                              (std::uint32_t(size_bytes[1]) << 16) |
+                                              (std::uint32_t(size_bytes[2]) << 8) |
+                                               std::uint32_t(size_bytes[3]);
+            if (header_size > max_blob_header_size) {
+                throw std::runtime_error{"PBF error: invalid BlobHeader size"};
+            }
+            offset += sizeof(size_bytes);
+
+            std::string header(header_size, '\0');
+            read_exactly(&header[0], header.size(), offset);
+            offset += header_size;
+
+            bool data_blob = false;
+            std::int32_t data_size = 0;
+            protozero::pbf_reader pbf{header};
+            while (pbf.next()) {
+                switch (pbf.tag()) {
+                    case 1: // type
+                        data_blob = pbf.get_string() == "OSMData";
+                        break;
+                    case 3: // datasize
+                        data_size = pbf.get_int32();
+                        break;
+                    default:
+                        pbf.skip();
+                }
+            }
+            if (data_size <= 0 || std::uint32_t(data_size) > max_blob_size) {
+                throw std::runtime_error{"PBF error: invalid Blob size"};
+            }
+
+            if (data_blob) {
+                m_blobs.push_back(blob_position{offset, std::uint32_t(data_size)});
+            }
+            offset += std::uint32_t(data_size);
+        }
+    }
+
+    // Estimate total from the values of the sampled blocks.
+    static sample_estimate estimate(const std::vector<double>& values, std::size_t population) {
+        sample_estimate result;
+        const auto n = double(values.size());
+        const auto N = double(population);
+        if (values.empty()) {
+            return result;
+        }
+
+        const double sum = std::accumulate(values.cbegin(), values.cend(), 0.0);
+        const double mean = sum / n;
+        result.value = mean * N;
+
+        if (values.size() < 2) {
+            result.low = sum;
+            result.high = std::numeric_limits<double>::infinity();
+            return result;
+        }
+
+        double variance = 0.0;
+        for (const auto value : values) {
+            variance += (value - mean) * (value - mean);
+        }
+        variance /= n - 1;
+
+        const double error = 1.96 * N * std::sqrt((1.0 - n / N) * variance / n);
+        result.low = std::max(sum, result.value - error);
+        result.high = result.value + error;
+        return result;
+    }
+
+public:
+
+    explicit PBFSampler(const std::string& filename) :
+        m_fd(::open(filename.c_str(), O_RDONLY)) {
+        if (m_fd < 0) {
+            throw std::system_error{errno, std::system_category(), "Can not open file '" + filename + "'"};
+        }
+        try {
+            scan();
+        } catch (...) {
+            ::close(m_fd);
+            throw;
+        }
+    }
+
+    PBFSampler(const PBFSampler&) = delete;
+    PBFSampler& operator=(const PBFSampler&) = delete;
+
+    ~PBFSampler() {
+        ::close(m_fd);
+    }
+
+    std::size_t num_blocks() const noexcept {
+        return m_blobs.size();
+    }
+
+    /**
+     * Decode a random sample of the given fraction (at least one block)
+     * of the data blocks and estimate the totals. The options must have a
+     * select function, they are used in count_only mode.
+     */
+    sample_result run(double fraction, std::uint64_t seed, unsigned num_threads,
+                      osmium::osm_entity_bits::type entities, pbf_decode_options options) const {
+        sample_result result;
+        result.blocks = m_blobs.size();
+        if (m_blobs.empty()) {
+            return result;
+        }
+
+        // Pick the sample and read it in file order.
+        std::vector<std::size_t> indexes(m_blobs.size());
+        std::iota(indexes.begin(), indexes.end(), 0);
+        std::mt19937_64 random{seed};
+        std::shuffle(indexes.begin(), indexes.end(), random);
+        const auto size = std::min(m_blobs.size(), std::max<std::size_t>(1, std::size_t(std::llround(fraction * double(m_blobs.size())))));
+        indexes.resize(size);
+        std::sort(indexes.begin(), indexes.end());
+        result.sampled = size;
+
+        options.count_only = true;
+        options.projection = nullptr;
+
+        std::vector<block_sample> samples(size);
+        process_chunks_ordered(size, num_threads, [&](unsigned /*thread_num*/, std::size_t n) {
+            const auto start = std::chrono::steady_clock::now();
+            const auto& blob = m_blobs[indexes[n]];
+            std::string data(blob.size, '\0');
+            read_exactly(&data[0], data.size(), blob.offset);
+            std::string uncompressed;
+            PBFBlockDecoder decoder{osmium::io::detail::decode_blob(data, uncompressed), entities, options};
+            const auto block = decoder();
+            samples[n].matched = block.counts.objects;
+            samples[n].objects = block.objects;
+            samples[n].time = std::chrono::steady_clock::now() - start;
+        }, [](std::size_t /*n*/) {
+            return true;
+        });
+
+        std::vector<double> values(size);
+        for (std::size_t type = 0; type < result.objects.size(); ++type) {
+            for (std::size_t n = 0; n < size; ++n) {
+                values[n] = double(samples[n].matched[type]);
+            }
+            result.objects[type] = estimate(values, m_blobs.size());
+        }
+
+        for (std::size_t n = 0; n < size; ++n) {
+            const auto& s = samples[n];
+            const auto matched = s.matched[0] + s.matched[1] + s.matched[2];
+            values[n] = s.objects == 0 ? 0.0 : double(m_blobs[indexes[n]].size) * double(matched) / double(s.objects);
+            result.time += s.time;
+        }
+        result.bytes = estimate(values, m_blobs.size());
+
+        return result;
+    }
+
+}; // class PBFSampler
+
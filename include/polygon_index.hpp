@@ -0,0 +1,260 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <istream>
+#include <limits>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <osmium/osm/location.hpp>
+
+/**
+ * A (multi)polygon prepared for fast point-in-polygon tests.
+ *
+ * The bounding box of the polygon is divided into a grid of
+ * grid_size x grid_size cells. Each cell is marked as inside, outside,
+ * or boundary (some polygon segment touches it). Points in inside or
+ * outside cells are decided by a single lookup, only points in boundary
+ * cells need the exact test. For that the segments are stored by grid
+ * row, so only the segments crossing the row of the point are checked.
+ *
+ * All coordinates are the fixed-point integer coordinates of
+ * osmium::Location, all calculations are done with integers. Rings are
+ * combined with the even-odd rule, so holes work without knowing which
+ * rings are inner rings.
+ */
+class PolygonIndex {
+
+public:
+
+    static constexpr const std::int64_t grid_size = 256;
+
+private:
+
+    enum class cell_type : std::uint8_t {
+        outside,
+        inside,
+        boundary
+    };
+
+    struct segment {
+        std::int32_t x1;
+        std::int32_t y1;
+        std::int32_t x2;
+        std::int32_t y2;
+    };
+
+    std::vector<std::vector<osmium::Location>> m_rings;
+
+    std::int64_t m_min_x = 0;
+    std::int64_t m_min_y = 0;
+    std::int64_t m_max_x = -1;
+    std::int64_t m_max_y = -1;
+    std::int64_t m_cell_width = 1;
+    std::int64_t m_cell_height = 1;
+
+    std::vector<cell_type> m_cells;
+
+    // Segments crossing each grid row, row r has the segments from
+    // m_row_offsets[r] to m_row_offsets[r + 1].
+    std::vector<std::size_t> m_row_offsets;
+    std::vector<segment> m_row_segments;
+
+    std::int64_t column(std::int64_t x) const noexcept {
+        return std::min((x - m_min_x) / m_cell_width, grid_size - 1);
+    }
+
+    std::int64_t row(std::int64_t y) const noexcept {
+        return std::min((y - m_min_y) / m_cell_height, grid_size - 1);
+    }
+
+    template <typename TFunc>
+    void for_each_segment(TFunc&& func) const {
+        for (const auto& ring : m_rings) {
+            for (std::size_t i = 0; i < ring.size(); ++i) {
+                const auto& a = ring[i];
+                const auto& b = ring[(i + 1) % ring.size()];
+                func(segment{a.x(), a.y(), b.x(), b.y()});
+            }
+        }
+    }
+
+    // Crossing number test with a ray from the point in positive x
+    // direction against the segments of the row.
+    bool exact_contains(std::int64_t x, std::int64_t y) const noexcept {
+        const auto r = row(y);
+        bool inside = false;
+        for (auto i = m_row_offsets[r]; i < m_row_offsets[r + 1]; ++i) {
+            const auto& s = m_row_segments[i];
+            if ((s.y1 > y) == (s.y2 > y)) {
+                continue;
+            }
+            const std::int64_t lhs = (x - s.x1) * (std::int64_t(s.y2) - s.y1);
+            const std::int64_t rhs = (y - s.y1) * (std::int64_t(s.x2) - s.x1);
+            if (s.y2 > s.y1 ? lhs < rhs : lhs > rhs) {
+                inside = !inside;
+            }
+        }
+        return inside;
+    }
+
+    void build_index() {
+        m_min_x = m_min_y = std::numeric_limits<std::int64_t>::max();
+        m_max_x = m_max_y = std::numeric_limits<std::int64_t>::min();
+        for (const auto& ring : m_rings) {
+            for (const auto& location : ring) {
+                m_min_x = std::min<std::int64_t>(m_min_x, location.x());
+                m_min_y = std::min<std::int64_t>(m_min_y, location.y());
+                m_max_x = std::max<std::int64_t>(m_max_x, location.x());
+                m_max_y = std::max<std::int64_t>(m_max_y, location.y());
+            }
+        }
+
+        m_cell_width = std::max<std::int64_t>(1, (m_max_x - m_min_x) / grid_size + 1);
+        m_cell_height = std::max<std::int64_t>(1, (m_max_y - m_min_y) / grid_size + 1);
+
+        // Sort segments into rows.
+        std::vector<std::size_t> counts(grid_size + 1, 0);
+        for_each_segment([&](const segment& s) {
+            for (auto r = row(std::min(s.y1, s.y2)); r <= row(std::max(s.y1, s.y2)); ++r) {
+                ++counts[r + 1];
+            }
+        });
+        m_row_offsets.resize(grid_size + 1);
+        std::partial_sum(counts.cbegin(), counts.cend(), m_row_offsets.begin());
+        m_row_segments.resize(m_row_offsets.back());
+        std::vector<std::size_t> pos(m_row_offsets.cbegin(), m_row_offsets.cend() - 1);
+        for_each_segment([&](const segment& s) {
+            for (auto r = row(std::min(s.y1, s.y2)); r <= row(std::max(s.y1, s.y2)); ++r) {
+                m_row_segments[pos[r]++] = s;
+            }
+        });
+
+        // Mark all cells touched by a segment as boundary cells. Segments
+        // are cut into pieces not longer than a cell, each piece can only
+        // touch the cells in its bounding box.
+        m_cells.assign(grid_size * grid_size, cell_type::outside);
+        for_each_segment([&](const segment& s) {
+            const std::int64_t dx = std::int64_t(s.x2) - s.x1;
+            const std::int64_t dy = std::int64_t(s.y2) - s.y1;
+            const std::int64_t steps = std::max(std::abs(dx) / m_cell_width, std::abs(dy) / m_cell_height) + 1;
+            for (std::int64_t i = 0; i < steps; ++i) {
+                const std::int64_t ax = s.x1 + dx * i / steps;
+                const std::int64_t ay = s.y1 + dy * i / steps;
+                const std::int64_t bx = s.x1 + dx * (i + 1) / steps;
+                const std::int64_t by = s.y1 + dy * (i + 1) / steps;
+                for (auto r = row(std::min(ay, by)); r <= row(std::max(ay, by)); ++r) {
+                    for (auto c = column(std::min(ax, bx)); c <= column(std::max(ax, bx)); ++c) {
+                        m_cells[r * grid_size + c] = cell_type::boundary;
+                    }
+                }
+            }
+        });
+
+        // No segment crosses the other cells, so they are completely
+        // inside or outside. Check one point in each.
+        for (std::int64_t r = 0; r < grid_size; ++r) {
+            for (std::int64_t c = 0; c < grid_size; ++c) {
+                auto& cell = m_cells[r * grid_size + c];
+                if (cell != cell_type::boundary) {
+                    const auto x = m_min_x + c * m_cell_width + m_cell_width / 2;
+                    const auto y = m_min_y + r * m_cell_height + m_cell_height / 2;
+                    cell = exact_contains(x, y) ? cell_type::inside : cell_type::outside;
+                }
+            }
+        }
+    }
+
+public:
+
+    PolygonIndex() = default;
+
+    /**
+     * Read polygon in the Osmosis polygon filter file format: A name line,
+     * then any number of rings, each consisting of a name line (starting
+     * with '!' for holes), lines with longitude and latitude, and a line
+     * "END". The file ends with another "END" line.
+     */
+    explicit PolygonIndex(std::istream& input) {
+        std::string line;
+        if (!std::getline(input, line)) {
+            throw std::runtime_error{"Invalid polygon file: empty"};
+        }
+
+        while (std::getline(input, line)) {
+            if (line.find_first_not_of(" \t\r") == std::string::npos) {
+                continue;
+            }
+            if (line.compare(0, 3, "END") == 0) {
+                break;
+            }
+
+            std::vector<osmium::Location> ring;
+            while (std::getline(input, line)) {
+                if (line.compare(0, 3, "END") == 0) {
+                    break;
+                }
+                if (line.find_first_not_of(" \t\r") == std::string::npos) {
+                    continue;
+                }
+                std::istringstream coordinates{line};
+                double lon;
+                double lat;
+                if (!(coordinates >> lon >> lat)) {
+                    throw std::runtime_error{"Invalid polygon file: can not parse '" + line + "'"};
+                }
+                const osmium::Location location{lon, lat};
+                if (!location.valid()) {
+                    throw std::runtime_error{"Invalid polygon file: invalid location '" + line + "'"};
+                }
+                ring.push_back(location);
+            }
+
+            if (ring.size() >= 3) {
+                m_rings.push_back(std::move(ring));
+            }
+        }
+
+        if (m_rings.empty()) {
+            throw std::runtime_error{"Invalid polygon file: no rings"};
+        }
+
+        build_index();
+    }
+
+    static PolygonIndex from_file(const std::string& filename) {
+        std::ifstream input{filename};
+        if (!input) {
+            throw std::runtime_error{"Can not open polygon file '" + filename + "'"};
+        }
+        return PolygonIndex{input};
+    }
+
+    bool contains(const osmium::Location& location) const noexcept {
+        const std::int64_t x = location.x();
+        const std::int64_t y = location.y();
+        if (x < m_min_x || x > m_max_x || y < m_min_y || y > m_max_y) {
+            return false;
+        }
+
+        switch (m_cells[row(y) * grid_size + column(x)]) {
+            case cell_type::inside:
+                return true;
+            case cell_type::outside:
+                return false;
+            default:
+                break;
+        }
+
+        return exact_contains(x, y);
+    }
+
+}; // class PolygonIndex
+
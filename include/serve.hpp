@@ -0,0 +1,9 @@
+#pragma once
+
+/**
+ * Entry point for "osmium-filter serve": Keep a dump and prepared filters
+ * in memory and answer filter requests on a Unix domain socket. Called
+ * with the command line arguments after "serve".
+ */
+int serve(int argc, char* argv[]);
+
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/types.hpp>
+
+/**
+ * A set of object IDs (of all types) using no more than a fixed amount
+ * of memory, for --complete-ways with --max-memory.
+ *
+ * IDs are collected in a buffer. When it is full, it is sorted and
+ * written to a temporary file as a sorted "run". After finish() all runs
+ * are merged on the fly while looking up IDs. Lookups must be done in
+ * the order of a sorted OSM file: by type (nodes, ways, relations), then
+ * by ID. Each ID is stored together with its type in one 64 bit key that
+ * sorts in that order.
+ */
+class SpilledIdSet {
+
+    using key_type = std::uint64_t;
+
+    // Entries read from the file at a time for each run.
+    static constexpr const std::size_t min_read_size = 4096;
+
+    struct run {
+        std::uint64_t offset = 0; // in entries from start of file
+        std::uint64_t size = 0;   // number of entries
+        std::uint64_t read = 0;   // entries read from file so far
+        std::vector<key_type> buffer;
+        std::size_t buffer_pos = 0;
+    };
+
+    using heap_entry = std::pair<key_type, std::size_t>;
+
+    std::size_t m_max_entries;
+    std::string m_directory;
+    int m_fd = -1;
+    std::uint64_t m_file_entries = 0;
+
+    std::vector<key_type> m_buffer;
+    std::vector<run> m_runs;
+
+    std::priority_queue<heap_entry, std::vector<heap_entry>, std::greater<heap_entry>> m_heap;
+    key_type m_last_lookup = 0;
+    bool m_finished = false;
+
+    static key_type make_key(osmium::item_type type, osmium::unsigned_object_id_type id) noexcept {
+        return (key_type(osmium::item_type_to_nwr_index(type)) << 62U) | key_type(id);
+    }
+
+    void open_file() {
+        std::string name = m_directory + "/osmium-filter-XXXXXX";
+        m_fd = ::mkstemp(&name[0]);
+        if (m_fd < 0) {
+            throw std::system_error{errno, std::system_category(), "Can not create temporary file in '" + m_directory + "'"};
+        }
+        // The file is removed as soon as it is closed.
+        ::unlink(name.c_str());
+    }
+
+    void sort_buffer() {
+        std::sort(m_buffer.begin(), m_buffer.end());
+        m_buffer.erase(std::unique(m_buffer.begin(), m_buffer.end()), m_buffer.end());
+    }
+
+    void spill() {
+        sort_buffer();
+        if (m_fd < 0) {
+            open_file();
+        }
+
+        const auto bytes = m_buffer.size() * sizeof(key_type);
+        const auto offset = static_cast<off_t>(m_file_entries * sizeof(key_type));
+        std::size_t done = 0;
+        while (done < bytes) {
+            const auto result = ::pwrite(m_fd, reinterpret_cast<const char*>(m_buffer.data()) + done, bytes - done, offset + static_cast<off_t>(done));
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error{errno, std::system_category(), "Error writing temporary file"};
+            }
+            done += static_cast<std::size_t>(result);
+        }
+
+        run r;
+        r.offset = m_file_entries;
+        r.size = m_buffer.size();
+        m_runs.push_back(std::move(r));
+        m_file_entries += m_buffer.size();
+        m_buffer.clear();
+    }
+
+    // Get next key from run. Returns false if the run is exhausted.
+    bool next_key(run& r, key_type& key) {
+        if (r.buffer_pos == r.buffer.size()) {
+            if (r.read == r.size) {
+                return false;
+            }
+            r.buffer.resize(std::min<std::uint64_t>(r.buffer.capacity(), r.size - r.read));
+            const auto bytes = r.buffer.size() * sizeof(key_type);
+            const auto offset = static_cast<off_t>((r.offset + r.read) * sizeof(key_type));
+            std::size_t done = 0;
+            while (done < bytes) {
+                const auto result = ::pread(m_fd, reinterpret_cast<char*>(r.buffer.data()) + done, bytes - done, offset + static_cast<off_t>(done));
+                if (result < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (result <= 0) {
+                    throw std::system_error{errno, std::system_category(), "Error reading temporary file"};
+                }
+                done += static_cast<std::size_t>(result);
+            }
+            r.read += r.buffer.size();
+            r.buffer_pos = 0;
+        }
+        key = r.buffer[r.buffer_pos++];
+        return true;
+    }
+
+    void push_next(std::size_t run_index) {
+        key_type key;
+        if (next_key(m_runs[run_index], key)) {
+            m_heap.emplace(key, run_index);
+        }
+    }
+
+public:
+
+    /**
+     * Create set using about max_memory bytes. Temporary files are
+     * created in directory.
+     */
+    explicit SpilledIdSet(std::size_t max_memory, std::string directory = "/tmp") :
+        m_max_entries(std::max<std::size_t>(max_memory / sizeof(key_type), min_read_size)),
+        m_directory(std::move(directory)) {
+    }
+
+    SpilledIdSet(const SpilledIdSet&) = delete;
+    SpilledIdSet& operator=(const SpilledIdSet&) = delete;
+
+    ~SpilledIdSet() {
+        if (m_fd >= 0) {
+            ::close(m_fd);
+        }
+    }
+
+    void set(osmium::item_type type, osmium::unsigned_object_id_type id) {
+        if (m_finished) {
+            throw std::logic_error{"SpilledIdSet::set() called after finish()"};
+        }
+        if (m_buffer.size() == m_max_entries) {
+            // Duplicates (a node in many ways) often free enough room.
+            sort_buffer();
+            if (m_buffer.size() > m_max_entries / 2) {
+                spill();
+            }
+        }
+        if (m_buffer.size() == m_buffer.capacity()) {
+            // Grow the buffer ourselves, so it never gets larger than allowed.
+            m_buffer.reserve(std::min(m_max_entries, std::max(m_buffer.capacity() * 2, min_read_size)));
+        }
+        m_buffer.push_back(make_key(type, id));
+    }
+
+    /**
+     * Done with adding IDs, prepare for lookups.
+     */
+    void finish() {
+        if (m_finished) {
+            return;
+        }
+        m_finished = true;
+
+        if (m_runs.empty()) {
+            // Everything fits into memory, use the buffer as the only run.
+            sort_buffer();
+            run r;
+            r.size = m_buffer.size();
+            r.read = r.size;
+            r.buffer.swap(m_buffer);
+            m_runs.push_back(std::move(r));
+        } else {
+            if (!m_buffer.empty()) {
+                spill();
+            }
+            std::vector<key_type>{}.swap(m_buffer);
+            const std::size_t read_size = std::max(min_read_size, m_max_entries / m_runs.size());
+            for (auto& r : m_runs) {
+                r.buffer.reserve(read_size);
+            }
+        }
+
+        for (std::size_t i = 0; i < m_runs.size(); ++i) {
+            push_next(i);
+        }
+    }
+
+    /**
+     * Is this ID in the set? Must be called in sorted order (see above)
+     * after finish().
+     */
+    bool get(osmium::item_type type, osmium::unsigned_object_id_type id) {
+        const key_type key = make_key(type, id);
+        if (key < m_last_lookup) {
+            throw std::runtime_error{"Input file is not sorted (needed for --max-memory)"};
+        }
+        m_last_lookup = key;
+
+        while (!m_heap.empty() && m_heap.top().first < key) {
+            const auto run_index = m_heap.top().second;
+            m_heap.pop();
+            push_next(run_index);
+        }
+        return !m_heap.empty() && m_heap.top().first == key;
+    }
+
+    /**
+     * Number of runs written to disk.
+     */
+    std::size_t spilled_runs() const noexcept {
+        return m_fd < 0 ? 0 : m_runs.size();
+    }
+
+}; // class SpilledIdSet
+
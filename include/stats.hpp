@@ -0,0 +1,10 @@
+#pragma once
+
+/**
+ * Entry point for "osmium-filter stats": Collect statistics about the
+ * tags and objects in an OSM file (see TagStats) and write them to a file
+ * for use with --stats. Called with the command line arguments after
+ * "stats".
+ */
+int stats(int argc, char* argv[]);
+
@@ -0,0 +1,338 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/tag.hpp>
+#include <osmium/osm/way.hpp>
+
+/**
+ * Statistics about the objects in an OSM file, used to estimate how
+ * selective the parts of a filter expression are (see CostModel). They
+ * are created by "osmium-filter stats" and read with --stats.
+ *
+ * For each object type there are the number of objects, the number of
+ * objects with each key together with the most common values of that
+ * key, and histograms of the number of tags and of the length (nodes of
+ * ways, members of relations).
+ *
+ * File format (all numbers in native byte order):
+ *
+ *   8 bytes   magic "OSMFSTAT"
+ *   uint32_t  format version
+ *   uint32_t  number of histogram buckets
+ *   for each type (node, way, relation):
+ *     uint64_t  number of objects
+ *     uint64_t  tag count histogram (one for each bucket)
+ *     uint64_t  length histogram (one for each bucket)
+ *     uint64_t  number of keys
+ *     for each key:
+ *       string    key (uint32_t length followed by the characters)
+ *       uint64_t  number of objects with this key
+ *       uint64_t  number of objects with values not listed
+ *       uint32_t  number of values listed
+ *       for each value: string value, uint64_t number of objects
+ */
+class TagStats {
+
+public:
+
+    // Histogram bucket 0 is for the value 0, bucket n for values from
+    // 2^(n-1) to 2^n-1. The last bucket also contains all larger values.
+    static constexpr const std::size_t num_buckets = 20;
+
+    using histogram_type = std::array<std::uint64_t, num_buckets>;
+
+    struct key_stats {
+        std::uint64_t count = 0;
+
+        // Most common values, most common first. Counts can be a bit
+        // too small (see TagStatsCollector).
+        std::vector<std::pair<std::string, std::uint64_t>> values;
+
+        // Objects with this key and a value not in values.
+        std::uint64_t other_values = 0;
+    };
+
+    struct type_stats {
+        std::uint64_t objects = 0;
+        histogram_type tag_counts{};
+        histogram_type lengths{};
+        std::map<std::string, key_stats> keys;
+    };
+
+private:
+
+    static const char* magic() noexcept {
+        return "OSMFSTAT";
+    }
+
+    static constexpr const std::size_t magic_size = 8;
+    static constexpr const std::uint32_t version = 1;
+
+    std::array<type_stats, 3> m_types; // by nwr index
+
+    template <typename T>
+    static void write_value(std::ofstream& out, T value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    static void write_string(std::ofstream& out, const std::string& str) {
+        write_value(out, static_cast<std::uint32_t>(str.size()));
+        out.write(str.data(), static_cast<std::streamsize>(str.size()));
+    }
+
+    template <typename T>
+    static T read_value(std::ifstream& in) {
+        T value;
+        if (!in.read(reinterpret_cast<char*>(&value), sizeof(T))) {
+            throw std::runtime_error{"Statistics file is truncated"};
+        }
+        return value;
+    }
+
+    static std::string read_string(std::ifstream& in) {
+        const auto size = read_value<std::uint32_t>(in);
+        std::string str(size, '\0');
+        if (size > 0 && !in.read(&str[0], size)) {
+            throw std::runtime_error{"Statistics file is truncated"};
+        }
+        return str;
+    }
+
+public:
+
+    static std::size_t bucket(std::uint64_t value) noexcept {
+        std::size_t n = 0;
+        while (value > 0 && n < num_buckets - 1) {
+            value >>= 1U;
+            ++n;
+        }
+        return n;
+    }
+
+    /**
+     * Estimated fraction of the objects in the histogram with a value
+     * smaller than the given one. Values are assumed to be evenly spread
+     * inside each bucket.
+     */
+    static double fraction_below(const histogram_type& histogram, std::int64_t value) noexcept {
+        std::uint64_t total = 0;
+        for (const auto count : histogram) {
+            total += count;
+        }
+        if (total == 0 || value <= 0) {
+            return 0.0;
+        }
+
+        double below = 0.0;
+        for (std::size_t n = 0; n < num_buckets; ++n) {
+            const double first = n == 0 ? 0.0 : double(std::uint64_t(1) << (n - 1));
+            const double last = n == 0 ? 0.0 : (n == num_buckets - 1 ? 2.0 * first : double(std::uint64_t(1) << n) - 1.0);
+            if (double(value) > last) {
+                below += double(histogram[n]);
+            } else {
+                if (double(value) > first) {
+                    below += double(histogram[n]) * (double(value) - first) / (last - first + 1.0);
+                }
+                break;
+            }
+        }
+        return below / double(total);
+    }
+
+    type_stats& operator()(osmium::item_type type) noexcept {
+        return m_types[osmium::item_type_to_nwr_index(type)];
+    }
+
+    const type_stats& operator()(osmium::item_type type) const noexcept {
+        return m_types[osmium::item_type_to_nwr_index(type)];
+    }
+
+    void write(const std::string& filename) const {
+        std::ofstream out{filename, std::ios::binary | std::ios::trunc};
+        if (!out) {
+            throw std::runtime_error{"Can not open statistics file '" + filename + "' for writing"};
+        }
+
+        out.write(magic(), magic_size);
+        write_value(out, std::uint32_t(version));
+        write_value(out, static_cast<std::uint32_t>(num_buckets));
+
+        for (const auto& type : m_types) {
+            write_value(out, type.objects);
+            for (const auto count : type.tag_counts) {
+                write_value(out, count);
+            }
+            for (const auto count : type.lengths) {
+                write_value(out, count);
+            }
+            write_value(out, static_cast<std::uint64_t>(type.keys.size()));
+            for (const auto& key : type.keys) {
+                write_string(out, key.first);
+                write_value(out, key.second.count);
+                write_value(out, key.second.other_values);
+                write_value(out, static_cast<std::uint32_t>(key.second.values.size()));
+                for (const auto& value : key.second.values) {
+                    write_string(out, value.first);
+                    write_value(out, value.second);
+                }
+            }
+        }
+
+        if (!out) {
+            throw std::runtime_error{"Error writing statistics file '" + filename + "'"};
+        }
+    }
+
+    static TagStats read(const std::string& filename) {
+        std::ifstream in{filename, std::ios::binary};
+        if (!in) {
+            throw std::runtime_error{"Can not open statistics file '" + filename + "'"};
+        }
+
+        char m[magic_size];
+        if (!in.read(m, magic_size) || std::memcmp(m, magic(), magic_size)) {
+            throw std::runtime_error{"Not a statistics file: '" + filename + "'"};
+        }
+        if (read_value<std::uint32_t>(in) != version || read_value<std::uint32_t>(in) != num_buckets) {
+            throw std::runtime_error{"Unsupported statistics file version in '" + filename + "'"};
+        }
+
+        TagStats stats;
+        for (auto& type : stats.m_types) {
+            type.objects = read_value<std::uint64_t>(in);
+            for (auto& count : type.tag_counts) {
+                count = read_value<std::uint64_t>(in);
+            }
+            for (auto& count : type.lengths) {
+                count = read_value<std::uint64_t>(in);
+            }
+            const auto num_keys = read_value<std::uint64_t>(in);
+            for (std::uint64_t k = 0; k < num_keys; ++k) {
+                auto& key = type.keys[read_string(in)];
+                key.count = read_value<std::uint64_t>(in);
+                key.other_values = read_value<std::uint64_t>(in);
+                const auto num_values = read_value<std::uint32_t>(in);
+                for (std::uint32_t v = 0; v < num_values; ++v) {
+                    auto value = read_string(in);
+                    key.values.emplace_back(std::move(value), read_value<std::uint64_t>(in));
+                }
+            }
+        }
+
+        return stats;
+    }
+
+}; // class TagStats
+
+/**
+ * Collects TagStats from the objects of an OSM file.
+ *
+ * Keeping counts for all values of all keys would need too much memory
+ * (think of "name"), so the most common values of each key are found
+ * with the Misra-Gries algorithm: At most max_tracked values are counted,
+ * when a new value comes along and there is no room, all counts are
+ * decreased by one and values with a count of zero are dropped. Counts
+ * of values that are kept are too small by at most 1/(max_tracked+1) of
+ * the number of objects with that key.
+ */
+class TagStatsCollector {
+
+    struct collected_key {
+        std::uint64_t count = 0;
+        std::unordered_map<std::string, std::uint64_t> values;
+    };
+
+    std::array<std::map<std::string, collected_key>, 3> m_keys;
+    TagStats m_stats;
+    std::size_t m_max_tracked;
+    std::size_t m_max_values;
+
+    void add_value(collected_key& key, const char* value) {
+        ++key.count;
+
+        const auto it = key.values.find(value);
+        if (it != key.values.end()) {
+            ++it->second;
+            return;
+        }
+
+        if (key.values.size() < m_max_tracked) {
+            key.values.emplace(value, 1);
+            return;
+        }
+
+        for (auto v = key.values.begin(); v != key.values.end();) {
+            if (--v->second == 0) {
+                v = key.values.erase(v);
+            } else {
+                ++v;
+            }
+        }
+    }
+
+public:
+
+    // Count up to max_tracked values for each key, keep the max_values
+    // most common ones in the statistics.
+    explicit TagStatsCollector(std::size_t max_tracked = 1000, std::size_t max_values = 64) :
+        m_max_tracked(max_tracked),
+        m_max_values(max_values) {
+    }
+
+    void add(const osmium::OSMObject& object) {
+        auto& type = m_stats(object.type());
+        ++type.objects;
+        ++type.tag_counts[TagStats::bucket(object.tags().size())];
+
+        if (object.type() == osmium::item_type::way) {
+            ++type.lengths[TagStats::bucket(static_cast<const osmium::Way&>(object).nodes().size())];
+        } else if (object.type() == osmium::item_type::relation) {
+            ++type.lengths[TagStats::bucket(static_cast<const osmium::Relation&>(object).members().size())];
+        }
+
+        auto& keys = m_keys[osmium::item_type_to_nwr_index(object.type())];
+        for (const auto& tag : object.tags()) {
+            add_value(keys[tag.key()], tag.value());
+        }
+    }
+
+    TagStats stats() const {
+        TagStats stats = m_stats;
+        for (const auto type : {osmium::item_type::node, osmium::item_type::way, osmium::item_type::relation}) {
+            for (const auto& collected : m_keys[osmium::item_type_to_nwr_index(type)]) {
+                auto& key = stats(type).keys[collected.first];
+                key.count = collected.second.count;
+                key.values.assign(collected.second.values.cbegin(), collected.second.values.cend());
+                std::sort(key.values.begin(), key.values.end(), [](const std::pair<std::string, std::uint64_t>& a,
+                                                                   const std::pair<std::string, std::uint64_t>& b) {
+                    return a.second > b.second || (a.second == b.second && a.first < b.first);
+                });
+                if (key.values.size() > m_max_values) {
+                    key.values.resize(m_max_values);
+                }
+                key.other_values = key.count;
+                for (const auto& value : key.values) {
+                    key.other_values -= value.second;
+                }
+            }
+        }
+        return stats;
+    }
+
+}; // class TagStatsCollector
+
@@ -0,0 +1,238 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * Statistics for one worker thread of a WorkStealingPool.
+ */
+struct worker_stats {
+    std::uint64_t tasks = 0;       // tasks run by this worker
+    std::uint64_t stolen = 0;      // tasks taken from other workers
+    std::chrono::nanoseconds busy{0};
+    std::chrono::nanoseconds wall{0};
+
+    double utilization() const noexcept {
+        return wall.count() > 0 ? double(busy.count()) / double(wall.count()) : 0.0;
+    }
+};
+
+inline void print_worker_stats(std::ostream& out, const std::vector<worker_stats>& stats) {
+    for (std::size_t i = 0; i < stats.size(); ++i) {
+        out << "thread " << i << ": " << stats[i].tasks << " tasks ("
+            << stats[i].stolen << " stolen), "
+            << std::fixed << std::setprecision(1) << (stats[i].utilization() * 100.0) << "% busy\n";
+    }
+}
+
+/**
+ * Task deque of one worker. The owner pushes and pops at the back, so it
+ * works on the task it created last, while its data is still in the
+ * cache. Other workers steal from the front, taking the oldest tasks.
+ *
+ * Every deque has its own lock. It is nearly always only used by its
+ * owner, so the lock is uncontended except when somebody steals.
+ */
+template <typename T>
+class WorkStealingDeque {
+
+    std::deque<T> m_tasks;
+    std::mutex m_mutex;
+
+public:
+
+    void push(T&& task) {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_tasks.push_back(std::move(task));
+    }
+
+    bool pop(T& task) {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        if (m_tasks.empty()) {
+            return false;
+        }
+        task = std::move(m_tasks.back());
+        m_tasks.pop_back();
+        return true;
+    }
+
+    bool steal(T& task) {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        if (m_tasks.empty()) {
+            return false;
+        }
+        task = std::move(m_tasks.front());
+        m_tasks.pop_front();
+        return true;
+    }
+
+}; // class WorkStealingDeque
+
+/**
+ * Thread pool where every worker thread has its own WorkStealingDeque.
+ * Tasks submitted from a worker thread (sub-tasks) go into the deque of
+ * that worker, tasks submitted from other threads are distributed
+ * round-robin. Workers without work steal from the others, so expensive
+ * tasks don't leave the other threads idle.
+ *
+ * Tasks must not throw. Tasks still queued on shutdown() are dropped.
+ */
+class WorkStealingPool {
+
+public:
+
+    using task_type = std::function<void()>;
+
+private:
+
+    struct worker {
+        WorkStealingDeque<task_type> tasks;
+        worker_stats stats;
+    };
+
+    struct current_worker {
+        const WorkStealingPool* pool = nullptr;
+        unsigned index = 0;
+    };
+
+    std::vector<std::unique_ptr<worker>> m_workers;
+    std::vector<std::thread> m_threads;
+
+    // Number of tasks in all deques. Incremented before a task is pushed,
+    // so a worker taking it right away can't make it wrap around.
+    std::atomic<std::size_t> m_pending{0};
+    std::atomic<unsigned> m_next_worker{0};
+    std::atomic<bool> m_shutdown{false};
+
+    std::mutex m_sleep_mutex;
+    std::condition_variable m_sleep_cv;
+
+    std::chrono::steady_clock::time_point m_start;
+    std::chrono::nanoseconds m_wall{0};
+
+    static current_worker& current() noexcept {
+        static thread_local current_worker worker;
+        return worker;
+    }
+
+    bool find_task(unsigned index, task_type& task) {
+        auto& self = *m_workers[index];
+        if (self.tasks.pop(task)) {
+            --m_pending;
+            return true;
+        }
+        for (std::size_t i = 1; i < m_workers.size(); ++i) {
+            if (m_workers[(index + i) % m_workers.size()]->tasks.steal(task)) {
+                --m_pending;
+                ++self.stats.stolen;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(unsigned index) {
+        current().pool = this;
+        current().index = index;
+        auto& stats = m_workers[index]->stats;
+
+        task_type task;
+        while (!m_shutdown) {
+            if (find_task(index, task)) {
+                const auto start = std::chrono::steady_clock::now();
+                task();
+                task = nullptr;
+                stats.busy += std::chrono::steady_clock::now() - start;
+                ++stats.tasks;
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock{m_sleep_mutex};
+            m_sleep_cv.wait(lock, [&]() {
+                return m_shutdown || m_pending > 0;
+            });
+        }
+    }
+
+public:
+
+    explicit WorkStealingPool(unsigned num_threads) :
+        m_start(std::chrono::steady_clock::now()) {
+        num_threads = std::max(1u, num_threads);
+        for (unsigned i = 0; i < num_threads; ++i) {
+            m_workers.emplace_back(new worker{});
+        }
+        for (unsigned i = 0; i < num_threads; ++i) {
+            m_threads.emplace_back(&WorkStealingPool::run, this, i);
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    ~WorkStealingPool() {
+        shutdown();
+    }
+
+    void submit(task_type task) {
+        const auto& cw = current();
+        const auto index = cw.pool == this ? cw.index : m_next_worker++ % m_workers.size();
+        ++m_pending;
+        m_workers[index]->tasks.push(std::move(task));
+
+        // Taking the lock makes sure a worker checking m_pending before
+        // going to sleep doesn't miss the notification.
+        {
+            std::lock_guard<std::mutex> lock{m_sleep_mutex};
+        }
+        m_sleep_cv.notify_one();
+    }
+
+    void shutdown() {
+        {
+            std::lock_guard<std::mutex> lock{m_sleep_mutex};
+            m_shutdown = true;
+        }
+        m_sleep_cv.notify_all();
+        for (auto& thread : m_threads) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+        if (!m_threads.empty()) {
+            m_wall = std::chrono::steady_clock::now() - m_start;
+            m_threads.clear();
+        }
+    }
+
+    std::size_t num_threads() const noexcept {
+        return m_workers.size();
+    }
+
+    /**
+     * Get statistics for all workers. Only available after shutdown().
+     */
+    std::vector<worker_stats> stats() const {
+        std::vector<worker_stats> result;
+        for (const auto& w : m_workers) {
+            result.push_back(w->stats);
+            result.back().wall = m_wall;
+        }
+        return result;
+    }
+
+}; // class WorkStealingPool
+
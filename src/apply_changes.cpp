@@ -0,0 +1,472 @@
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <osmium/index/id_set.hpp>
+#include <osmium/index/nwr_array.hpp>
+#include <osmium/io/any_input.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/osm/way.hpp>
+
+#include "apply_changes.hpp"
+#include "match_state.hpp"
+#include "object_filter.hpp"
+#include "output_writer.hpp"
+
+namespace po = boost::program_options;
+
+namespace {
+
+using object_key = std::pair<osmium::item_type, osmium::object_id_type>;
+
+object_key key(const osmium::OSMObject& object) noexcept {
+    return {object.type(), object.id()};
+}
+
+/**
+ * The objects from all change files. Only the newest version of each
+ * object is kept. Objects are sorted by type and ID, the same order as
+ * in the extract.
+ */
+class ChangeSet {
+
+    osmium::memory::Buffer m_buffer{1024 * 1024, osmium::memory::Buffer::auto_grow::yes};
+    std::vector<const osmium::OSMObject*> m_objects;
+
+public:
+
+    using const_iterator = std::vector<const osmium::OSMObject*>::const_iterator;
+
+    explicit ChangeSet(const std::vector<std::string>& filenames) {
+        for (const auto& filename : filenames) {
+            osmium::io::Reader reader{filename};
+            while (osmium::memory::Buffer buffer = reader.read()) {
+                for (const auto& object : buffer.select<osmium::OSMObject>()) {
+                    m_buffer.add_item(object);
+                    m_buffer.commit();
+                }
+            }
+            reader.close();
+        }
+
+        // Pointers can only be taken after all objects are in the buffer,
+        // because the buffer moves its data when it grows.
+        std::vector<const osmium::OSMObject*> objects;
+        for (const auto& object : m_buffer.select<osmium::OSMObject>()) {
+            objects.push_back(&object);
+        }
+
+        // Stable sort, so for the same version the later change wins.
+        std::stable_sort(objects.begin(), objects.end(), [](const osmium::OSMObject* a, const osmium::OSMObject* b) {
+            return std::make_tuple(a->type(), a->id(), a->version()) <
+                   std::make_tuple(b->type(), b->id(), b->version());
+        });
+
+        for (std::size_t i = 0; i < objects.size(); ++i) {
+            if (i + 1 == objects.size() || key(*objects[i]) != key(*objects[i + 1])) {
+                m_objects.push_back(objects[i]);
+            }
+        }
+    }
+
+    const_iterator begin() const noexcept {
+        return m_objects.cbegin();
+    }
+
+    const_iterator end() const noexcept {
+        return m_objects.cend();
+    }
+
+    std::size_t size() const noexcept {
+        return m_objects.size();
+    }
+
+    bool contains(const osmium::OSMObject& object) const {
+        return std::binary_search(m_objects.cbegin(), m_objects.cend(), &object, [](const osmium::OSMObject* a, const osmium::OSMObject* b) {
+            return key(*a) < key(*b);
+        });
+    }
+
+}; // class ChangeSet
+
+/**
+ * Merges the old extract with the changes and decides for every object
+ * whether it is in the new extract. Writes the new extract and/or a
+ * change file with the differences between old and new extract.
+ */
+class ExtractUpdater {
+
+    const osmium::nwr_array<match_state::id_set_type>& m_matched;
+    const match_state::id_set_type& m_needed_nodes;
+    bool m_complete_ways;
+
+    std::unique_ptr<OutputWriter> m_writer;
+    std::unique_ptr<OutputWriter> m_change_writer;
+
+    // Nodes available in old extract or changes.
+    match_state::id_set_type m_present_nodes;
+
+    osmium::memory::Buffer m_deleted_buffer{1024, osmium::memory::Buffer::auto_grow::yes};
+
+    std::size_t m_count = 0;
+    std::size_t m_added = 0;
+    std::size_t m_removed = 0;
+
+    bool keep(const osmium::OSMObject& object) const noexcept {
+        if (!object.visible()) {
+            return false;
+        }
+        if (m_matched(object.type()).get(object.positive_id())) {
+            return true;
+        }
+        return m_complete_ways &&
+               object.type() == osmium::item_type::node &&
+               m_needed_nodes.get(object.positive_id());
+    }
+
+    void write_deleted(const osmium::OSMObject& object) {
+        if (!object.visible()) {
+            (*m_change_writer)(object);
+            return;
+        }
+        auto& copy = m_deleted_buffer.add_item(object);
+        m_deleted_buffer.commit();
+        copy.set_visible(false);
+        (*m_change_writer)(copy);
+        m_deleted_buffer.clear();
+    }
+
+    // Either old or changed can be nullptr, but not both.
+    void update(const osmium::OSMObject* old, const osmium::OSMObject* changed) {
+        const auto& current = changed ? *changed : *old;
+
+        if (current.type() == osmium::item_type::node && current.visible()) {
+            m_present_nodes.set(current.positive_id());
+        }
+
+        if (keep(current)) {
+            ++m_count;
+            if (!old) {
+                ++m_added;
+            }
+            if (m_writer) {
+                (*m_writer)(current);
+            }
+            if (m_change_writer && changed) {
+                (*m_change_writer)(current);
+            }
+        } else if (old) {
+            ++m_removed;
+            if (m_change_writer) {
+                write_deleted(current);
+            }
+        }
+    }
+
+public:
+
+    ExtractUpdater(const osmium::nwr_array<match_state::id_set_type>& matched,
+                   const match_state::id_set_type& needed_nodes,
+                   bool complete_ways,
+                   const std::string& output_filename,
+                   const std::string& output_format,
+                   const std::string& change_filename) :
+        m_matched(matched),
+        m_needed_nodes(needed_nodes),
+        m_complete_ways(complete_ways) {
+        if (!output_filename.empty()) {
+            m_writer.reset(new OutputWriter{output_filename, output_format});
+        }
+        if (!change_filename.empty()) {
+            m_change_writer.reset(new OutputWriter{change_filename, ""});
+        }
+    }
+
+    void run(const std::string& old_extract, const ChangeSet& changes) {
+        auto it = changes.begin();
+
+        osmium::io::Reader reader{old_extract};
+        while (osmium::memory::Buffer buffer = reader.read()) {
+            for (const auto& object : buffer.select<osmium::OSMObject>()) {
+                for (; it != changes.end() && key(**it) < key(object); ++it) {
+                    update(nullptr, *it);
+                }
+                if (it != changes.end() && key(**it) == key(object)) {
+                    update(&object, *it);
+                    ++it;
+                } else {
+                    update(&object, nullptr);
+                }
+            }
+        }
+        reader.close();
+
+        for (; it != changes.end(); ++it) {
+            update(nullptr, *it);
+        }
+
+        if (m_writer) {
+            m_writer->close();
+        }
+        if (m_change_writer) {
+            m_change_writer->close();
+        }
+    }
+
+    /**
+     * Nodes referenced by matching ways, but neither in the old extract
+     * nor in the changes. This happens when a way starts to match without
+     * its nodes changing. They have to be fetched from a full planet.
+     */
+    std::vector<osmium::unsigned_object_id_type> missing_nodes() const {
+        std::vector<osmium::unsigned_object_id_type> missing;
+        if (m_complete_ways) {
+            for (const auto id : m_needed_nodes) {
+                if (!m_present_nodes.get(id)) {
+                    missing.push_back(id);
+                }
+            }
+        }
+        return missing;
+    }
+
+    std::size_t count() const noexcept {
+        return m_count;
+    }
+
+    std::size_t added() const noexcept {
+        return m_added;
+    }
+
+    std::size_t removed() const noexcept {
+        return m_removed;
+    }
+
+}; // class ExtractUpdater
+
+void add_node_refs(const osmium::Way& way, match_state::id_set_type& nodes) {
+    for (const auto& nr : way.nodes()) {
+        nodes.set(nr.positive_ref());
+    }
+}
+
+void print_help(const po::options_description& desc) {
+    std::cout << "osmium-filter apply-changes [OPTIONS] OLD-EXTRACT CHANGE-FILE...\n\n"
+              << "Update an extract created with \"osmium-filter --state\" using OSM change files.\n"
+              << "The filter expression must be the same as for the original extract. Only the\n"
+              << "changed objects are checked against the filter. The old extract must be sorted\n"
+              << "by type and ID.\n\n"
+              << desc << "\n";
+}
+
+} // anonymous namespace
+
+int apply_changes(int argc, char* argv[]) {
+    po::options_description desc{"OPTIONS"};
+    desc.add_options()
+        ("help,h", "Print usage information")
+        ("verbose,v", "Enable verbose output")
+        ("output,o", po::value<std::string>(), "Output file name for updated extract")
+        ("output-format,f", po::value<std::string>(), "Output format")
+        ("output-changes,c", po::value<std::string>(), "Write changes between old and new extract to file")
+        ("expression,e", po::value<std::string>(), "Filter expression")
+        ("expression-file,E", po::value<std::string>(), "Filter expression file")
+        ("state,s", po::value<std::string>(), "State file of the old extract")
+        ("output-state", po::value<std::string>(), "Write state of the new extract to file")
+        ("missing-nodes", po::value<std::string>(), "Write IDs of nodes missing for complete ways to file")
+    ;
+
+    po::options_description hidden;
+    hidden.add_options()
+    ("input-filenames", po::value<std::vector<std::string>>(), "Old extract and change files")
+    ;
+
+    po::options_description parsed_options;
+    parsed_options.add(desc).add(hidden);
+
+    po::positional_options_description positional;
+    positional.add("input-filenames", -1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(parsed_options).positional(positional).run(), vm);
+    po::notify(vm);
+
+    std::vector<std::string> input_filenames;
+    std::string output_format;
+    std::string output_filename;
+    std::string change_filename;
+    std::string filter_expression;
+    std::string state_filename;
+    std::string output_state_filename;
+    std::string missing_nodes_filename;
+    bool verbose = false;
+
+    if (vm.count("help")) {
+        print_help(desc);
+        std::exit(0);
+    }
+
+    if (vm.count("verbose")) {
+        verbose = true;
+    }
+
+    if (vm.count("input-filenames")) {
+        input_filenames = vm["input-filenames"].as<std::vector<std::string>>();
+    }
+
+    if (vm.count("output-format")) {
+        output_format = vm["output-format"].as<std::string>();
+    }
+
+    if (vm.count("output")) {
+        output_filename = vm["output"].as<std::string>();
+    }
+
+    if (vm.count("output-changes")) {
+        change_filename = vm["output-changes"].as<std::string>();
+    }
+
+    if (vm.count("state")) {
+        state_filename = vm["state"].as<std::string>();
+    }
+
+    if (vm.count("output-state")) {
+        output_state_filename = vm["output-state"].as<std::string>();
+    }
+
+    if (vm.count("missing-nodes")) {
+        missing_nodes_filename = vm["missing-nodes"].as<std::string>();
+    }
+
+    if (vm.count("expression") && vm.count("expression-file")) {
+        std::cerr << "Do not use --expression/-e and --expression-file/-E together\n";
+        return 2;
+    }
+
+    if (vm.count("expression")) {
+        filter_expression = vm["expression"].as<std::string>();
+    }
+
+    if (vm.count("expression-file")) {
+        std::ifstream t{vm["expression-file"].as<std::string>()};
+        filter_expression.append(std::istreambuf_iterator<char>{t},
+                                 std::istreambuf_iterator<char>{});
+    }
+
+    if (input_filenames.size() < 2 || state_filename.empty()) {
+        std::cerr << "Need old extract, at least one change file, and --state/-s\n";
+        return 2;
+    }
+
+    if (output_filename.empty() && change_filename.empty()) {
+        std::cerr << "Need --output/-o or --output-changes/-c\n";
+        return 2;
+    }
+
+    try {
+        OSMObjectFilter filter{filter_expression};
+        if (filter.has_location_predicates()) {
+            throw std::runtime_error{"Location checks can not be used with apply-changes"};
+        }
+        filter.prepare();
+
+        osmium::nwr_array<match_state::id_set_type> matched;
+        const bool complete_ways = match_state::read(state_filename, matched);
+
+        const std::string& old_extract = input_filenames.front();
+        const ChangeSet changes{std::vector<std::string>(input_filenames.cbegin() + 1, input_filenames.cend())};
+        if (verbose) {
+            std::cerr << "Read " << changes.size() << " changed objects\n";
+        }
+
+        for (const auto* object : changes) {
+            auto& ids = matched(object->type());
+            if (object->visible() && filter.match(*object)) {
+                ids.set(object->positive_id());
+            } else {
+                ids.unset(object->positive_id());
+            }
+        }
+
+        // Nodes needed by matching ways: From changed ways and from
+        // unchanged ways in the old extract.
+        match_state::id_set_type needed_nodes;
+        if (complete_ways) {
+            for (const auto* object : changes) {
+                if (object->type() == osmium::item_type::way && matched(osmium::item_type::way).get(object->positive_id())) {
+                    add_node_refs(static_cast<const osmium::Way&>(*object), needed_nodes);
+                }
+            }
+
+            osmium::io::Reader reader{old_extract, osmium::osm_entity_bits::way};
+            while (osmium::memory::Buffer buffer = reader.read()) {
+                for (const auto& way : buffer.select<osmium::Way>()) {
+                    if (matched(osmium::item_type::way).get(way.positive_id()) && !changes.contains(way)) {
+                        add_node_refs(way, needed_nodes);
+                    }
+                }
+            }
+            reader.close();
+        }
+
+        ExtractUpdater updater{matched, needed_nodes, complete_ways, output_filename, output_format, change_filename};
+        updater.run(old_extract, changes);
+
+        if (verbose) {
+            std::cerr << "New extract has " << updater.count() << " objects ("
+                      << updater.added() << " added, " << updater.removed() << " removed)\n";
+        }
+
+        const auto missing = updater.missing_nodes();
+        if (!missing.empty()) {
+            std::cerr << "Warning: " << missing.size() << " nodes referenced by matching ways are neither in the old extract nor in the changes\n";
+        }
+        if (!missing_nodes_filename.empty()) {
+            std::ofstream out{missing_nodes_filename};
+            for (const auto id : missing) {
+                out << 'n' << id << '\n';
+            }
+            if (!out) {
+                throw std::runtime_error{"Error writing file '" + missing_nodes_filename + "'"};
+            }
+        }
+
+        if (!output_state_filename.empty()) {
+            match_state::write(output_state_filename, matched, complete_ways);
+        }
+    } catch (const expression_parser_error& e) {
+        std::cerr << "Error parsing filter expression:\n";
+        std::cerr << e.input() << "\n";
+        if (e.pos() >= 0) {
+            for (auto i = e.pos(); i > 0; --i) {
+                std::cerr << ' ';
+            }
+        }
+        std::cerr << "^\n";
+        if (!e.message().empty()) {
+            std::cerr << e.message() << "\n";
+        }
+        return 1;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
+
@@ -2,24 +2,35 @@
 #include <boost/program_options.hpp>
 
 #include <algorithm>
+#include <cerrno>
 #include <cstdlib>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <memory>
 #include <streambuf>
 #include <string>
+#include <system_error>
+#include <thread>
 #include <vector>
 
+#include <fcntl.h>
+
 #include <osmium/index/id_set.hpp>
 #include <osmium/index/nwr_array.hpp>
-#include <osmium/io/any_output.hpp>
-#include <osmium/io/file.hpp>
-#include <osmium/io/writer_options.hpp>
 #include <osmium/memory/buffer.hpp>
 #include <osmium/osm/object.hpp>
 #include <osmium/util/file.hpp>
 #include <osmium/util/memory_mapping.hpp>
 
+#include "direct_reader.hpp"
+#include "dump_chunks.hpp"
+#include "dump_io.hpp"
+#include "match_limit.hpp"
 #include "object_filter.hpp"
+#include "output_writer.hpp"
+#include "tag_stats.hpp"
 
 namespace po = boost::program_options;
 
@@ -38,7 +49,18 @@ int main(int argc, char* argv[]) {
         ("expression,e", po::value<std::string>(), "Filter expression")
         ("expression-file,E", po::value<std::string>(), "Filter expression file")
         ("dry-run,n", "Only parse expression, do not run it")
+        ("stats", po::value<std::string>(), "Optimize expression using statistics file from 'osmium-filter stats'")
         ("complete-ways,w", "Add nodes referenced in ways")
+        ("limit", po::value<std::size_t>(), "Stop after writing this many matching objects")
+        ("limit-per-type", po::value<std::size_t>(), "Stop after writing this many matching objects of each type")
+        ("threads,t", po::value<unsigned>(), "Number of threads (default: number of CPUs)")
+        ("index,i", po::value<std::string>(), "Read chunk index from file (created if it doesn't exist or is out of date)")
+        ("readahead", po::value<std::size_t>(), "Read ahead this many MBytes (default: 64)")
+        ("drop-behind", "Drop input data from page cache after use")
+        ("io-stats", "Print I/O statistics at the end")
+        ("io-backend", po::value<std::string>(), "I/O backend: mmap (default), direct (O_DIRECT with pread), uring (O_DIRECT with io_uring)")
+        ("block-size", po::value<std::size_t>(), "Block size for direct I/O in MBytes (default: 32)")
+        ("buffers", po::value<unsigned>(), "Number of buffers for direct I/O (default: 8)")
     ;
 
     po::options_description hidden;
@@ -60,9 +82,20 @@ int main(int argc, char* argv[]) {
     std::string output_format;
     std::string output_filename{"-"};
     std::string filter_expression;
+    std::string index_filename;
+    std::string stats_filename;
     bool verbose = false;
     bool run = true;
     bool complete_ways = false;
+    bool drop_behind = false;
+    bool show_io_stats = false;
+    std::size_t readahead = 64 * 1024 * 1024;
+    std::string io_backend{"mmap"};
+    std::size_t block_size = 32 * 1024 * 1024;
+    unsigned num_buffers = 8;
+    unsigned num_threads = std::thread::hardware_concurrency();
+    std::size_t limit_total = 0;
+    std::size_t limit_per_type = 0;
 
     if (vm.count("help")) {
         print_help(desc);
@@ -81,6 +114,61 @@ int main(int argc, char* argv[]) {
         complete_ways = true;
     }
 
+    if (vm.count("limit")) {
+        limit_total = vm["limit"].as<std::size_t>();
+    }
+
+    if (vm.count("limit-per-type")) {
+        limit_per_type = vm["limit-per-type"].as<std::size_t>();
+    }
+
+    if (complete_ways && (limit_total > 0 || limit_per_type > 0)) {
+        std::cerr << "Do not use --complete-ways/-w together with --limit/--limit-per-type\n";
+        std::exit(2);
+    }
+
+    if (vm.count("threads")) {
+        num_threads = vm["threads"].as<unsigned>();
+    }
+
+    if (num_threads == 0) {
+        num_threads = 1;
+    }
+
+    if (vm.count("readahead")) {
+        readahead = vm["readahead"].as<std::size_t>() * 1024 * 1024;
+    }
+
+    if (vm.count("io-backend")) {
+        io_backend = vm["io-backend"].as<std::string>();
+    }
+
+    if (vm.count("block-size")) {
+        // Reads are submitted with 32 bit lengths.
+        const auto mbytes = vm["block-size"].as<std::size_t>();
+        if (mbytes == 0 || mbytes >= 4096) {
+            std::cerr << "--block-size must be between 1 and 4095 MBytes\n";
+            std::exit(2);
+        }
+        block_size = mbytes * 1024 * 1024;
+    }
+
+    if (vm.count("buffers")) {
+        num_buffers = vm["buffers"].as<unsigned>();
+    }
+
+    if (vm.count("drop-behind")) {
+        drop_behind = true;
+    }
+
+    if (vm.count("io-stats")) {
+        show_io_stats = true;
+    }
+
+    if (vm.count("index")) {
+        index_filename = vm["index"].as<std::string>();
+    }
+
     if (vm.count("input-filename")) {
         input_filename = vm["input-filename"].as<std::string>();
     }
@@ -93,6 +181,10 @@ int main(int argc, char* argv[]) {
         output_filename = vm["output"].as<std::string>();
     }
 
+    if (vm.count("stats")) {
+        stats_filename = vm["stats"].as<std::string>();
+    }
+
     if (vm.count("expression") && vm.count("expression-file")) {
         std::cerr << "Do not use --expression/-e and --expression-file/-E together\n";
         std::exit(2);
@@ -115,6 +207,15 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    if (!stats_filename.empty()) {
+        try {
+            filter.optimize(TagStats::read(stats_filename));
+        } catch (const std::runtime_error& e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+    }
+
     if (verbose) {
         filter.print_tree(std::cerr);
 
@@ -139,48 +240,248 @@ int main(int argc, char* argv[]) {
 
     filter.prepare();
 
-    const int fd = ::open(input_filename.c_str(), O_RDONLY);
-    const auto size = osmium::util::file_size(fd);
-    const osmium::util::MemoryMapping mapping{size, osmium::util::MemoryMapping::mapping_mode::readonly, fd};
-    const osmium::memory::Buffer buffer{mapping.get_addr<unsigned char>(), mapping.size()};
+    MatchLimit limit{limit_total, limit_per_type, filter.entities()};
+
+    IOStats io_stats;
+
+    // A pass over the input calls process() for parts of the input on the
+    // worker threads. It fills in the objects to be written out, which
+    // are then handed to output() in input order in this thread. Objects
+    // are only valid until output() returns (except with the mmap backend,
+    // where they stay valid). If output() returns false, the pass stops.
+    using matches_type = std::vector<const osmium::OSMObject*>;
+    using process_func = std::function<void(unsigned, const osmium::memory::Buffer&, matches_type&)>;
+    using output_func = std::function<bool(const matches_type&)>;
+
+    // The first parameter tells whether all of the input is needed or only
+    // the parts that can contain objects matching the filter.
+    std::function<void(bool, const process_func&, const output_func&)> run_pass;
+
+    std::unique_ptr<osmium::util::MemoryMapping> mapping;
+    std::unique_ptr<DirectDumpReader> direct_reader;
+    std::unique_ptr<ChunkWorkerPool> worker_pool;
+    std::vector<dump_chunk> chunks;
+    std::vector<dump_chunk> matching_chunks;
+
+    if (io_backend == "mmap") {
+        const int fd = ::open(input_filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::system_error{errno, std::system_category(), "Can not open dump"};
+        }
+        const auto size = osmium::util::file_size(fd);
+        mapping.reset(new osmium::util::MemoryMapping{size, osmium::util::MemoryMapping::mapping_mode::readonly, fd});
+        unsigned char* data = mapping->get_addr<unsigned char>();
+        std::size_t data_size = mapping->size();
+        off_t data_offset = 0;
+
+        auto layout = load_dump_chunks(fd, data, data_size, index_filename);
+        chunks = std::move(layout.chunks);
+        data += layout.data_offset;
+        data_size = layout.data_size;
+        data_offset = static_cast<off_t>(layout.data_offset);
+
+        // Only chunks that contain objects of the right types, IDs, and
+        // timestamps can match.
+        const auto id_range = filter.id_range();
+        const auto timestamp_range = filter.timestamp_range();
+        std::copy_if(chunks.cbegin(), chunks.cend(), std::back_inserter(matching_chunks), [&](const dump_chunk& chunk) {
+            return (chunk.entities() & filter.entities()) &&
+                   chunk.contains_ids(id_range.first, id_range.second) &&
+                   chunk.contains_timestamps(timestamp_range.first, timestamp_range.second);
+        });
+
+        // With a limit, chunks more likely to contain matches are read
+        // first: those with only objects of the right types and with all
+        // IDs and timestamps in the ranges the filter can match.
+        if (limit.enabled()) {
+            const auto score = [&](const dump_chunk& chunk) {
+                return ((chunk.entities() & ~filter.entities()) == 0 ? 1 : 0) +
+                       (chunk.min_id >= id_range.first && chunk.max_id <= id_range.second ? 1 : 0) +
+                       (std::int64_t(chunk.min_timestamp) >= timestamp_range.first && std::int64_t(chunk.max_timestamp) <= timestamp_range.second ? 1 : 0);
+            };
+            std::stable_sort(matching_chunks.begin(), matching_chunks.end(), [&](const dump_chunk& a, const dump_chunk& b) {
+                return score(a) > score(b);
+            });
+        }
+
+        if (verbose) {
+            std::cerr << "Processing " << matching_chunks.size() << " of " << chunks.size() << " chunks with " << num_threads << " threads\n";
+        }
+
+        std::shared_ptr<const MappingAdvisor> advisor{new MappingAdvisor{data, data_size, fd, data_offset, drop_behind}};
+        if (!advisor->advise_sequential() && verbose) {
+            std::cerr << "Transparent huge pages not available for input\n";
+        }
+
+        // The kernel is told to read ahead the chunks that will be needed
+        // next and, after output(), that a chunk isn't needed any more.
+        run_pass = [&, data, advisor](bool all, const process_func& process, const output_func& output) {
+            const auto& list = all ? chunks : matching_chunks;
+            const std::size_t ahead = std::max<std::size_t>(1, readahead / default_chunk_size);
+            for (std::size_t n = 0; n < ahead && n < list.size(); ++n) {
+                advisor->will_need(list[n].offset, list[n].size);
+            }
+
+            std::vector<matches_type> matches(list.size());
+            process_chunks_ordered(list.size(), num_threads, [&](unsigned thread_num, std::size_t n) {
+                if (n + ahead < list.size()) {
+                    advisor->will_need(list[n + ahead].offset, list[n + ahead].size);
+                }
+                const osmium::memory::Buffer buffer{data + list[n].offset, list[n].size};
+                process(thread_num, buffer, matches[n]);
+            }, [&](std::size_t n) {
+                const bool more = output(matches[n]);
+                matches[n] = matches_type{};
+                advisor->done_with(list[n].offset, list[n].size);
+                io_stats.add_bytes(list[n].size);
+                return more;
+            });
+        };
+    } else if (io_backend == "direct" || io_backend == "uring") {
+        if (io_backend == "uring" && !DirectDumpReader::has_uring()) {
+            std::cerr << "Compiled without io_uring support, using pread\n";
+        }
+
+        direct_reader.reset(new DirectDumpReader{input_filename, block_size, num_buffers, io_backend == "uring"});
+
+        if (verbose) {
+            std::cerr << "Processing " << direct_reader->file_size() << " bytes in blocks of " << block_size << " bytes with " << num_threads << " threads\n";
+        }
+
+        // Each segment of complete items delivered by the reader is split
+        // up again, so all threads can work on it. The same worker threads
+        // are used for all segments.
+        worker_pool.reset(new ChunkWorkerPool{num_threads});
+        run_pass = [&](bool /*all*/, const process_func& process, const output_func& output) {
+            direct_reader->read([&](unsigned char* data, std::size_t size) {
+                const auto parts = split_into_chunks(data, size, size / num_threads + 1);
+                std::vector<matches_type> matches(parts.size());
+                bool more = true;
+                worker_pool->run(parts.size(), [&](unsigned thread_num, std::size_t n) {
+                    const osmium::memory::Buffer buffer{data + parts[n].offset, parts[n].size};
+                    process(thread_num, buffer, matches[n]);
+                }, [&](std::size_t n) {
+                    more = output(matches[n]);
+                    matches[n] = matches_type{};
+                    return more;
+                });
+                io_stats.add_bytes(size);
+                return more;
+            });
+        };
+    } else {
+        std::cerr << "Unknown I/O backend '" << io_backend << "'\n";
+        return 2;
+    }
+
+    // Location predicates need to know which nodes and ways are in their
+    // areas before ways and relations can be matched. This is collected in
+    // an extra pass in input order in this thread.
+    if (filter.has_location_predicates()) {
+        run_pass(true, [](unsigned /*thread_num*/, const osmium::memory::Buffer& buffer, matches_type& matches) {
+            for (const auto& object : buffer.select<osmium::OSMObject>()) {
+                if (object.type() == osmium::item_type::node || object.type() == osmium::item_type::way) {
+                    matches.push_back(&object);
+                }
+            }
+        }, [&](const matches_type& matches) {
+            for (const auto* object : matches) {
+                filter.collect(*object);
+            }
+            return true;
+        });
+    }
 
     if (complete_ways) {
-        osmium::nwr_array<osmium::index::IdSetDense<osmium::unsigned_object_id_type>> ids;
-
-        for (const auto& object : buffer.select<osmium::OSMObject>()) {
-            if (filter.match(object)) {
-                ids(object.type()).set(object.positive_id());
-                if (object.type() == osmium::item_type::way) {
-                    for (const auto& nr : static_cast<const osmium::Way&>(object).nodes()) {
-                        ids(osmium::item_type::node).set(nr.positive_ref());
+        using id_set_type = osmium::nwr_array<osmium::index::IdSetDense<osmium::unsigned_object_id_type>>;
+
+        // Every thread collects IDs into its own sets, they are merged
+        // into the first one afterwards.
+        std::vector<id_set_type> thread_ids(num_threads);
+
+        run_pass(false, [&](unsigned thread_num, const osmium::memory::Buffer& buffer, matches_type& /*matches*/) {
+            auto& ids = thread_ids[thread_num];
+            for (const auto& object : buffer.select<osmium::OSMObject>()) {
+                if (filter.match(object)) {
+                    ids(object.type()).set(object.positive_id());
+                    if (object.type() == osmium::item_type::way) {
+                        for (const auto& nr : static_cast<const osmium::Way&>(object).nodes()) {
+                            ids(osmium::item_type::node).set(nr.positive_ref());
+                        }
                     }
                 }
             }
+        }, [](const matches_type& /*matches*/) {
+            return true;
+        });
+
+        auto& ids = thread_ids.front();
+        for (auto it = std::next(thread_ids.begin()); it != thread_ids.end(); ++it) {
+            for (const auto type : {osmium::item_type::node, osmium::item_type::way, osmium::item_type::relation}) {
+                for (const auto id : (*it)(type)) {
+                    ids(type).set(id);
+                }
+                (*it)(type).clear();
+            }
         }
 
-        osmium::io::File output_file{output_filename, output_format};
-        osmium::io::Writer writer{output_file, osmium::io::overwrite::allow};
+        OutputWriter writer{output_filename, output_format};
 
-        for (const auto& object : buffer.select<osmium::OSMObject>()) {
-            if (ids(object.type()).get(object.positive_id())) {
-                writer(object);
+        run_pass(true, [&](unsigned /*thread_num*/, const osmium::memory::Buffer& buffer, matches_type& matches) {
+            for (const auto& object : buffer.select<osmium::OSMObject>()) {
+                if (ids(object.type()).get(object.positive_id())) {
+                    matches.push_back(&object);
+                }
             }
-        }
+        }, [&](const matches_type& matches) {
+            for (const auto* object : matches) {
+                writer(*object);
+            }
+            return true;
+        });
 
         writer.close();
     } else {
-        osmium::io::File output_file{output_filename, output_format};
-        osmium::io::Writer writer{output_file, osmium::io::overwrite::allow};
+        OutputWriter writer{output_filename, output_format};
 
-        for (const auto& object : buffer.select<osmium::OSMObject>()) {
-            if (filter.match(object)) {
-                writer(object);
+        // With the mmap backend the objects stay valid, so they can be
+        // collected and written in order at the end.
+        matches_type limited;
+
+        run_pass(false, [&](unsigned /*thread_num*/, const osmium::memory::Buffer& buffer, matches_type& matches) {
+            for (const auto& object : buffer.select<osmium::OSMObject>()) {
+                if (filter.match(object)) {
+                    matches.push_back(&object);
+                }
+            }
+        }, [&](const matches_type& matches) {
+            for (const auto* object : matches) {
+                if (!limit.add(object->type())) {
+                    continue;
+                }
+                if (mapping && limit.enabled()) {
+                    limited.push_back(object);
+                } else {
+                    writer(*object);
+                }
             }
+            return !limit.reached();
+        });
+
+        // The chunks were not read in order, so sort the objects found.
+        std::sort(limited.begin(), limited.end(), [](const osmium::OSMObject* a, const osmium::OSMObject* b) {
+            return *a < *b;
+        });
+        for (const auto* object : limited) {
+            writer(*object);
         }
 
         writer.close();
     }
 
+    if (show_io_stats) {
+        io_stats.print(std::cerr);
+    }
+
     return 0;
 }
-
@@ -5,30 +5,100 @@
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <random>
 #include <streambuf>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <osmium/index/id_set.hpp>
 #include <osmium/index/nwr_array.hpp>
 #include <osmium/io/any_input.hpp>
-#include <osmium/io/any_output.hpp>
-#include <osmium/io/file.hpp>
-#include <osmium/io/writer_options.hpp>
 #include <osmium/memory/buffer.hpp>
 #include <osmium/osm/object.hpp>
 #include <osmium/util/progress_bar.hpp>
 
+#include "apply_changes.hpp"
+#include "match_counts.hpp"
+#include "match_limit.hpp"
+#include "match_state.hpp"
 #include "object_filter.hpp"
+#include "object_projection.hpp"
+#include "output_writer.hpp"
+#include "parallel_pbf_reader.hpp"
+#include "pbf_output.hpp"
+#include "pbf_sampler.hpp"
+#include "serve.hpp"
+#include "stats.hpp"
+#include "spilled_id_set.hpp"
+#include "tag_stats.hpp"
 
 namespace po = boost::program_options;
 
 void print_help(const po::options_description& desc) {
-    std::cout << "osmium-filter [OPTIONS] INPUT-FILE\n\n"
+    std::cout << "osmium-filter [OPTIONS] INPUT-FILE\n"
+              << "osmium-filter apply-changes [OPTIONS] OLD-EXTRACT CHANGE-FILE...\n"
+              << "osmium-filter serve [OPTIONS] DUMP-FILE\n"
+              << "osmium-filter stats [OPTIONS] INPUT-FILE\n\n"
               << desc << "\n";
 }
 
+std::vector<std::string> split_list(const std::string& list) {
+    std::vector<std::string> items;
+    std::string::size_type start = 0;
+    while (start <= list.size()) {
+        auto end = list.find(',', start);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        if (end > start) {
+            items.emplace_back(list, start, end - start);
+        }
+        start = end + 1;
+    }
+    return items;
+}
+
+/**
+ * Write the encoded PBF blocks from the reader to the output file. If
+ * matched is not nullptr, the IDs of all objects written are added.
+ */
+void write_pass_through(ParallelPBFReader& reader, const std::string& output_filename, osmium::nwr_array<match_state::id_set_type>* matched) {
+    PBFFileWriter writer{output_filename};
+
+    osmium::ProgressBar progress_bar{reader.file_size(), true};
+    osmium::memory::Buffer buffer;
+    std::string encoded;
+    while (reader.read_encoded(buffer, encoded)) {
+        progress_bar.update(reader.offset());
+        if (matched && buffer) {
+            for (const auto& object : buffer.select<osmium::OSMObject>()) {
+                (*matched)(object.type()).set(object.positive_id());
+            }
+        }
+        writer.write(encoded);
+    }
+    progress_bar.done();
+
+    reader.close();
+    writer.close();
+}
+
 int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string{argv[1]} == "serve") {
+        return serve(argc - 1, argv + 1);
+    }
+
+    if (argc > 1 && std::string{argv[1]} == "apply-changes") {
+        return apply_changes(argc - 1, argv + 1);
+    }
+
+    if (argc > 1 && std::string{argv[1]} == "stats") {
+        return stats(argc - 1, argv + 1);
+    }
+
     po::options_description desc{"OPTIONS"};
     desc.add_options()
         ("help,h", "Print usage information")
@@ -38,7 +108,21 @@ int main(int argc, char* argv[]) {
         ("expression,e", po::value<std::string>(), "Filter expression")
         ("expression-file,E", po::value<std::string>(), "Filter expression file")
         ("dry-run,n", "Only parse expression, do not run it")
+        ("stats", po::value<std::string>(), "Optimize expression using statistics file from 'osmium-filter stats'")
         ("complete-ways,w", "Add nodes referenced in ways")
+        ("max-memory", po::value<std::size_t>(), "Memory for IDs with --complete-ways in MB, the rest is kept in temporary files (needs sorted input)")
+        ("state", po::value<std::string>(), "Write IDs of matching objects to file (for apply-changes)")
+        ("threads,t", po::value<unsigned>(), "Threads for reading PBF input (default: number of CPUs, 0: use standard reader)")
+        ("pass-through", "Copy PBF blocks where all objects match unchanged to the output (PBF input and output only)")
+        ("keep-tags", po::value<std::string>(), "Only write tags with these keys (comma separated)")
+        ("keep-tags-from-expression", "Only write tags with keys used in the expression")
+        ("strip-metadata", "Do not write version, changeset, timestamp, uid, and user")
+        ("count", "Only count matching objects, do not write them")
+        ("count-by", po::value<std::string>(), "Count matching objects by value of the tag with this key (implies --count)")
+        ("limit", po::value<std::size_t>(), "Stop after writing this many matching objects")
+        ("limit-per-type", po::value<std::size_t>(), "Stop after writing this many matching objects of each type")
+        ("sample", po::value<double>(), "Estimate number of matching objects from this fraction of the PBF blocks (0 < FRACTION <= 1)")
+        ("seed", po::value<std::size_t>(), "Seed for the random sample (default: random)")
     ;
 
     po::options_description hidden;
@@ -60,9 +144,22 @@ int main(int argc, char* argv[]) {
     std::string output_format;
     std::string output_filename{"-"};
     std::string filter_expression;
+    std::string state_filename;
+    std::string stats_filename;
     bool verbose = false;
     bool run = true;
     bool complete_ways = false;
+    bool pass_through = false;
+    bool keep_tags_from_expression = false;
+    bool count = false;
+    std::string count_key;
+    ObjectProjection projection;
+    unsigned num_threads = std::thread::hardware_concurrency();
+    std::size_t max_memory = 0;
+    std::size_t limit_total = 0;
+    std::size_t limit_per_type = 0;
+    double sample_fraction = 0.0;
+    std::size_t seed = std::random_device{}();
 
     if (vm.count("help")) {
         print_help(desc);
@@ -81,6 +178,63 @@ int main(int argc, char* argv[]) {
         complete_ways = true;
     }
 
+    if (vm.count("pass-through")) {
+        pass_through = true;
+    }
+
+    if (vm.count("keep-tags")) {
+        projection.keep_tags(split_list(vm["keep-tags"].as<std::string>()));
+    }
+
+    if (vm.count("keep-tags-from-expression")) {
+        keep_tags_from_expression = true;
+    }
+
+    if (vm.count("strip-metadata")) {
+        projection.strip_metadata();
+    }
+
+    if (vm.count("count")) {
+        count = true;
+    }
+
+    if (vm.count("count-by")) {
+        count = true;
+        count_key = vm["count-by"].as<std::string>();
+    }
+
+    if (vm.count("limit")) {
+        limit_total = vm["limit"].as<std::size_t>();
+    }
+
+    if (vm.count("limit-per-type")) {
+        limit_per_type = vm["limit-per-type"].as<std::size_t>();
+    }
+
+    if (vm.count("sample")) {
+        sample_fraction = vm["sample"].as<double>();
+        if (!(sample_fraction > 0.0 && sample_fraction <= 1.0)) {
+            std::cerr << "--sample must be larger than 0 and at most 1\n";
+            std::exit(2);
+        }
+    }
+
+    if (vm.count("seed")) {
+        seed = vm["seed"].as<std::size_t>();
+    }
+
+    if (vm.count("max-memory")) {
+        max_memory = vm["max-memory"].as<std::size_t>();
+        if (max_memory == 0) {
+            std::cerr << "--max-memory must be at least 1 (MB)\n";
+            std::exit(2);
+        }
+    }
+
+    if (vm.count("threads")) {
+        num_threads = vm["threads"].as<unsigned>();
+    }
+
     if (vm.count("input-filename")) {
         input_filename = vm["input-filename"].as<std::string>();
     }
@@ -93,6 +247,18 @@ int main(int argc, char* argv[]) {
         output_filename = vm["output"].as<std::string>();
     }
 
+    if (vm.count("state")) {
+        state_filename = vm["state"].as<std::string>();
+        if (limit_total > 0 || limit_per_type > 0) {
+            std::cerr << "Do not use --state together with --limit/--limit-per-type\n";
+            std::exit(2);
+        }
+    }
+
+    if (vm.count("stats")) {
+        stats_filename = vm["stats"].as<std::string>();
+    }
+
     if (vm.count("expression") && vm.count("expression-file")) {
         std::cerr << "Do not use --expression/-e and --expression-file/-E together\n";
         std::exit(2);
@@ -116,6 +282,16 @@ int main(int argc, char* argv[]) {
             return 1;
         }
 
+        if (!stats_filename.empty()) {
+            filter.optimize(TagStats::read(stats_filename));
+        }
+
+        if (keep_tags_from_expression) {
+            auto keys = filter.tag_keys();
+            keys.insert(keys.end(), projection.keys().cbegin(), projection.keys().cend());
+            projection.keep_tags(std::move(keys));
+        }
+
         if (verbose) {
             filter.print_tree(std::cerr);
 
@@ -131,6 +307,38 @@ int main(int argc, char* argv[]) {
                 std::cerr << " relation";
             }
             std::cerr << "\n";
+
+            const auto p = filter.used_parts();
+            std::cerr << "parts:";
+            if (p & object_parts::metadata) {
+                std::cerr << " metadata";
+            }
+            if (p & object_parts::tags) {
+                std::cerr << " tags";
+            }
+            if (p & object_parts::node_refs) {
+                std::cerr << " node_refs";
+            }
+            if (p & object_parts::members) {
+                std::cerr << " members";
+            }
+            std::cerr << "\n";
+
+            if (!projection.keeps_everything()) {
+                std::cerr << "output:";
+                if (projection.strips_metadata()) {
+                    std::cerr << " no metadata,";
+                }
+                if (!projection.filters_tags()) {
+                    std::cerr << " all tags\n";
+                } else {
+                    std::cerr << " tags";
+                    for (const auto& key : projection.keys()) {
+                        std::cerr << " '" << key << "'";
+                    }
+                    std::cerr << "\n";
+                }
+            }
         }
 
         // With --dry-run or -n we are done.
@@ -140,64 +348,317 @@ int main(int argc, char* argv[]) {
 
         filter.prepare();
 
+        osmium::nwr_array<match_state::id_set_type> matched;
+
+        // Location checks need all objects in order, they can not be
+        // evaluated in the worker threads of the ParallelPBFReader.
+        const bool parallel = num_threads > 0 && is_parallel_pbf_input(input_filename);
+        const bool parallel_match = parallel && !filter.has_location_predicates();
+
+        if (max_memory > 0 && !complete_ways) {
+            std::cerr << "Warning: --max-memory only has an effect with --complete-ways/-w, ignored.\n";
+        }
+
+        if (pass_through && !(parallel && is_plain_pbf_output(output_filename, output_format))) {
+            std::cerr << "Warning: --pass-through needs uncompressed PBF input and output without format options and -t > 0, ignored.\n";
+            pass_through = false;
+        }
+
+        if (pass_through && !projection.keeps_everything()) {
+            std::cerr << "Warning: --pass-through can not be used with --keep-tags/--strip-metadata, ignored.\n";
+            pass_through = false;
+        }
+
+        // Reading the input stops as soon as the limits are reached. With
+        // --complete-ways this limits the matching objects, the nodes
+        // they need are added.
+        MatchLimit limit{limit_total, limit_per_type, filter.entities()};
+
+        if (pass_through && limit.enabled()) {
+            std::cerr << "Warning: --pass-through can not be used with --limit/--limit-per-type, ignored.\n";
+            pass_through = false;
+        }
+
+        // The filter is evaluated on the decoded PBF data, only matching
+        // objects are built with the parts the projection keeps.
+        pbf_decode_options match_options;
+        match_options.select = [&filter](const raw_object& object) {
+            return filter.match(object);
+        };
+        match_options.string_slots = filter.arena().string_slots();
+        match_options.parts = filter.used_parts() | projection.needed_parts();
+        match_options.projection = &projection;
+
+        if (sample_fraction > 0.0) {
+            if (!is_parallel_pbf_input(input_filename) || filter.has_location_predicates()) {
+                std::cerr << "--sample needs an uncompressed PBF input file and can not be used with location checks\n";
+                return 2;
+            }
+
+            pbf_decode_options options = match_options;
+            options.parts = filter.used_parts();
+            const PBFSampler sampler{input_filename};
+            sampler.run(sample_fraction, seed, num_threads, filter.entities(), options).print(std::cout, num_threads);
+            return 0;
+        }
+
+        if (count) {
+            if (complete_ways || !state_filename.empty() || vm.count("output") || limit.enabled()) {
+                std::cerr << "Warning: --complete-ways/-w, --state, --output/-o, and --limit are ignored with --count.\n";
+            }
+
+            // Nothing is written, so only the parts of the objects the
+            // filter looks at (and the tags for --count-by) are read.
+            const char* key = count_key.empty() ? nullptr : count_key.c_str();
+            const auto parts = filter.used_parts() | (key ? object_parts::tags : object_parts::nothing);
+            match_counts counts;
+
+            if (parallel_match) {
+                pbf_decode_options options = match_options;
+                options.parts = parts;
+                options.projection = nullptr;
+                options.count_only = true;
+                options.count_key = count_key;
+                ParallelPBFReader reader{input_filename, filter.input_entities(), num_threads, nullptr, false, options};
+                while (reader.read()) {
+                }
+                reader.close();
+                counts = reader.counts();
+                if (verbose) {
+                    print_worker_stats(std::cerr, reader.stats());
+                }
+            } else {
+                const auto read_meta = (parts & object_parts::metadata) ? osmium::io::read_meta::yes : osmium::io::read_meta::no;
+                osmium::io::Reader reader{input_filename, filter.input_entities(), read_meta};
+                while (osmium::memory::Buffer buffer = reader.read()) {
+                    for (const auto& object : buffer.select<osmium::OSMObject>()) {
+                        filter.collect(object);
+                        if (filter.match(object)) {
+                            counts.add(object, key);
+                        }
+                    }
+                }
+                reader.close();
+            }
+
+            counts.print(std::cout, key);
+            return 0;
+        }
+
         if (complete_ways) {
             osmium::nwr_array<osmium::index::IdSetDense<osmium::unsigned_object_id_type>> ids;
 
-            {
-                osmium::io::Reader reader{input_filename, filter.entities()};
+            // With --max-memory the IDs are kept in sorted runs on disk
+            // and merged while reading the (sorted) input again.
+            std::unique_ptr<SpilledIdSet> spilled;
+            if (max_memory > 0) {
+                const char* tmpdir = std::getenv("TMPDIR");
+                spilled.reset(new SpilledIdSet{max_memory * 1024 * 1024, tmpdir ? tmpdir : "/tmp"});
+            }
+
+            const auto add_ids = [&](const osmium::OSMObject& object) {
+                if (spilled) {
+                    spilled->set(object.type(), object.positive_id());
+                } else {
+                    ids(object.type()).set(object.positive_id());
+                }
+                if (!state_filename.empty()) {
+                    matched(object.type()).set(object.positive_id());
+                }
+                if (object.type() == osmium::item_type::way) {
+                    for (const auto& nr : static_cast<const osmium::Way&>(object).nodes()) {
+                        if (spilled) {
+                            spilled->set(osmium::item_type::node, nr.positive_ref());
+                        } else {
+                            ids(osmium::item_type::node).set(nr.positive_ref());
+                        }
+                    }
+                }
+            };
+
+            // Nothing is written in the first pass, so only the parts the
+            // filter looks at and the node refs of ways are decoded.
+            const auto parts = filter.used_parts() | object_parts::node_refs;
+
+            if (parallel_match) {
+                pbf_decode_options options = match_options;
+                options.parts = parts;
+                options.projection = nullptr;
+                ParallelPBFReader reader{input_filename, filter.input_entities(), num_threads, nullptr, false, options};
                 while (osmium::memory::Buffer buffer = reader.read()) {
                     for (const auto& object : buffer.select<osmium::OSMObject>()) {
-                        if (filter.match(object)) {
-                            ids(object.type()).set(object.positive_id());
-                            if (object.type() == osmium::item_type::way) {
-                                for (const auto& nr : static_cast<const osmium::Way&>(object).nodes()) {
-                                    ids(osmium::item_type::node).set(nr.positive_ref());
-                                }
-                            }
+                        if (limit.add(object.type())) {
+                            add_ids(object);
+                        }
+                    }
+                    if (limit.reached()) {
+                        break;
+                    }
+                }
+                reader.close();
+                if (verbose) {
+                    print_worker_stats(std::cerr, reader.stats());
+                }
+            } else {
+                const auto read_meta = (parts & object_parts::metadata) ? osmium::io::read_meta::yes : osmium::io::read_meta::no;
+                osmium::io::Reader reader{input_filename, filter.input_entities(), read_meta};
+                while (osmium::memory::Buffer buffer = reader.read()) {
+                    for (const auto& object : buffer.select<osmium::OSMObject>()) {
+                        filter.collect(object);
+                        if (filter.match(object) && limit.add(object.type())) {
+                            add_ids(object);
                         }
                     }
+                    if (limit.reached()) {
+                        break;
+                    }
                 }
                 reader.close();
             }
 
-            osmium::io::Reader reader{input_filename};
+            if (spilled) {
+                spilled->finish();
+                if (verbose) {
+                    std::cerr << "IDs spilled to disk in " << spilled->spilled_runs() << " runs\n";
+                }
+
+                // Lookups must be done in file order, so this can not
+                // be done in worker threads.
+                osmium::io::Reader reader{input_filename};
+
+                OutputWriter writer{output_filename, output_format, &projection};
+
+                osmium::ProgressBar progress_bar{reader.file_size(), true};
+                while (osmium::memory::Buffer buffer = reader.read()) {
+                    progress_bar.update(reader.offset());
+                    for (const auto& object : buffer.select<osmium::OSMObject>()) {
+                        if (spilled->get(object.type(), object.positive_id())) {
+                            writer(object);
+                        }
+                    }
+                }
+                progress_bar.done();
+
+                reader.close();
+                writer.close();
+            } else if (parallel) {
+                // The ID sets are only read from here on.
+                const auto copy_selected = [&ids, &projection](const osmium::memory::Buffer& input, osmium::memory::Buffer& output) {
+                    for (const auto& object : input.select<osmium::OSMObject>()) {
+                        if (ids(object.type()).get(object.positive_id())) {
+                            projection.add(object, output);
+                        }
+                    }
+                };
+
+                ParallelPBFReader reader{input_filename, osmium::osm_entity_bits::nwr, num_threads, copy_selected, pass_through};
+
+                if (pass_through) {
+                    write_pass_through(reader, output_filename, nullptr);
+                } else {
+                    OutputWriter writer{output_filename, output_format, &projection};
+
+                    osmium::ProgressBar progress_bar{reader.file_size(), true};
+                    while (osmium::memory::Buffer buffer = reader.read()) {
+                        progress_bar.update(reader.offset());
+                        writer(std::move(buffer));
+                    }
+                    progress_bar.done();
+
+                    reader.close();
+                    writer.close();
+                }
+                if (verbose) {
+                    print_worker_stats(std::cerr, reader.stats());
+                }
+            } else {
+                osmium::io::Reader reader{input_filename};
+
+                OutputWriter writer{output_filename, output_format, &projection};
+
+                osmium::ProgressBar progress_bar{reader.file_size(), true};
+                while (osmium::memory::Buffer buffer = reader.read()) {
+                    progress_bar.update(reader.offset());
+                    for (const auto& object : buffer.select<osmium::OSMObject>()) {
+                        if (ids(object.type()).get(object.positive_id())) {
+                            writer(object);
+                        }
+                    }
+                }
+                progress_bar.done();
+
+                reader.close();
+                writer.close();
+            }
+        } else if (parallel_match && pass_through) {
+            ParallelPBFReader reader{input_filename, filter.input_entities(), num_threads, nullptr, true, match_options};
+            write_pass_through(reader, output_filename, state_filename.empty() ? nullptr : &matched);
+            if (verbose) {
+                print_worker_stats(std::cerr, reader.stats());
+            }
+        } else if (parallel_match) {
+            ParallelPBFReader reader{input_filename, filter.input_entities(), num_threads, nullptr, false, match_options};
 
-            osmium::io::File output_file{output_filename, output_format};
-            osmium::io::Writer writer{output_file, osmium::io::overwrite::allow};
+            OutputWriter writer{output_filename, output_format, &projection};
 
             osmium::ProgressBar progress_bar{reader.file_size(), true};
             while (osmium::memory::Buffer buffer = reader.read()) {
                 progress_bar.update(reader.offset());
-                for (const auto& object : buffer.select<osmium::OSMObject>()) {
-                    if (ids(object.type()).get(object.positive_id())) {
-                        writer(object);
+                if (limit.enabled()) {
+                    for (const auto& object : buffer.select<osmium::OSMObject>()) {
+                        if (limit.add(object.type())) {
+                            writer(object);
+                        }
                     }
+                    if (limit.reached()) {
+                        break;
+                    }
+                    continue;
                 }
+                if (!state_filename.empty()) {
+                    for (const auto& object : buffer.select<osmium::OSMObject>()) {
+                        matched(object.type()).set(object.positive_id());
+                    }
+                }
+                writer(std::move(buffer));
             }
             progress_bar.done();
 
             reader.close();
             writer.close();
+            if (verbose) {
+                print_worker_stats(std::cerr, reader.stats());
+            }
         } else {
-            osmium::io::Reader reader{input_filename, filter.entities()};
+            osmium::io::Reader reader{input_filename, filter.input_entities()};
 
-            osmium::io::File output_file{output_filename, output_format};
-            osmium::io::Writer writer{output_file, osmium::io::overwrite::allow};
+            OutputWriter writer{output_filename, output_format, &projection};
 
             osmium::ProgressBar progress_bar{reader.file_size(), true};
             while (osmium::memory::Buffer buffer = reader.read()) {
                 progress_bar.update(reader.offset());
                 for (const auto& object : buffer.select<osmium::OSMObject>()) {
-                    if (filter.match(object)) {
+                    filter.collect(object);
+                    if (filter.match(object) && limit.add(object.type())) {
                         writer(object);
+                        if (!state_filename.empty()) {
+                            matched(object.type()).set(object.positive_id());
+                        }
                     }
                 }
+                if (limit.reached()) {
+                    break;
+                }
             }
             progress_bar.done();
 
             reader.close();
             writer.close();
         }
+
+        if (!state_filename.empty()) {
+            match_state::write(state_filename, matched, complete_ways);
+        }
     } catch (const expression_parser_error& e) {
         std::cerr << "Error parsing filter expression:\n";
         std::cerr << e.input() << "\n";
@@ -207,6 +668,9 @@ int main(int argc, char* argv[]) {
             }
         }
         std::cerr << "^\n";
+        if (!e.message().empty()) {
+            std::cerr << e.message() << "\n";
+        }
     }
 
     return 0;
@@ -1,350 +1,840 @@
 
-#include <cassert>
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
 #include <cstdint>
-#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
 #include <memory>
 #include <stdexcept>
 #include <string>
-#include <tuple>
+#include <utility>
 #include <vector>
 
-#include <boost/bind.hpp>
-#include <boost/fusion/adapted/std_tuple.hpp>
-#include <boost/optional.hpp>
-#include <boost/spirit/include/phoenix.hpp>
-#include <boost/spirit/include/qi.hpp>
-#include <boost/spirit/include/qi_grammar.hpp>
-
 #include <osmium/osm/item_type.hpp>
+#include <osmium/osm/timestamp.hpp>
 
+#include "cost_model.hpp"
 #include "object_filter.hpp"
+#include "tag_stats.hpp"
+
+/**
+ * Recursive descent parser for the expression language.
+ *
+ * The parser works in a single pass over the input and never backtracks:
+ * the next character (or keyword) always decides which rule applies. So
+ * parse time is linear in the size of the input, even for machine
+ * generated expressions with huge ID lists or thousands of alternatives.
+ * The expression tree is built directly and every node gets the position
+ * where it starts in the input.
+ *
+ * Grammar (whitespace and comments from '#' to the end of the line are
+ * allowed between all tokens):
+ *
+ *   expression  := term ("or" term)*
+ *   term        := factor ("and" factor)*
+ *   factor      := "not" factor | "(" expression ")" | condition
+ *   condition   := "true" | "false" | bool_attr
+ *                | string [str_op string | regex_op string ["i"]]
+ *                | str_attr (str_op string | regex_op string)
+ *                | int_attr ["not"] "in" (int_list | "(" "<" string ")")
+ *                | int_operand int_op int_operand
+ *                | "@location" ["not"] "in" "bbox" "(" num "," num "," num "," num ")"
+ *                | "@location" ["not"] "in" "polygon" "(" "<" string ")"
+ *   int_operand := int_attr | integer | timestamp
+ *                | ("@tags" | "@nodes" | "@members") ["[" expression "]"]
+ *   int_list    := "(" int_item ("," int_item)* ")"
+ *   int_item    := (integer | timestamp) [":" (integer | timestamp)]
+ *
+ * Keywords (and, or, not, in, true, false, bbox, polygon) are only
+ * recognized if they are not followed by a character that could continue
+ * a plain string, so "notable" is a tag key, not "not able".
+ */
+class ExprParser {
+
+    const std::string& m_input;
+    std::size_t m_pos = 0;
+
+    [[noreturn]] void error(std::size_t pos, const std::string& message) const {
+        throw expression_parser_error{m_input, static_cast<int>(pos), message};
+    }
+
+    char at(std::size_t pos) const noexcept {
+        return pos < m_input.size() ? m_input[pos] : '\0';
+    }
+
+    char peek() const noexcept {
+        return at(m_pos);
+    }
+
+    static bool is_alpha(char c) noexcept {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    }
+
+    static bool is_digit(char c) noexcept {
+        return c >= '0' && c <= '9';
+    }
+
+    // Characters allowed after the first one in plain strings.
+    static bool is_string_char(char c) noexcept {
+        return is_alpha(c) || is_digit(c) || c == ':' || c == '_';
+    }
+
+    // Skip whitespace and comments.
+    void skip() noexcept {
+        while (m_pos < m_input.size()) {
+            const char c = m_input[m_pos];
+            if (c == '#') {
+                while (m_pos < m_input.size() && m_input[m_pos] != '\n') {
+                    ++m_pos;
+                }
+            } else if (std::isspace(static_cast<unsigned char>(c))) {
+                ++m_pos;
+            } else {
+                break;
+            }
+        }
+    }
+
+    bool starts_with(const char* str) const noexcept {
+        return m_input.compare(m_pos, std::strlen(str), str) == 0;
+    }
+
+    // Consume an operator or punctuation if it is next in the input.
+    bool literal(const char* str) noexcept {
+        if (!starts_with(str)) {
+            return false;
+        }
+        m_pos += std::strlen(str);
+        skip();
+        return true;
+    }
+
+    void expect(const char* str) {
+        if (!literal(str)) {
+            error(m_pos, std::string{"Expected '"} + str + "'");
+        }
+    }
+
+    // Consume a keyword if it is next in the input.
+    bool keyword(const char* word) noexcept {
+        const auto len = std::strlen(word);
+        if (!starts_with(word) || is_string_char(at(m_pos + len))) {
+            return false;
+        }
+        m_pos += len;
+        skip();
+        return true;
+    }
+
+    template <typename T, typename... TArgs>
+    static std::unique_ptr<ExprNode> make(std::size_t pos, TArgs&&... args) {
+        std::unique_ptr<ExprNode> node{new T(std::forward<TArgs>(args)...)};
+        node->set_position(pos);
+        return node;
+    }
+
+    // Plain string ([a-zA-Z][a-zA-Z0-9:_]*) or string in single or double
+    // quotes (without escapes).
+    std::string parse_string() {
+        const auto start = m_pos;
+        const char c = peek();
+        std::string str;
+        if (c == '\'' || c == '"') {
+            const auto end = m_input.find(c, start + 1);
+            if (end == std::string::npos) {
+                error(start, "Missing closing quote");
+            }
+            str.assign(m_input, start + 1, end - start - 1);
+            m_pos = end + 1;
+        } else if (is_alpha(c)) {
+            do {
+                ++m_pos;
+            } while (is_string_char(peek()));
+            str.assign(m_input, start, m_pos - start);
+        } else {
+            error(start, "Expected string");
+        }
+        skip();
+        return str;
+    }
+
+    bool is_timestamp() const noexcept {
+        for (std::size_t i = 0; i < 10; ++i) {
+            const char c = at(m_pos + i);
+            if (i == 4 || i == 7 ? c != '-' : !is_digit(c)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // ISO 8601 timestamp ("2016-01-01T00:00:00Z") or date ("2016-01-01"),
+    // converted into seconds since the epoch.
+    std::int64_t parse_timestamp() {
+        const auto start = m_pos;
+        const char* pattern = "Tdd:dd:ddZ";
+        std::size_t len = 10;
+        bool has_time = true;
+        for (std::size_t i = 0; pattern[i] != '\0'; ++i) {
+            const char c = at(start + len + i);
+            if (pattern[i] == 'd' ? !is_digit(c) : c != pattern[i]) {
+                has_time = false;
+                break;
+            }
+        }
+        if (has_time) {
+            len += std::strlen(pattern);
+        }
+
+        std::string str{m_input, start, len};
+        if (!has_time) {
+            str += "T00:00:00Z";
+        }
+        try {
+            const osmium::Timestamp timestamp{str};
+            m_pos += len;
+            skip();
+            return timestamp.seconds_since_epoch();
+        } catch (const std::invalid_argument&) {
+            error(start, "Invalid timestamp");
+        }
+    }
+
+    std::int64_t parse_integer() {
+        const auto start = m_pos;
+        bool negative = false;
+        if (peek() == '-' || peek() == '+') {
+            negative = peek() == '-';
+            ++m_pos;
+        }
+        if (!is_digit(peek())) {
+            error(start, "Expected integer");
+        }
+
+        // Accumulate as negative number, so the minimum value fits.
+        std::int64_t value = 0;
+        constexpr const auto min = std::numeric_limits<std::int64_t>::min();
+        while (is_digit(peek())) {
+            const int digit = peek() - '0';
+            if (value < (min + digit) / 10) {
+                error(start, "Integer out of range");
+            }
+            value = value * 10 - digit;
+            ++m_pos;
+        }
+        if (!negative) {
+            if (value == min) {
+                error(start, "Integer out of range");
+            }
+            value = -value;
+        }
+        skip();
+        return value;
+    }
+
+    std::int64_t parse_int_value() {
+        return is_timestamp() ? parse_timestamp() : parse_integer();
+    }
+
+    double parse_double() {
+        const char* begin = m_input.c_str() + m_pos;
+        char* end = nullptr;
+        const double value = std::strtod(begin, &end);
+        if (end == begin) {
+            error(m_pos, "Expected number");
+        }
+        m_pos += static_cast<std::size_t>(end - begin);
+        skip();
+        return value;
+    }
+
+    // Name of an attribute after the '@'.
+    std::string parse_attribute_name() {
+        const auto start = m_pos;
+        ++m_pos;
+        while (is_alpha(peek()) || peek() == '_') {
+            ++m_pos;
+        }
+        std::string name{m_input, start + 1, m_pos - start - 1};
+        if (name.empty()) {
+            error(start, "Expected attribute name");
+        }
+        skip();
+        return name;
+    }
+
+    template <typename T>
+    static bool find_attribute(const std::string& name, T last, T& attr) noexcept {
+        for (int i = 0; i <= int(last); ++i) {
+            if (name == attribute_name(T(i))) {
+                attr = T(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool parse_int_op(integer_op_type& op) noexcept {
+        if (literal("==")) {
+            op = integer_op_type::equal;
+        } else if (literal("!=")) {
+            op = integer_op_type::not_equal;
+        } else if (literal("<=")) {
+            op = integer_op_type::less_or_equal;
+        } else if (literal("<")) {
+            op = integer_op_type::less_than;
+        } else if (literal(">=")) {
+            op = integer_op_type::greater_or_equal;
+        } else if (literal(">")) {
+            op = integer_op_type::greater_than;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    // Parses string comparison or regex match operators. Returns false
+    // if there is none.
+    bool parse_str_op(string_op_type& op) noexcept {
+        if (literal("==")) {
+            op = string_op_type::equal;
+        } else if (literal("!=")) {
+            op = string_op_type::not_equal;
+        } else if (literal("=^")) {
+            op = string_op_type::prefix_equal;
+        } else if (literal("!^")) {
+            op = string_op_type::prefix_not_equal;
+        } else if (literal("=~")) {
+            op = string_op_type::match;
+        } else if (literal("!~")) {
+            op = string_op_type::not_match;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    static bool is_match(string_op_type op) noexcept {
+        return op == string_op_type::match || op == string_op_type::not_match;
+    }
 
+    // "in" or "not in"
+    list_op_type parse_list_op() {
+        if (keyword("in")) {
+            return list_op_type::in;
+        }
+        if (keyword("not") && keyword("in")) {
+            return list_op_type::not_in;
+        }
+        error(m_pos, "Expected 'in' or 'not in'");
+    }
+
+    // "(" "<" string ")"
+    std::string parse_filename() {
+        expect("<");
+        std::string filename = parse_string();
+        expect(")");
+        return filename;
+    }
+
+    std::unique_ptr<ExprNode> parse_subexpression(std::size_t pos, const std::string& name) {
+        std::unique_ptr<ExprNode> expr;
+        if (literal("[")) {
+            expr = parse_expression();
+            expect("]");
+        } else {
+            expr.reset(new BooleanValue);
+        }
+
+        if (name == "tags") {
+            return make<TagsExpr>(pos, std::move(expr));
+        }
+        if (name == "nodes") {
+            return make<NodesExpr>(pos, std::move(expr));
+        }
+        return make<MembersExpr>(pos, std::move(expr));
+    }
+
+    std::unique_ptr<ExprNode> parse_int_operand() {
+        const auto pos = m_pos;
+        const char c = peek();
+        if (is_digit(c) || ((c == '-' || c == '+') && is_digit(at(m_pos + 1)))) {
+            return make<IntegerValue>(pos, parse_int_value());
+        }
+        if (c == '@') {
+            const auto name = parse_attribute_name();
+            integer_attribute_type attr;
+            if (find_attribute(name, integer_attribute_type::timestamp, attr)) {
+                return make<IntegerAttribute>(pos, attr);
+            }
+            if (name == "tags" || name == "nodes" || name == "members") {
+                return parse_subexpression(pos, name);
+            }
+        }
+        error(pos, "Expected integer, integer attribute, @tags, @nodes, or @members");
+    }
+
+    std::unique_ptr<ExprNode> parse_binary_int_op(std::size_t pos, std::unique_ptr<ExprNode>&& lhs) {
+        integer_op_type op;
+        if (!parse_int_op(op)) {
+            error(m_pos, "Expected integer comparison operator");
+        }
+        auto rhs = parse_int_operand();
+        return make<BinaryIntOperation>(pos, std::move(lhs), op, std::move(rhs));
+    }
+
+    // After "@id in" etc.
+    std::unique_ptr<ExprNode> parse_int_list(std::size_t pos, std::unique_ptr<ExprNode>&& attr, list_op_type op) {
+        expect("(");
+        if (peek() == '<') {
+            return make<InIntegerList>(pos, std::move(attr), op, parse_filename());
+        }
+
+        std::vector<integer_range> ranges;
+        bool has_ranges = false;
+        do {
+            const auto item_pos = m_pos;
+            const auto first = parse_int_value();
+            auto last = first;
+            if (literal(":")) {
+                last = parse_int_value();
+                has_ranges = true;
+                if (first > last) {
+                    error(item_pos, "Invalid range");
+                }
+            }
+            ranges.emplace_back(first, last);
+        } while (literal(","));
+        expect(")");
+
+        if (has_ranges) {
+            return make<InIntegerRanges>(pos, std::move(attr), op, ranges);
+        }
+
+        std::vector<std::int64_t> values;
+        values.reserve(ranges.size());
+        for (const auto& range : ranges) {
+            values.push_back(range.first);
+        }
+        return make<InIntegerList>(pos, std::move(attr), op, values);
+    }
+
+    std::unique_ptr<ExprNode> parse_location(std::size_t pos) {
+        const auto op = parse_list_op();
+        const auto box_pos = m_pos;
+        if (keyword("bbox")) {
+            expect("(");
+            const double minlon = parse_double();
+            expect(",");
+            const double minlat = parse_double();
+            expect(",");
+            const double maxlon = parse_double();
+            expect(",");
+            const double maxlat = parse_double();
+            expect(")");
+            if (!(minlon >= -180.0 && maxlon <= 180.0 && minlat >= -90.0 && maxlat <= 90.0 &&
+                  minlon <= maxlon && minlat <= maxlat)) {
+                error(box_pos, "Invalid bounding box");
+            }
+            return make<LocationInBox>(pos, op, minlon, minlat, maxlon, maxlat);
+        }
+        if (keyword("polygon")) {
+            expect("(");
+            return make<LocationInPolygon>(pos, op, parse_filename());
+        }
+        error(m_pos, "Expected 'bbox' or 'polygon'");
+    }
+
+    // Condition starting with an attribute.
+    std::unique_ptr<ExprNode> parse_attribute_condition() {
+        const auto pos = m_pos;
+        const auto name = parse_attribute_name();
+
+        boolean_attribute_type bool_attr;
+        if (find_attribute(name, boolean_attribute_type::open_way, bool_attr)) {
+            return make<BooleanAttribute>(pos, bool_attr);
+        }
+
+        integer_attribute_type int_attr;
+        if (find_attribute(name, integer_attribute_type::timestamp, int_attr)) {
+            auto attr = make<IntegerAttribute>(pos, int_attr);
+            if (peek() == 'i' || peek() == 'n') {
+                const auto op = parse_list_op();
+                return parse_int_list(pos, std::move(attr), op);
+            }
+            return parse_binary_int_op(pos, std::move(attr));
+        }
+
+        string_attribute_type str_attr;
+        if (find_attribute(name, string_attribute_type::role, str_attr)) {
+            auto attr = make<StringAttribute>(pos, str_attr);
+            string_op_type op;
+            if (!parse_str_op(op)) {
+                error(m_pos, "Expected string comparison operator");
+            }
+            const auto value_pos = m_pos;
+            std::unique_ptr<ExprNode> value;
+            if (is_match(op)) {
+                value = make<RegexValue>(value_pos, parse_string());
+            } else {
+                value = make<StringValue>(value_pos, parse_string());
+            }
+            return make<BinaryStrOperation>(pos, std::move(attr), op, std::move(value));
+        }
+
+        if (name == "tags" || name == "nodes" || name == "members") {
+            return parse_binary_int_op(pos, parse_subexpression(pos, name));
+        }
+
+        if (name == "location") {
+            return parse_location(pos);
+        }
+
+        error(pos, "Unknown attribute '@" + name + "'");
+    }
+
+    // Tag key check or tag check.
+    std::unique_ptr<ExprNode> parse_tag_condition() {
+        const auto pos = m_pos;
+        const auto key = parse_string();
+
+        string_op_type op;
+        if (!parse_str_op(op)) {
+            return make<CheckHasKeyExpr>(pos, key);
+        }
+
+        const auto value = parse_string();
+        if (!is_match(op)) {
+            return make<CheckTagStrExpr>(pos, key, op, value);
+        }
+        const bool case_insensitive = keyword("i");
+        return make<CheckTagRegexExpr>(pos, key, op, value, case_insensitive);
+    }
+
+    std::unique_ptr<ExprNode> parse_condition() {
+        const auto pos = m_pos;
+        const char c = peek();
+
+        if (keyword("true")) {
+            return make<BooleanValue>(pos, true);
+        }
+        if (keyword("false")) {
+            return make<BooleanValue>(pos, false);
+        }
+        if (c == '@') {
+            return parse_attribute_condition();
+        }
+        if (is_alpha(c) || c == '\'' || c == '"') {
+            return parse_tag_condition();
+        }
+        if (is_digit(c) || c == '-' || c == '+') {
+            return parse_binary_int_op(pos, parse_int_operand());
+        }
+
+        error(pos, "Expected condition");
+    }
+
+    std::unique_ptr<ExprNode> parse_factor() {
+        const auto pos = m_pos;
+        if (keyword("not")) {
+            return make<NotExpr>(pos, parse_factor());
+        }
+        if (literal("(")) {
+            auto expr = parse_expression();
+            expect(")");
+            return expr;
+        }
+        return parse_condition();
+    }
+
+    std::unique_ptr<ExprNode> parse_term() {
+        const auto pos = m_pos;
+        std::vector<std::unique_ptr<ExprNode>> children;
+        children.push_back(parse_factor());
+        while (keyword("and")) {
+            children.push_back(parse_factor());
+        }
+        if (children.size() == 1) {
+            return std::move(children.front());
+        }
+        return make<AndExpr>(pos, std::move(children));
+    }
 
-namespace qi = boost::spirit::qi;
-namespace ascii = boost::spirit::ascii;
-
-template <typename Iterator>
-struct comment_skipper : public qi::grammar<Iterator> {
-
-    qi::rule<Iterator> skip;
-
-    comment_skipper() : comment_skipper::base_type(skip, "Comment skipper") {
-        skip = ascii::space
-             | ('#' >> *(qi::char_ - '\n') >> ('\n' | qi::eoi));
-    }
-
-};
-
-template <typename Iterator>
-struct OSMObjectFilterGrammar : qi::grammar<Iterator, comment_skipper<Iterator>, expr_node<ExprNode>()> {
-
-    template <typename... T>
-    using rs = qi::rule<Iterator, comment_skipper<Iterator>, T...>;
-
-    rs<std::string()> single_q_str, double_q_str, plain_string, string, list_from_filename;
-    rs<integer_op_type> oper_int;
-    rs<string_op_type> oper_str, oper_regex;
-    rs<list_op_type> oper_list;
-    rs<std::vector<std::int64_t>()> int_list_value;
-
-    rs<expr_node<IntegerAttribute>()> attr_int;
-    rs<expr_node<StringAttribute>()> attr_str;
-    rs<expr_node<BooleanAttribute>()> attr_boolean;
-
-    rs<expr_node<ExprNode>()> start_rule, paren_expression, factor, tag, primitive, subexpression, subexpr_int;
-    rs<std::vector<expr_node<ExprNode>>()> expression_v, term_v;
-    rs<expr_node<OrExpr>()> expression;
-    rs<expr_node<AndExpr>()> term;
-    rs<expr_node<NotExpr>()> not_factor;
-    rs<expr_node<BooleanValue>()> static_true, bool_true, bool_false;
-    rs<expr_node<IntegerValue>()> int_value;
-    rs<expr_node<CheckHasKeyExpr>()> key;
-    rs<expr_node<StringValue>()> str_value;
-    rs<expr_node<RegexValue>()> regex_value;
-    rs<expr_node<TagsExpr>()> tags_expr;
-    rs<expr_node<NodesExpr>()> nodes_expr;
-    rs<expr_node<MembersExpr>()> members_expr;
-
-    rs<std::tuple<expr_node<ExprNode>, integer_op_type, expr_node<ExprNode>>()> binary_int_oper_v;
-    rs<std::tuple<expr_node<ExprNode>, string_op_type, expr_node<ExprNode>>()> binary_str_oper_v;
-    rs<expr_node<BinaryIntOperation>()> binary_int_oper;
-    rs<expr_node<BinaryStrOperation>()> binary_str_oper;
-
-    rs<std::tuple<expr_node<ExprNode>, list_op_type, std::vector<std::int64_t>>()> in_int_list_values_v;
-    rs<std::tuple<expr_node<ExprNode>, list_op_type, std::string>()> in_int_list_filename_v;
-    rs<expr_node<InIntegerList>()> in_int_list_values;
-    rs<expr_node<InIntegerList>()> in_int_list_filename;
-
-    rs<std::tuple<std::string, string_op_type, std::string>()> tag_str_v;
-    rs<std::tuple<std::string, string_op_type, std::string, boost::optional<char>>()> tag_regex_v;
-    rs<expr_node<CheckTagStrExpr>()> tag_str;
-    rs<expr_node<CheckTagRegexExpr>()> tag_regex;
-
-    OSMObjectFilterGrammar() :
-        OSMObjectFilterGrammar::base_type(start_rule, "OSM Object Filter Grammar") {
-
-        // single quoted string
-        single_q_str   = qi::lexeme[
-                           qi::lit('\'')
-                           > *(~qi::char_('\''))
-                           > qi::lit('\'')
-                         ];
-        single_q_str.name("single quoted string");
-
-        // double quoted string (XXX TODO: escapes, unicode)
-        double_q_str   = qi::lexeme[
-                             qi::lit('"')
-                           > *(~qi::char_('"'))
-                           > qi::lit('"')
-                         ];
-        double_q_str.name("double quoted string");
-
-        // plain string as used in keys and values
-        plain_string   = qi::lexeme[
-                              qi::char_("a-zA-Z")
-                           > *qi::char_("a-zA-Z0-9:_")
-                         ];
-        plain_string.name("plain string");
-
-        // any kind of string
-        string         = plain_string
-                       | single_q_str
-                       | double_q_str;
-        string.name("string");
-
-        // operator for integer comparison
-        oper_int       = (qi::lit("==") > qi::attr(integer_op_type::equal))
-                       | (qi::lit("!=") > qi::attr(integer_op_type::not_equal))
-                       | (qi::lit("<=") > qi::attr(integer_op_type::less_or_equal))
-                       | (qi::lit("<")  > qi::attr(integer_op_type::less_than))
-                       | (qi::lit(">=") > qi::attr(integer_op_type::greater_or_equal))
-                       | (qi::lit(">")  > qi::attr(integer_op_type::greater_than));
-        oper_int.name("integer comparison operand");
-
-        // operator for simple string comparison
-        oper_str       = (qi::lit("==") > qi::attr(string_op_type::equal))
-                       | (qi::lit("!=") > qi::attr(string_op_type::not_equal))
-                       | (qi::lit("=^") > qi::attr(string_op_type::prefix_equal))
-                       | (qi::lit("!^") > qi::attr(string_op_type::prefix_not_equal));
-        oper_str.name("string comparison operand");
-
-        // operator for regex string comparison
-        oper_regex     = (qi::lit("=~") > qi::attr(string_op_type::match))
-                       | (qi::lit("!~") > qi::attr(string_op_type::not_match));
-        oper_regex.name("string regex comparison operand");
-
-        oper_list      = (qi::lit("in")     > qi::attr(list_op_type::in))
-                       | (qi::lit("not in") > qi::attr(list_op_type::not_in));
-        oper_list.name("list comparison operand");
-
-        // IntegerAttribute
-        attr_int       = (qi::lit("@id")        > qi::attr(integer_attribute_type::id))
-                       | (qi::lit("@version")   > qi::attr(integer_attribute_type::version))
-                       | (qi::lit("@uid")       > qi::attr(integer_attribute_type::uid))
-                       | (qi::lit("@changeset") > qi::attr(integer_attribute_type::changeset))
-                       | (qi::lit("@ref")       > qi::attr(integer_attribute_type::ref));
-        attr_int.name("integer attribute");
-
-        // StringAttribute
-        attr_str       = (qi::lit("@user")  > qi::attr(string_attribute_type::user))
-                       | (qi::lit("@key")   > qi::attr(string_attribute_type::key))
-                       | (qi::lit("@value") > qi::attr(string_attribute_type::value))
-                       | (qi::lit("@role")  > qi::attr(string_attribute_type::role));
-        attr_str.name("string attribute");
-
-        // BooleanAttribute
-        attr_boolean   = (qi::lit("@node")       > qi::attr(boolean_attribute_type::node))
-                       | (qi::lit("@way")        > qi::attr(boolean_attribute_type::way))
-                       | (qi::lit("@relation")   > qi::attr(boolean_attribute_type::relation))
-                       | (qi::lit("@visible")    > qi::attr(boolean_attribute_type::visible))
-                       | (qi::lit("@closed_way") > qi::attr(boolean_attribute_type::closed_way))
-                       | (qi::lit("@open_way")   > qi::attr(boolean_attribute_type::open_way));
-        attr_boolean.name("boolean attribute");
-
-        // BooleanValue
-        static_true    = qi::attr(true);
-
-        bool_true      = qi::lit("true")  > qi::attr(true);
-        bool_true.name("true");
-
-        bool_false     = qi::lit("false") > qi::attr(false);
-        bool_true.name("false");
-
-        // IntegerValue
-        int_value      = qi::int_parser<std::int64_t>();
-        int_value.name("integer value");
-
-        // StringValue
-        str_value      = string;
-        str_value.name("string value");
-
-        // RegexValue
-        regex_value    = string;
-        regex_value.name("regex value");
-
-        // CheckHasKeyExpr
-        key            = string;
-        key.name("tag key");
-
-        // CheckTagStrExpr
-        tag_str_v      = string
-                       >> oper_str
-                       >> string;
-        tag_str_v.name("tag_str_v");
-
-        tag_str        = tag_str_v;
-        tag_str.name("tag_str");
-
-        // CheckTagRegexExpr
-        tag_regex_v    = string
-                       >> oper_regex
-                       >> string
-                       >> -ascii::char_('i');
-        tag_regex_v.name("tag_regex_v");
-
-        tag_regex      = tag_regex_v;
-        tag_regex.name("tag_regex");
-
-        // Tag check
-        tag            = tag_str | tag_regex;
-        tag.name("tag");
-
-        subexpression  = (qi::lit('[') > expression > qi::lit(']')) | static_true;
-        subexpression.name("subexpression");
-
-        // TagsExpr
-        tags_expr      = qi::lit("@tags") >> subexpression;
-        tags_expr.name("tags expression");
-
-        // NodesExpr
-        nodes_expr     = qi::lit("@nodes") >> subexpression;
-        nodes_expr.name("nodes expression");
-
-        // MembersExpr
-        members_expr   = qi::lit("@members") >> subexpression;
-        members_expr.name("members expression");
-
-        int_list_value   = qi::lit("(")
-                         >> (qi::int_parser<std::int64_t>() % qi::lit(","))
-                         >> qi::lit(")");
-        int_list_value.name("int_list_value");
-
-        list_from_filename     = qi::lit("(")
-                               >> qi::lit("<")
-                               >> string
-                               >> qi::lit(")");
-        list_from_filename.name("list_from_filename");
-
-        in_int_list_values_v   = attr_int >> oper_list >> int_list_value;
-        in_int_list_values_v.name("in_int_list_values_v");
-
-        in_int_list_values     = in_int_list_values_v;
-        in_int_list_values.name("in_int_list_values");
-
-        in_int_list_filename_v = attr_int >> oper_list >> list_from_filename;
-        in_int_list_filename_v.name("in_int_list_filename_v");
-
-        in_int_list_filename   = in_int_list_filename_v;
-        in_int_list_filename.name("in_int_list_filename");
-
-        subexpr_int      = tags_expr
-                         | nodes_expr
-                         | members_expr;
-        subexpr_int.name("subexpr_int");
+    std::unique_ptr<ExprNode> parse_expression() {
+        const auto pos = m_pos;
+        std::vector<std::unique_ptr<ExprNode>> children;
+        children.push_back(parse_term());
+        while (keyword("or")) {
+            children.push_back(parse_term());
+        }
+        if (children.size() == 1) {
+            return std::move(children.front());
+        }
+        return make<OrExpr>(pos, std::move(children));
+    }
 
-        // an attribute name, comparison operator and integer
-        binary_int_oper_v  = (attr_int | int_value | subexpr_int)
-                           >> oper_int
-                           >> (attr_int | int_value | subexpr_int);
-        binary_int_oper_v.name("binary_int_oper_v");
+public:
 
-        binary_int_oper  = binary_int_oper_v;
-        binary_int_oper.name("binary_int_oper");
+    explicit ExprParser(const std::string& input) noexcept :
+        m_input(input) {
+    }
 
-        binary_str_oper_v = (attr_str >> oper_str >> str_value) | (attr_str >> oper_regex >> regex_value);
-        binary_str_oper_v.name("binary_str_oper_v");
+    std::unique_ptr<ExprNode> operator()() {
+        skip();
+        auto root = parse_expression();
+        if (m_pos != m_input.size()) {
+            error(m_pos, "Unexpected input");
+        }
+        return root;
+    }
 
-        binary_str_oper  = binary_str_oper_v;
-        binary_str_oper.name("binary_str_oper");
+}; // class ExprParser
 
-        primitive        = bool_true
-                         | bool_false
-                         | attr_boolean
-                         | tag
-                         | key
-                         | binary_int_oper
-                         | binary_str_oper
-                         | in_int_list_values
-                         | in_int_list_filename;
-        primitive.name("condition");
+/**
+ * Semantic analysis of a parsed expression. Gives each node its static
+ * type and the context it is evaluated in (see eval_context) and checks
+ * that they fit together: attributes must exist in their context ("@ref"
+ * only for node refs and members, "@key" only for tags, ...), comparisons
+ * need operands of the right type, and so on. The grammar allows some
+ * expressions that fail these checks, they used to throw (or crash) while
+ * evaluating. Now evaluation can assume a well-typed tree.
+ */
+class ExprChecker {
 
-        paren_expression = '('
-                         > expression
-                         > ')';
-        paren_expression.name("parenthesized expression");
+    const std::string& m_input;
 
-        not_factor       = qi::lit("not")
-                         > factor;
-        not_factor.name("not_factor");
+    [[noreturn]] void error(const ExprNode& expr, const std::string& message) const {
+        const int pos = expr.position() == ExprNode::unknown_position ? -1 : static_cast<int>(expr.position());
+        throw expression_parser_error{m_input, pos, message};
+    }
 
-        factor           = not_factor
-                         | paren_expression
-                         | primitive;
-        factor.name("factor");
+    static const char* context_name(eval_context context) noexcept {
+        switch (context) {
+            case eval_context::object:
+                break;
+            case eval_context::tag:
+                return "in @tags[...]";
+            case eval_context::node_ref:
+                return "in @nodes[...]";
+            case eval_context::member:
+                return "in @members[...]";
+        }
+        return "outside @tags[...], @nodes[...], and @members[...]";
+    }
 
-        term_v           = factor % qi::lit("and");
-        term_v.name("term_v");
+    void require_context(const ExprNode& expr, eval_context context, bool allowed, const std::string& what) const {
+        if (!allowed) {
+            error(expr, what + " can not be used " + context_name(context));
+        }
+    }
 
-        term             = term_v;
-        term.name("term");
+    void require_condition(ExprNode& expr, eval_context context) const {
+        const auto type = check(expr, context);
+        if (type == expr_value_type::string || type == expr_value_type::regex) {
+            error(expr, "Expected a condition");
+        }
+    }
 
-        expression_v     = term % qi::lit("or");
-        expression_v.name("expression_v");
+    void require_integer(ExprNode& expr, eval_context context) const {
+        const auto type = check(expr, context);
+        if (type != expr_value_type::integer && type != expr_value_type::boolean) {
+            error(expr, "Expected an integer");
+        }
+    }
 
-        expression       = expression_v;
-        expression.name("expression");
+    expr_value_type check_attribute(const ExprNode& expr, eval_context context) const {
+        switch (expr.expression_type()) {
+            case expr_node_type::integer_attribute: {
+                    const auto attr = static_cast<const IntegerAttribute&>(expr).attribute();
+                    const bool is_ref = attr == integer_attribute_type::ref;
+                    require_context(expr, context,
+                                    context == eval_context::object ? !is_ref :
+                                    context != eval_context::tag && is_ref,
+                                    std::string{"@"} + attribute_name(attr));
+                }
+                return expr_value_type::integer;
+            case expr_node_type::string_attribute: {
+                    const auto attr = static_cast<const StringAttribute&>(expr).attribute();
+                    bool allowed = false;
+                    switch (context) {
+                        case eval_context::object:
+                            allowed = attr == string_attribute_type::user;
+                            break;
+                        case eval_context::tag:
+                            allowed = attr == string_attribute_type::key || attr == string_attribute_type::value;
+                            break;
+                        case eval_context::node_ref:
+                            break;
+                        case eval_context::member:
+                            allowed = attr == string_attribute_type::role;
+                            break;
+                    }
+                    require_context(expr, context, allowed, std::string{"@"} + attribute_name(attr));
+                }
+                return expr_value_type::string;
+            default:
+                break;
+        }
+        error(expr, "Expected an attribute");
+    }
 
-        start_rule       = expression;
-        start_rule.name("start_rule");
+    expr_value_type check_node(ExprNode& expr, eval_context context) const {
+        switch (expr.expression_type()) {
+            case expr_node_type::and_expr:
+            case expr_node_type::or_expr:
+                for (const auto& child : static_cast<WithSubExpr&>(expr).children()) {
+                    require_condition(*child, context);
+                }
+                return expr_value_type::boolean;
+            case expr_node_type::not_expr:
+                require_condition(*static_cast<NotExpr&>(expr).expr(), context);
+                return expr_value_type::boolean;
+            case expr_node_type::bool_value:
+                return expr_value_type::boolean;
+            case expr_node_type::integer_value:
+                return expr_value_type::integer;
+            case expr_node_type::string_value:
+                return expr_value_type::string;
+            case expr_node_type::regex_value:
+                return expr_value_type::regex;
+            case expr_node_type::integer_attribute:
+            case expr_node_type::string_attribute:
+                return check_attribute(expr, context);
+            case expr_node_type::boolean_attribute:
+                require_context(expr, context, context == eval_context::object,
+                                std::string{"@"} + attribute_name(static_cast<const BooleanAttribute&>(expr).attribute()));
+                return expr_value_type::boolean;
+            case expr_node_type::binary_int_op: {
+                    const auto& e = static_cast<const BinaryIntOperation&>(expr);
+                    require_integer(*e.lhs(), context);
+                    require_integer(*e.rhs(), context);
+                }
+                return expr_value_type::boolean;
+            case expr_node_type::binary_str_op: {
+                    const auto& e = static_cast<const BinaryStrOperation&>(expr);
+                    if (check(*e.lhs(), context) != expr_value_type::string) {
+                        error(*e.lhs(), "Expected a string");
+                    }
+                    check(*e.rhs(), context);
+                    const bool match = e.op() == string_op_type::match || e.op() == string_op_type::not_match;
+                    if (match && e.rhs()->expression_type() != expr_node_type::regex_value) {
+                        error(*e.rhs(), "Expected a regex");
+                    }
+                    if (!match && e.rhs()->expression_type() != expr_node_type::string_value) {
+                        error(*e.rhs(), "Expected a string");
+                    }
+                }
+                return expr_value_type::boolean;
+            case expr_node_type::tags_expr:
+                require_context(expr, context, context == eval_context::object, "@tags");
+                require_condition(*static_cast<TagsExpr&>(expr).expr(), eval_context::tag);
+                return expr_value_type::integer;
+            case expr_node_type::nodes_expr:
+                require_context(expr, context, context == eval_context::object, "@nodes");
+                require_condition(*static_cast<NodesExpr&>(expr).expr(), eval_context::node_ref);
+                return expr_value_type::integer;
+            case expr_node_type::members_expr:
+                require_context(expr, context, context == eval_context::object, "@members");
+                require_condition(*static_cast<MembersExpr&>(expr).expr(), eval_context::member);
+                return expr_value_type::integer;
+            case expr_node_type::in_integer_list:
+                require_context(expr, context, context == eval_context::object, "Lists");
+                require_integer(*static_cast<InIntegerList&>(expr).attr(), context);
+                return expr_value_type::boolean;
+            case expr_node_type::in_integer_ranges:
+                require_context(expr, context, context == eval_context::object, "Lists");
+                require_integer(*static_cast<InIntegerRanges&>(expr).attr(), context);
+                return expr_value_type::boolean;
+            case expr_node_type::location_in_box:
+            case expr_node_type::location_in_polygon:
+                require_context(expr, context, context == eval_context::object, "@location");
+                return expr_value_type::boolean;
+            case expr_node_type::check_has_key:
+            case expr_node_type::check_tag_str:
+            case expr_node_type::check_tag_regex:
+                require_context(expr, context, context == eval_context::object, "Tag checks");
+                return expr_value_type::boolean;
+            default:
+                break;
+        }
+        error(expr, "Unsupported expression");
+    }
 
-        qi::on_error<qi::fail>(start_rule,
-            std::cerr
-                << boost::phoenix::val("ERROR: Expecting ")
-                << boost::spirit::_4
-                << boost::phoenix::val(" here: \"")
-                << boost::phoenix::construct<std::string>(boost::spirit::_3, boost::spirit::_2)
-                << boost::phoenix::val("\"\n")
-        );
+public:
 
+    explicit ExprChecker(const std::string& input) noexcept :
+        m_input(input) {
     }
 
-}; // struct OSMObjectFilterGrammar
+    expr_value_type check(ExprNode& expr, eval_context context) const {
+        const auto type = check_node(expr, context);
+        expr.set_static_type(type, context);
+        return type;
+    }
+
+    void check_root(ExprNode& root) const {
+        require_condition(root, eval_context::object);
+    }
+
+}; // class ExprChecker
 
 OSMObjectFilter::OSMObjectFilter(const std::string& input) {
-    comment_skipper<std::string::const_iterator> skip;
+    m_root = ExprParser{input}();
+    ExprChecker{input}.check_root(*m_root);
+    m_arena = ExprArena{*m_root};
+}
 
-    OSMObjectFilterGrammar<std::string::const_iterator> grammar;
+void WithSubExpr::optimize(const CostModel& model) {
+    const bool in_and = expression_type() == expr_node_type::and_expr;
 
-    expr_node<ExprNode> root;
-    auto first = input.cbegin();
-    auto last  = input.cend();
-    const bool result = qi::phrase_parse(
-        first,
-        last,
-        grammar,
-        skip,
-        root
-    );
+    std::vector<std::pair<double, std::unique_ptr<ExprNode>>> ranked;
+    for (auto& child : m_children) {
+        child->optimize(model);
+        const double rank = model.rank(*child, in_and);
+        ranked.emplace_back(rank, std::move(child));
+    }
+
+    std::stable_sort(ranked.begin(), ranked.end(), [](const std::pair<double, std::unique_ptr<ExprNode>>& a,
+                                                      const std::pair<double, std::unique_ptr<ExprNode>>& b) {
+        return a.first < b.first;
+    });
 
-    if (!result) {
-        throw expression_parser_error{input};
+    for (std::size_t i = 0; i < ranked.size(); ++i) {
+        m_children[i] = std::move(ranked[i].second);
     }
+}
 
-    if (first != last) {
-        throw expression_parser_error{input, static_cast<int>(std::distance(input.cbegin(), first))};
+void InIntegerList::optimize(const CostModel& model) {
+    m_attr->optimize(model);
+
+    const auto size = linear_size();
+    if (size == 0 || !model.prefer_set(size)) {
+        return;
+    }
+
+    // linear_size() is only > 0 for literal lists in an IdSetSmall.
+    const auto& ids = static_cast<const osmium::index::IdSetSmall<std::uint64_t>&>(*m_values);
+    const auto minmax = std::minmax_element(ids.cbegin(), ids.cend(), [](std::uint64_t a, std::uint64_t b) {
+        return std::int64_t(a) < std::int64_t(b);
+    });
+
+    // Negative values are huge as unsigned, so they and far apart values
+    // would make the IdSetDense allocate gigabytes.
+    if (std::int64_t(*minmax.first) < 0 || *minmax.second - *minmax.first > max_dense_range) {
+        m_lookup.reset(new SortedIdSet{ids.cbegin(), ids.cend()});
+        return;
     }
 
-    assert(root.get());
-    m_root.reset(root.release());
+    m_lookup.reset(new osmium::index::IdSetDense<std::uint64_t>);
+    for (auto it = ids.cbegin(); it != ids.cend(); ++it) {
+        m_lookup->set(*it);
+    }
 }
 
+void OSMObjectFilter::optimize(const TagStats& stats) {
+    const CostModel model{stats, entities()};
+    m_root->optimize(model);
+    m_arena = ExprArena{*m_root};
+}
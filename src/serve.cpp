@@ -0,0 +1,667 @@
+
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/util/file.hpp>
+#include <osmium/util/memory_mapping.hpp>
+
+#include "dump_chunks.hpp"
+#include "object_filter.hpp"
+#include "output_writer.hpp"
+#include "serve.hpp"
+
+namespace po = boost::program_options;
+
+namespace {
+
+/**
+ * A dump file mapped into memory together with its chunk index. It is
+ * only read after construction, so it can be shared by all requests.
+ */
+class ResidentDump {
+
+    std::unique_ptr<osmium::util::MemoryMapping> m_mapping;
+    const unsigned char* m_data = nullptr;
+    std::size_t m_size = 0;
+    std::vector<dump_chunk> m_chunks;
+
+public:
+
+    ResidentDump(const std::string& filename, const std::string& index_filename) {
+        const int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::system_error{errno, std::system_category(), "Can not open '" + filename + "'"};
+        }
+        const auto size = osmium::util::file_size(fd);
+        m_mapping.reset(new osmium::util::MemoryMapping{size, osmium::util::MemoryMapping::mapping_mode::readonly, fd});
+
+        m_data = m_mapping->get_addr<unsigned char>();
+        m_size = m_mapping->size();
+
+        auto layout = load_dump_chunks(fd, m_data, m_size, index_filename);
+        ::close(fd);
+        m_chunks = std::move(layout.chunks);
+        m_data += layout.data_offset;
+        m_size = layout.data_size;
+    }
+
+    const std::vector<dump_chunk>& chunks() const noexcept {
+        return m_chunks;
+    }
+
+    std::size_t size() const noexcept {
+        return m_size;
+    }
+
+    osmium::memory::Buffer buffer(const dump_chunk& chunk) const {
+        return osmium::memory::Buffer{const_cast<unsigned char*>(m_data) + chunk.offset, chunk.size};
+    }
+
+}; // class ResidentDump
+
+/**
+ * Prepared filters by expression, so that they are only parsed and
+ * prepared once. The least recently used filters are dropped if there are
+ * more than max_size. Filters with location predicates collect state
+ * from the input while running, they are not cached and not shared.
+ */
+class FilterCache {
+
+    using entry_type = std::pair<std::string, std::shared_ptr<const OSMObjectFilter>>;
+
+    std::mutex m_mutex;
+    std::list<entry_type> m_entries;
+    std::size_t m_max_size;
+
+public:
+
+    explicit FilterCache(std::size_t max_size) :
+        m_max_size(max_size) {
+    }
+
+    std::shared_ptr<const OSMObjectFilter> get(const std::string& expression) {
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            const auto it = std::find_if(m_entries.begin(), m_entries.end(), [&](const entry_type& entry) {
+                return entry.first == expression;
+            });
+            if (it != m_entries.end()) {
+                m_entries.splice(m_entries.begin(), m_entries, it);
+                return it->second;
+            }
+        }
+
+        // Preparing can take a long time, don't block other requests.
+        std::shared_ptr<OSMObjectFilter> filter{new OSMObjectFilter{expression}};
+
+        // Clients must not make the server read its files.
+        if (!filter->input_files().empty()) {
+            throw std::runtime_error{"Expressions can not read files in serve mode"};
+        }
+
+        filter->prepare();
+
+        if (filter->has_location_predicates() || m_max_size == 0) {
+            return filter;
+        }
+
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_entries.emplace_front(expression, filter);
+        if (m_entries.size() > m_max_size) {
+            m_entries.pop_back();
+        }
+
+        return filter;
+    }
+
+}; // class FilterCache
+
+class request_cancelled : public std::runtime_error {
+
+public:
+
+    request_cancelled() :
+        std::runtime_error("Request cancelled") {
+    }
+
+}; // class request_cancelled
+
+/**
+ * A client connection. Requests are read line by line, results are
+ * written back unbuffered. The client can cancel a running request by
+ * sending a line "cancel" or by closing the connection.
+ */
+class Connection {
+
+    int m_fd;
+    std::string m_input;
+    bool m_eof = false;
+
+public:
+
+    explicit Connection(int fd) :
+        m_fd(fd) {
+    }
+
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    ~Connection() {
+        ::close(m_fd);
+    }
+
+    // Read the next line (without the newline). Returns false at the
+    // end of the input.
+    bool read_line(std::string& line) {
+        while (true) {
+            const auto pos = m_input.find('\n');
+            if (pos != std::string::npos) {
+                line = m_input.substr(0, pos);
+                m_input.erase(0, pos + 1);
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                return true;
+            }
+            if (m_eof) {
+                return false;
+            }
+
+            char buffer[4096];
+            const auto result = ::read(m_fd, buffer, sizeof(buffer));
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error{errno, std::system_category(), "Read from client failed"};
+            }
+            if (result == 0) {
+                m_eof = true;
+                if (m_input.empty()) {
+                    return false;
+                }
+                m_input.push_back('\n');
+            } else {
+                m_input.append(buffer, static_cast<std::size_t>(result));
+            }
+        }
+    }
+
+    void write(const std::string& data) {
+        const char* ptr = data.data();
+        std::size_t size = data.size();
+        while (size > 0) {
+            const auto result = ::send(m_fd, ptr, size, MSG_NOSIGNAL);
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // The client is gone.
+                throw request_cancelled{};
+            }
+            ptr += result;
+            size -= static_cast<std::size_t>(result);
+        }
+    }
+
+    // Has the client cancelled the request? This doesn't block. If the
+    // client only shut down its sending side that is not a cancellation.
+    bool cancelled() {
+        pollfd pfd;
+        pfd.fd = m_fd;
+        pfd.events = m_eof ? 0 : POLLIN;
+        pfd.revents = 0;
+        if (::poll(&pfd, 1, 0) <= 0) {
+            return false;
+        }
+        if (pfd.revents & (POLLHUP | POLLERR)) {
+            return true;
+        }
+        if (pfd.revents & POLLIN) {
+            while (m_input.find('\n') == std::string::npos && !m_eof) {
+                char buffer[4096];
+                const auto result = ::recv(m_fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+                if (result <= 0) {
+                    m_eof = (result == 0);
+                    break;
+                }
+                m_input.append(buffer, static_cast<std::size_t>(result));
+            }
+            return m_input.compare(0, 6, "cancel") == 0;
+        }
+        return false;
+    }
+
+}; // class Connection
+
+struct filter_request {
+    std::string expression;
+    std::string output_filename;
+    std::string output_format;
+};
+
+/**
+ * Read a request: lines of the form "KEYWORD VALUE" ended by an empty
+ * line or the end of the input. Several "expression" lines are joined.
+ */
+bool read_request(Connection& connection, filter_request& request) {
+    std::string line;
+    bool got_something = false;
+    while (connection.read_line(line)) {
+        if (line.empty()) {
+            if (got_something) {
+                break;
+            }
+            continue;
+        }
+        got_something = true;
+
+        const auto pos = line.find(' ');
+        const std::string keyword = line.substr(0, pos);
+        const std::string value = pos == std::string::npos ? std::string{} : line.substr(pos + 1);
+
+        if (keyword == "expression") {
+            if (!request.expression.empty()) {
+                request.expression += '\n';
+            }
+            request.expression += value;
+        } else if (keyword == "output") {
+            request.output_filename = value;
+        } else if (keyword == "format") {
+            request.output_format = value;
+        } else {
+            throw std::runtime_error{"Unknown keyword '" + keyword + "'"};
+        }
+    }
+
+    return got_something;
+}
+
+/**
+ * The path of the output file named in a request. Clients can only write
+ * below output_dir: absolute names and names with ".." are rejected.
+ */
+std::string output_path(const std::string& output_dir, const std::string& filename) {
+    if (output_dir.empty()) {
+        throw std::runtime_error{"Output files not allowed (server has no --output-dir)"};
+    }
+    if (filename == "-" || filename.front() == '/') {
+        throw std::runtime_error{"Invalid output file name '" + filename + "'"};
+    }
+
+    std::string::size_type start = 0;
+    while (start <= filename.size()) {
+        auto end = filename.find('/', start);
+        if (end == std::string::npos) {
+            end = filename.size();
+        }
+        if (filename.compare(start, end - start, "..") == 0) {
+            throw std::runtime_error{"Invalid output file name '" + filename + "'"};
+        }
+        start = end + 1;
+    }
+
+    return output_dir + "/" + filename;
+}
+
+class FilterServer {
+
+    const ResidentDump& m_dump;
+    FilterCache m_cache;
+    std::string m_output_dir;
+    bool m_verbose;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<int> m_queue;
+    std::vector<int> m_active;
+    std::vector<std::thread> m_threads;
+    bool m_shutdown = false;
+
+    void run_request(Connection& connection, const filter_request& request) {
+        if (request.expression.empty()) {
+            throw std::runtime_error{"Missing expression"};
+        }
+
+        const auto filter = m_cache.get(request.expression);
+        const auto& chunks = m_dump.chunks();
+
+        if (filter->has_location_predicates()) {
+            for (const auto& chunk : chunks) {
+                if (connection.cancelled()) {
+                    throw request_cancelled{};
+                }
+                const auto buffer = m_dump.buffer(chunk);
+                for (const auto& object : buffer.select<osmium::OSMObject>()) {
+                    if (object.type() == osmium::item_type::node || object.type() == osmium::item_type::way) {
+                        filter->collect(object);
+                    }
+                }
+            }
+        }
+
+        std::unique_ptr<OutputWriter> writer;
+        if (!request.output_filename.empty()) {
+            writer.reset(new OutputWriter{output_path(m_output_dir, request.output_filename), request.output_format});
+        }
+
+        const auto entities = filter->entities();
+        const auto id_range = filter->id_range();
+        const auto timestamp_range = filter->timestamp_range();
+
+        std::uint64_t count = 0;
+        std::string ids;
+        for (const auto& chunk : chunks) {
+            if (!(chunk.entities() & entities) ||
+                !chunk.contains_ids(id_range.first, id_range.second) ||
+                !chunk.contains_timestamps(timestamp_range.first, timestamp_range.second)) {
+                continue;
+            }
+            if (connection.cancelled()) {
+                throw request_cancelled{};
+            }
+            const auto buffer = m_dump.buffer(chunk);
+            for (const auto& object : buffer.select<osmium::OSMObject>()) {
+                if (filter->match(object)) {
+                    ++count;
+                    if (writer) {
+                        (*writer)(object);
+                    } else {
+                        ids += osmium::item_type_to_char(object.type());
+                        ids += std::to_string(object.id());
+                        ids += '\n';
+                    }
+                }
+            }
+            if (!ids.empty()) {
+                connection.write(ids);
+                ids.clear();
+            }
+        }
+
+        if (writer) {
+            writer->close();
+        }
+
+        connection.write("OK " + std::to_string(count) + "\n");
+    }
+
+    void handle(Connection& connection) {
+        while (true) {
+            filter_request request;
+            std::string error;
+            try {
+                if (!read_request(connection, request)) {
+                    return;
+                }
+                if (m_verbose) {
+                    std::cerr << "Request: " << request.expression << "\n";
+                }
+                run_request(connection, request);
+            } catch (const request_cancelled&) {
+                if (m_verbose) {
+                    std::cerr << "Request cancelled\n";
+                }
+                return;
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+            if (!error.empty()) {
+                connection.write("ERROR " + error + "\n");
+            }
+        }
+    }
+
+    void worker() {
+        while (true) {
+            int fd;
+            {
+                std::unique_lock<std::mutex> lock{m_mutex};
+                m_cv.wait(lock, [this] { return m_shutdown || !m_queue.empty(); });
+                if (m_shutdown) {
+                    return;
+                }
+                fd = m_queue.front();
+                m_queue.pop_front();
+                m_active.push_back(fd);
+            }
+            Connection connection{fd};
+            try {
+                handle(connection);
+            } catch (const request_cancelled&) {
+                // The client went away while we were sending an error.
+            } catch (const std::exception& e) {
+                std::cerr << "Error: " << e.what() << "\n";
+            }
+            // Unregister before the connection closes the fd, so the
+            // destructor never shuts down an fd number that was reused.
+            std::lock_guard<std::mutex> lock{m_mutex};
+            m_active.erase(std::find(m_active.begin(), m_active.end(), fd));
+        }
+    }
+
+public:
+
+    FilterServer(const ResidentDump& dump, std::size_t cache_size, const std::string& output_dir, bool verbose) :
+        m_dump(dump),
+        m_cache(cache_size),
+        m_output_dir(output_dir),
+        m_verbose(verbose) {
+    }
+
+    FilterServer(const FilterServer&) = delete;
+    FilterServer& operator=(const FilterServer&) = delete;
+
+    // Stop the workers: connections being served are shut down, waiting
+    // ones are closed.
+    ~FilterServer() {
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            m_shutdown = true;
+            for (const int fd : m_active) {
+                ::shutdown(fd, SHUT_RDWR);
+            }
+            for (const int fd : m_queue) {
+                ::close(fd);
+            }
+            m_queue.clear();
+        }
+        m_cv.notify_all();
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    // Accept connections on the socket until accept() fails. At most
+    // max_requests connections are served at the same time, others wait.
+    void run(int socket_fd, unsigned max_requests) {
+        for (unsigned i = 0; i < max_requests; ++i) {
+            m_threads.emplace_back(&FilterServer::worker, this);
+        }
+
+        while (true) {
+            const int fd = ::accept(socket_fd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                throw std::system_error{errno, std::system_category(), "Accept failed"};
+            }
+            {
+                std::lock_guard<std::mutex> lock{m_mutex};
+                m_queue.push_back(fd);
+            }
+            m_cv.notify_one();
+        }
+    }
+
+}; // class FilterServer
+
+int open_socket(const std::string& path) {
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error{"Socket path too long: '" + path + "'"};
+    }
+    std::strcpy(address.sun_path, path.c_str());
+
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw std::system_error{errno, std::system_category(), "Can not create socket"};
+    }
+
+    ::unlink(path.c_str());
+    if (::bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+        throw std::system_error{errno, std::system_category(), "Can not bind socket '" + path + "'"};
+    }
+
+    if (::listen(fd, 64) != 0) {
+        throw std::system_error{errno, std::system_category(), "Can not listen on socket '" + path + "'"};
+    }
+
+    return fd;
+}
+
+void print_help(const po::options_description& desc) {
+    std::cout << "osmium-filter serve [OPTIONS] DUMP-FILE\n\n"
+              << "Keep the dump in memory and answer filter requests on a Unix domain socket.\n"
+              << "A request consists of lines \"expression EXPR\", \"output FILENAME\" (optional),\n"
+              << "and \"format FORMAT\" (optional), ended by an empty line. Without output file\n"
+              << "the IDs of the matching objects are sent back (\"n123\", \"w456\", ...). The\n"
+              << "response ends with \"OK COUNT\" or \"ERROR MESSAGE\". Send \"cancel\" or close\n"
+              << "the connection to cancel a request.\n"
+              << "Output files are written below the --output-dir directory only, their names\n"
+              << "must be relative and must not contain \"..\". Without --output-dir, requests\n"
+              << "with output file are rejected. Expressions can not read ID lists or polygons\n"
+              << "from files.\n\n"
+              << desc << "\n";
+}
+
+} // anonymous namespace
+
+int serve(int argc, char* argv[]) {
+    po::options_description desc{"OPTIONS"};
+    desc.add_options()
+        ("help,h", "Print usage information")
+        ("verbose,v", "Enable verbose output")
+        ("socket,s", po::value<std::string>(), "Path of the Unix domain socket")
+        ("index,i", po::value<std::string>(), "Read chunk index from file (created if it doesn't exist or is out of date)")
+        ("max-requests,j", po::value<unsigned>(), "Number of requests served at the same time (default: 4)")
+        ("cache-size", po::value<std::size_t>(), "Number of prepared filters kept (default: 16)")
+        ("output-dir,d", po::value<std::string>(), "Directory for output files of requests")
+    ;
+
+    po::options_description hidden;
+    hidden.add_options()
+    ("input-filename", po::value<std::string>(), "OSM dump file")
+    ;
+
+    po::options_description parsed_options;
+    parsed_options.add(desc).add(hidden);
+
+    po::positional_options_description positional;
+    positional.add("input-filename", 1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(parsed_options).positional(positional).run(), vm);
+    po::notify(vm);
+
+    std::string input_filename;
+    std::string socket_path;
+    std::string index_filename;
+    std::string output_dir;
+    bool verbose = false;
+    unsigned max_requests = 4;
+    std::size_t cache_size = 16;
+
+    if (vm.count("help")) {
+        print_help(desc);
+        std::exit(0);
+    }
+
+    if (vm.count("verbose")) {
+        verbose = true;
+    }
+
+    if (vm.count("socket")) {
+        socket_path = vm["socket"].as<std::string>();
+    }
+
+    if (vm.count("index")) {
+        index_filename = vm["index"].as<std::string>();
+    }
+
+    if (vm.count("max-requests")) {
+        max_requests = std::max(1u, vm["max-requests"].as<unsigned>());
+    }
+
+    if (vm.count("cache-size")) {
+        cache_size = vm["cache-size"].as<std::size_t>();
+    }
+
+    if (vm.count("output-dir")) {
+        output_dir = vm["output-dir"].as<std::string>();
+        if (output_dir.empty()) {
+            std::cerr << "Empty --output-dir\n";
+            return 2;
+        }
+    }
+
+    if (vm.count("input-filename")) {
+        input_filename = vm["input-filename"].as<std::string>();
+    }
+
+    if (input_filename.empty() || socket_path.empty()) {
+        std::cerr << "Need dump file and --socket/-s\n";
+        return 2;
+    }
+
+    try {
+        const ResidentDump dump{input_filename, index_filename};
+        if (verbose) {
+            std::cerr << "Loaded " << dump.size() << " bytes in " << dump.chunks().size() << " chunks\n";
+        }
+
+        const int fd = open_socket(socket_path);
+        if (verbose) {
+            std::cerr << "Listening on " << socket_path << "\n";
+        }
+
+        FilterServer server{dump, cache_size, output_dir, verbose};
+        server.run(fd, max_requests);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
+
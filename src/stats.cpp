@@ -0,0 +1,118 @@
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <string>
+
+#include <osmium/io/any_input.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/entity_bits.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/util/progress_bar.hpp>
+
+#include "stats.hpp"
+#include "tag_stats.hpp"
+
+namespace po = boost::program_options;
+
+namespace {
+
+void print_help(const po::options_description& desc) {
+    std::cout << "osmium-filter stats [OPTIONS] INPUT-FILE\n\n"
+              << "Collect statistics about the objects and tags in the input file and write\n"
+              << "them to the output file. Use them with \"osmium-filter --stats\" to evaluate\n"
+              << "the cheapest and most selective parts of filter expressions first.\n\n"
+              << desc << "\n";
+}
+
+} // anonymous namespace
+
+int stats(int argc, char* argv[]) {
+    po::options_description desc{"OPTIONS"};
+    desc.add_options()
+        ("help,h", "Print usage information")
+        ("verbose,v", "Enable verbose output")
+        ("output,o", po::value<std::string>(), "Output file name")
+        ("max-values", po::value<std::size_t>(), "Number of most common values kept for each key (default: 64)")
+    ;
+
+    po::options_description hidden;
+    hidden.add_options()
+    ("input-filename", po::value<std::string>(), "OSM input file")
+    ;
+
+    po::options_description parsed_options;
+    parsed_options.add(desc).add(hidden);
+
+    po::positional_options_description positional;
+    positional.add("input-filename", 1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(parsed_options).positional(positional).run(), vm);
+    po::notify(vm);
+
+    std::string input_filename;
+    std::string output_filename;
+    bool verbose = false;
+    std::size_t max_values = 64;
+
+    if (vm.count("help")) {
+        print_help(desc);
+        std::exit(0);
+    }
+
+    if (vm.count("verbose")) {
+        verbose = true;
+    }
+
+    if (vm.count("output")) {
+        output_filename = vm["output"].as<std::string>();
+    }
+
+    if (vm.count("max-values")) {
+        max_values = vm["max-values"].as<std::size_t>();
+    }
+
+    if (vm.count("input-filename")) {
+        input_filename = vm["input-filename"].as<std::string>();
+    }
+
+    if (input_filename.empty() || output_filename.empty()) {
+        std::cerr << "Need input file and --output/-o\n";
+        return 2;
+    }
+
+    try {
+        TagStatsCollector collector{std::max<std::size_t>(1000, 4 * max_values), max_values};
+
+        osmium::io::Reader reader{input_filename, osmium::osm_entity_bits::nwr, osmium::io::read_meta::no};
+        osmium::ProgressBar progress_bar{reader.file_size(), true};
+        while (osmium::memory::Buffer buffer = reader.read()) {
+            progress_bar.update(reader.offset());
+            for (const auto& object : buffer.select<osmium::OSMObject>()) {
+                collector.add(object);
+            }
+        }
+        progress_bar.done();
+        reader.close();
+
+        const auto result = collector.stats();
+        result.write(output_filename);
+
+        if (verbose) {
+            for (const auto type : {osmium::item_type::node, osmium::item_type::way, osmium::item_type::relation}) {
+                std::cerr << osmium::item_type_to_name(type) << ": " << result(type).objects << " objects, "
+                          << result(type).keys.size() << " keys\n";
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
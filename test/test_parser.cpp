@@ -3,6 +3,7 @@
 #include <string>
 
 #include "object_filter.hpp"
+#include "tag_stats.hpp"
 
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
@@ -17,6 +18,17 @@ void check(const std::string& s, osmium::osm_entity_bits::type types, const std:
     REQUIRE(t.str() == tree + "\n");
 }
 
+// Position of the error in the input, -2 if it parses.
+int error_pos(const std::string& input) {
+    try {
+        OSMObjectFilter filter{input};
+    } catch (const expression_parser_error& e) {
+        REQUIRE_FALSE(e.message().empty());
+        return e.pos();
+    }
+    return -2;
+}
+
 namespace eb = osmium::osm_entity_bits;
 
 TEST_CASE("spacing and comments") {
@@ -117,3 +129,232 @@ TEST_CASE("tags without subexpression") {
     check("@tags == 0", eb::nwr, "INT_BIN_OP[equal]\n COUNT_TAGS\n  TRUE\n INT_VALUE[0]");
 }
 
+
+TEST_CASE("id range") {
+    const auto full = full_integer_range();
+
+    REQUIRE(OSMObjectFilter{"true"}.id_range() == full);
+    REQUIRE(OSMObjectFilter{"@id == 17"}.id_range() == std::make_pair(std::int64_t(17), std::int64_t(17)));
+    REQUIRE(OSMObjectFilter{"@id != 17"}.id_range() == full);
+    REQUIRE(OSMObjectFilter{"@id < 17"}.id_range() == std::make_pair(full.first, std::int64_t(16)));
+    REQUIRE(OSMObjectFilter{"17 <= @id"}.id_range() == std::make_pair(std::int64_t(17), full.second));
+    REQUIRE(OSMObjectFilter{"@id > 10 and @id <= 20"}.id_range() == std::make_pair(std::int64_t(11), std::int64_t(20)));
+    REQUIRE(OSMObjectFilter{"@id == 5 or @id in (71, 28)"}.id_range() == std::make_pair(std::int64_t(5), std::int64_t(71)));
+    REQUIRE(OSMObjectFilter{"@id == 5 or highway"}.id_range() == full);
+    REQUIRE(OSMObjectFilter{"not @id == 5"}.id_range() == full);
+    REQUIRE(OSMObjectFilter{"@version == 5"}.id_range() == full);
+}
+
+TEST_CASE("expression arena") {
+    OSMObjectFilter filter{"highway == primary or (highway == secondary and not @id == 3)"};
+
+    const auto& nodes = filter.arena().nodes();
+    REQUIRE(nodes.size() == 8);
+    REQUIRE(nodes[0].type == expr_node_type::or_expr);
+    REQUIRE(nodes[0].next == 8);
+    REQUIRE(nodes[1].type == expr_node_type::check_tag_str);
+    REQUIRE(nodes[1].next == 2);
+    REQUIRE(nodes[2].type == expr_node_type::and_expr);
+    REQUIRE(nodes[3].type == expr_node_type::check_tag_str);
+    REQUIRE(nodes[4].type == expr_node_type::not_expr);
+    REQUIRE(nodes[5].type == expr_node_type::binary_int_op);
+
+    // "highway" is only stored once
+    REQUIRE(nodes[1].str == nodes[3].str);
+    REQUIRE(filter.arena().strings().size() == std::string{"highway primary secondary "}.size());
+}
+
+TEST_CASE("string table slots in expression arena") {
+    OSMObjectFilter filter{"highway or name =~ 'foo' or @tags[@key =^ 'addr:'] > 0 or @user == 'foo'"};
+
+    const auto& nodes = filter.arena().nodes();
+    REQUIRE(nodes[1].type == expr_node_type::check_has_key);
+    REQUIRE(nodes[1].slot == 1);
+    REQUIRE(nodes[2].type == expr_node_type::check_tag_regex);
+    REQUIRE(nodes[2].slot == 2);
+    REQUIRE(nodes[5].type == expr_node_type::binary_str_op);
+    REQUIRE(nodes[5].slot == 4);
+    REQUIRE(nodes[9].type == expr_node_type::binary_str_op);
+    REQUIRE(nodes[9].slot == 0);
+    REQUIRE(filter.arena().string_slots() == 4);
+}
+
+TEST_CASE("parts of objects used by filter") {
+    const auto parts = [](const std::string& expression) {
+        return OSMObjectFilter{expression}.used_parts();
+    };
+
+    REQUIRE(parts("@way and @id < 17") == object_parts::nothing);
+    REQUIRE(parts("@way and building") == object_parts::tags);
+    REQUIRE(parts("@uid == 1 or @user == 'foo'") == object_parts::metadata);
+    REQUIRE(parts("@closed_way") == object_parts::node_refs);
+    REQUIRE(parts("@open_way and @tags[@key == 'name'] > 0") == (object_parts::node_refs | object_parts::tags));
+    REQUIRE(parts("@members[@role == 'outer'] > 0") == object_parts::members);
+}
+
+TEST_CASE("tag keys used by filter") {
+    OSMObjectFilter filter{"highway == primary or (building and name =~ 'foo') or @tags[@key == 'ref' or @key =^ 'addr:'] > 0"};
+
+    const auto keys = filter.tag_keys();
+    REQUIRE(keys.size() == 4);
+    REQUIRE(keys[0] == "highway");
+    REQUIRE(keys[1] == "building");
+    REQUIRE(keys[2] == "name");
+    REQUIRE(keys[3] == "ref");
+}
+
+TEST_CASE("optimize with statistics") {
+    TagStats stats;
+    auto& ways = stats(osmium::item_type::way);
+    ways.objects = 100;
+    auto& highway = ways.keys["highway"];
+    highway.count = 50;
+    highway.values.emplace_back("residential", 30);
+    highway.values.emplace_back("primary", 5);
+    highway.other_values = 15;
+    ways.keys["name"].count = 80;
+
+    const auto optimized = [&stats](const std::string& expression) {
+        OSMObjectFilter filter{expression};
+        filter.optimize(stats);
+        std::stringstream t;
+        filter.print_tree(t);
+        return t.str();
+    };
+
+    // "and": the most selective first, the type check is always true for ways
+    REQUIRE(optimized("@way and name and highway == primary") ==
+            "BOOL_AND\n CHECK_TAG[highway][equal][primary]\n HAS_KEY[name]\n BOOL_ATTR[way]\n");
+
+    // "or": the most likely first
+    REQUIRE(optimized("@way and (highway == primary or highway == residential)") ==
+            "BOOL_AND\n BOOL_OR\n  CHECK_TAG[highway][equal][residential]\n  CHECK_TAG[highway][equal][primary]\n BOOL_ATTR[way]\n");
+
+    // long ID lists are looked up in a set
+    OSMObjectFilter filter{"@way and @id in (1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12)"};
+    const auto& list = *static_cast<const InIntegerList*>(static_cast<const WithSubExpr*>(filter.root())->children()[1].get());
+    REQUIRE(list.linear_size() == 12);
+    filter.optimize(stats);
+    REQUIRE(list.linear_size() == 0);
+    REQUIRE(dynamic_cast<const osmium::index::IdSetDense<std::uint64_t>*>(list.values()));
+
+    // negative and far apart IDs are not put in a dense set
+    OSMObjectFilter sparse{"@way and @id in (-1, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 10000000000)"};
+    const auto& sparse_list = *static_cast<const InIntegerList*>(static_cast<const WithSubExpr*>(sparse.root())->children()[1].get());
+    sparse.optimize(stats);
+    REQUIRE(sparse_list.linear_size() == 0);
+    REQUIRE(dynamic_cast<const SortedIdSet*>(sparse_list.values()));
+    REQUIRE(sparse_list.values()->get(std::uint64_t(-1)));
+    REQUIRE(sparse_list.values()->get(10000000000));
+    REQUIRE_FALSE(sparse_list.values()->get(11));
+}
+
+TEST_CASE("match raw objects") {
+    const char* strings[] = {"", "highway", "primary", "name", "Main Street", "alice"};
+    const std::uint32_t tags[] = {1, 2, 3, 4};
+    const std::int64_t refs[] = {10, 11, 10};
+
+    const auto match = [&](const std::string& expression) {
+        OSMObjectFilter filter{expression};
+        filter.prepare();
+
+        StringTableMatcher matcher;
+        matcher.reset(strings, 6, filter.arena().string_slots());
+
+        raw_object object;
+        object.type = osmium::item_type::way;
+        object.id = 17;
+        object.user = strings[5];
+        object.tags = tags;
+        object.tags_end = tags + 4;
+        object.refs = refs;
+        object.refs_end = refs + 3;
+        object.matcher = &matcher;
+        return filter.match(object);
+    };
+
+    REQUIRE(match("highway"));
+    REQUIRE_FALSE(match("building"));
+    REQUIRE(match("highway == primary"));
+    REQUIRE_FALSE(match("highway != primary"));
+    REQUIRE(match("name =~ 'main'i"));
+    REQUIRE_FALSE(match("name !~ 'Main'"));
+    REQUIRE(match("@tags[@key =^ 'na'] == 1"));
+    REQUIRE(match("@way and @closed_way and @id == 17"));
+    REQUIRE_FALSE(match("@node"));
+    REQUIRE(match("@user == alice"));
+}
+
+TEST_CASE("timestamps") {
+    check("@timestamp > 2016-01-01", eb::nwr, "INT_BIN_OP[greater_than]\n INT_ATTR[timestamp]\n INT_VALUE[1451606400]");
+    check("@timestamp <= 2016-01-01T12:30:00Z", eb::nwr, "INT_BIN_OP[less_or_equal]\n INT_ATTR[timestamp]\n INT_VALUE[1451651400]");
+    check("@timestamp in (2016-01-01, 2016-01-02)", eb::nwr, "IN_INT_LIST[in]\n INT_ATTR[timestamp]\n VALUES[1451606400, 1451692800]");
+    check("@timestamp in (2016-01-01:2016-01-02)", eb::nwr, "IN_INT_RANGES[in]\n INT_ATTR[timestamp]\n RANGES[1451606400:1451692800]");
+    check("@id not in (1, 3:5, 4:8)", eb::nwr, "IN_INT_RANGES[not_in]\n INT_ATTR[id]\n RANGES[1:1, 3:8]");
+
+    REQUIRE(OSMObjectFilter{"@timestamp >= 2016-01-01 and @timestamp < 2016-01-02"}.timestamp_range() == std::make_pair(std::int64_t(1451606400), std::int64_t(1451692799)));
+    REQUIRE(OSMObjectFilter{"@timestamp in (10:20, 30:40)"}.timestamp_range() == std::make_pair(std::int64_t(10), std::int64_t(40)));
+    REQUIRE(OSMObjectFilter{"@id in (10:20)"}.timestamp_range() == full_integer_range());
+    REQUIRE_THROWS(OSMObjectFilter{"@timestamp > 2016-13-01"});
+}
+
+TEST_CASE("location in bounding box") {
+    check("@location in bbox(13.0, 52.0, 14.5, 53.25)", eb::nwr, "LOCATION_IN_BOX[in][13,52,14.5,53.25]");
+    check("@location not in bbox(-10,-20,10,20)", eb::nwr, "LOCATION_IN_BOX[not_in][-10,-20,10,20]");
+    check("@way and @location in bbox(13, 52, 14, 53)", eb::way, "BOOL_AND\n BOOL_ATTR[way]\n LOCATION_IN_BOX[in][13,52,14,53]");
+
+    REQUIRE(OSMObjectFilter{"@way and @location in bbox(13, 52, 14, 53)"}.input_entities() == (eb::node | eb::way));
+    REQUIRE(OSMObjectFilter{"@way"}.input_entities() == eb::way);
+    REQUIRE_THROWS_AS(OSMObjectFilter{"@location in bbox(14, 52, 13, 53)"}, expression_parser_error);
+    REQUIRE_THROWS_AS(OSMObjectFilter{"@location in bbox(13, 52, 14, 93)"}, expression_parser_error);
+}
+
+TEST_CASE("location in polygon") {
+    check("@location in polygon(<'germany.poly')", eb::nwr, "LOCATION_IN_POLYGON[in][germany.poly]");
+    check("highway and @location not in polygon(<\"foo.poly\")", eb::nwr, "BOOL_AND\n HAS_KEY[highway]\n LOCATION_IN_POLYGON[not_in][foo.poly]");
+
+    const OSMObjectFilter filter{"@location in polygon(<'a.poly') or @id in (<'ids') or @id in (1, 2)"};
+    REQUIRE(filter.input_files().size() == 2);
+    REQUIRE(filter.input_files()[0] == "a.poly");
+    REQUIRE(filter.input_files()[1] == "ids");
+    REQUIRE(OSMObjectFilter{"@id in (1, 2)"}.input_files().empty());
+
+    std::istringstream input{"test\n1\n 0 0\n 10 0\n 10 10\n 0 10\nEND\n!2\n 4 4\n 6 4\n 6 6\n 4 6\nEND\nEND\n"};
+    const PolygonIndex polygon{input};
+    REQUIRE(polygon.contains(osmium::Location{1.0, 1.0}));
+    REQUIRE(polygon.contains(osmium::Location{9.5, 5.0}));
+    REQUIRE_FALSE(polygon.contains(osmium::Location{5.0, 5.0}));
+    REQUIRE_FALSE(polygon.contains(osmium::Location{11.0, 5.0}));
+    REQUIRE_FALSE(polygon.contains(osmium::Location{-0.5, -0.5}));
+}
+
+TEST_CASE("type checking") {
+    REQUIRE(error_pos("@tags[@way] > 0") == 6);
+    REQUIRE(error_pos("@ref == 1") == 0);
+    REQUIRE(error_pos("@way and @members[highway] > 0") == 18);
+    REQUIRE(error_pos("@members[@key == 'x'] > 0") == 9);
+    REQUIRE(error_pos("@members[@ref in (1, 2)] > 0") == 9);
+    REQUIRE(error_pos("@tags[@tags > 1] > 0") == 6);
+    REQUIRE(error_pos("@tags[@user == 'x'] > 0") == 6);
+
+    const OSMObjectFilter filter{"@way and @members[@ref == 17] > 0 and @tags[@key =~ '^name'] > 0"};
+    REQUIRE(filter.root()->static_type() == expr_value_type::boolean);
+    REQUIRE(filter.root()->context() == eval_context::object);
+    REQUIRE(OSMObjectFilter{"  # comment\n@members[@role == inner] > 1"}.root()->position() == 12);
+}
+
+TEST_CASE("keywords and syntax errors") {
+    check("notable", eb::nwr, "HAS_KEY[notable]");
+    check("android or order", eb::nwr, "BOOL_OR\n HAS_KEY[android]\n HAS_KEY[order]");
+    check("@nodes > 2", eb::way, "INT_BIN_OP[greater_than]\n COUNT_NODES\n  TRUE\n INT_VALUE[2]");
+
+    REQUIRE(error_pos("(highway") == 8);
+    REQUIRE(error_pos("highway ==") == 10);
+    REQUIRE(error_pos("@foo") == 0);
+    REQUIRE(error_pos("@id in ()") == 8);
+    REQUIRE(error_pos("@id == 99999999999999999999") == 7);
+    REQUIRE(error_pos("name == 'foo") == 8);
+    REQUIRE(error_pos("highway foo") == 8);
+    REQUIRE(error_pos("@timestamp > 2016-13-01") == 13);
+    REQUIRE(error_pos("@id in (1, 9:8)") == 11);
+}